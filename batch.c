@@ -0,0 +1,516 @@
+#include "batch.h"
+#include "pipeline.h"
+#include "function.h"
+#include "pool.h"
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Files ahead of the one being read that are prefetched
+#define BATCH_READ_AHEAD 4
+
+// Room in each queue beyond one image per compute thread
+#define BATCH_QUEUE_SLACK 2
+
+const char *const batch_samples[BATCH_SAMPLES] = {
+    "samples/easy", "samples/medium", "samples/hard", "samples/impossible"
+};
+
+// Growable string for building result lines
+typedef struct batch_text {
+    char *data;
+    size_t length;
+    size_t size;
+    int failed;             // the string could not grow, so it is incomplete
+} batch_text;
+
+// An image on its way through the reader, compute and writer stages
+typedef struct batch_item {
+    int index;
+    bmp_status status;
+    bmp_file file;          // mapped input, streamed by compute and copied by the writer
+    cell *cells;            // copy of the cells found
+    int count;
+    double seconds;         // time spent detecting
+} batch_item;
+
+// Bounded blocking queue between two stages
+typedef struct batch_queue {
+    batch_item **items;
+    int capacity;
+    int head;
+    int count;
+    int closed;             // no more items will be pushed
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} batch_queue;
+
+typedef struct batch_job {
+    const batch_options *options;
+    char **paths;
+    int count;
+    batch_queue opened;     // reader to compute
+    batch_queue detected;   // compute to writer
+    char **lines;           // result line of each image, until it is printed
+    int read;               // images the reader handed on, count unless it ran out of memory
+    int failed;             // only touched by the writer
+} batch_job;
+
+// Stands in for the result line of an image when there was no memory for it
+static char _no_line[] = "";
+
+static void _append(batch_text *text, const char *format, ...) {
+    while (!text->failed) {
+        va_list args;
+        va_start(args, format);
+        int needed = vsnprintf(text->data + text->length, text->size - text->length, format, args);
+        va_end(args);
+        if (needed < 0) {
+            return;
+        }
+        if (text->length + (size_t) needed < text->size) {
+            text->length += (size_t) needed;
+            return;
+        }
+        size_t size = text->size == 0 ? 256 : text->size;
+        while (size <= text->length + (size_t) needed) {
+            size *= 2;
+        }
+        char *data = (char *) realloc(text->data, size);
+        if (data == NULL) {
+            text->failed = 1;
+            return;
+        }
+        text->data = data;
+        text->size = size;
+    }
+}
+
+// Writes s as a quoted CSV or JSON string
+static void _append_string(batch_text *text, const char *s, batch_format format) {
+    _append(text, "\"");
+    for (; *s != '\0'; s++) {
+        if (*s == '"') {
+            _append(text, format == BATCH_CSV ? "\"\"" : "\\\"");
+        } else if (format == BATCH_JSON && *s == '\\') {
+            _append(text, "\\\\");
+        } else if (format == BATCH_JSON && (unsigned char) *s < 0x20) {
+            _append(text, "\\u%04x", (unsigned char) *s);
+        } else {
+            _append(text, "%c", *s);
+        }
+    }
+    _append(text, "\"");
+}
+
+// Returns 0, or -1 if there was no memory for the path
+static int _add_path(batch_paths *list, const char *dir, const char *name) {
+    if (list->count == list->size) {
+        int size = list->size == 0 ? 64 : 2 * list->size;
+        char **paths = (char **) realloc(list->paths, (size_t) size * sizeof(char *));
+        if (paths == NULL) {
+            return -1;
+        }
+        list->paths = paths;
+        list->size = size;
+    }
+    size_t length = strlen(name) + (dir != NULL ? strlen(dir) + 1 : 0) + 1;
+    char *path = (char *) malloc(length);
+    if (path == NULL) {
+        return -1;
+    }
+    if (dir != NULL) {
+        size_t n = strlen(dir);
+        // Avoid a double separator for arguments like samples/easy/
+        snprintf(path, length, "%s%s%s", dir, n > 0 && dir[n - 1] == '/' ? "" : "/", name);
+    } else {
+        snprintf(path, length, "%s", name);
+    }
+    list->paths[list->count++] = path;
+    return 0;
+}
+
+static int _compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// Tells if a file in a directory is an input, a BMP or PGM file
+static int _is_input(const char *name) {
+    size_t n = strlen(name);
+    if (n < 4 || name[n - 4] != '.') {
+        return 0;
+    }
+    const char *ext = name + n - 3;
+    char lower[4] = {0};
+    for (int i = 0; i < 3; i++) {
+        lower[i] = ext[i] >= 'A' && ext[i] <= 'Z' ? (char) (ext[i] - 'A' + 'a') : ext[i];
+    }
+    return strcmp(lower, "bmp") == 0 || strcmp(lower, "pgm") == 0;
+}
+
+/**
+ * \brief Adds an input to the list: a file as is, or the BMP files of a directory in name order.
+ *
+ * \param list The list to add to, starting out as {NULL, 0, 0}.
+ * \param input Path of a file or a directory.
+ * \return 0 on success, -1 if the input does not exist, -2 if there was no memory for the list.
+ */
+int batch_collect(batch_paths *list, const char *input) {
+    struct stat st;
+    if (stat(input, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return _add_path(list, NULL, input) == 0 ? 0 : -2;
+    }
+    DIR *dir = opendir(input);
+    if (dir == NULL) {
+        return -1;
+    }
+    int first = list->count;
+    int status = 0;
+    struct dirent *entry;
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        if (_is_input(entry->d_name) && _add_path(list, input, entry->d_name) != 0) {
+            status = -2;
+        }
+    }
+    closedir(dir);
+    if (list->count > first) {
+        qsort(list->paths + first, (size_t) (list->count - first), sizeof(char *), _compare_paths);
+    }
+    return status;
+}
+
+void batch_paths_free(batch_paths *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    list->paths = NULL;
+    list->count = 0;
+    list->size = 0;
+}
+
+// Returns NULL if there was no memory for the path
+static char *_output_path(const char *dir, const char *input) {
+    const char *name = strrchr(input, '/');
+    name = name == NULL ? input : name + 1;
+    size_t length = strlen(dir) + strlen(name) + 2;
+    char *path = (char *) malloc(length);
+    if (path == NULL) {
+        return NULL;
+    }
+    snprintf(path, length, "%s/%s", dir, name);
+    return path;
+}
+
+// Returns NULL if there was no memory for the line
+static char *_result_line(const char *path, bmp_status status, const cell *cells, int count, double seconds,
+                          batch_format format) {
+    batch_text text = {NULL, 0, 0, 0};
+    if (format == BATCH_JSON) {
+        _append(&text, "{\"path\": ");
+        _append_string(&text, path, format);
+        if (status != BMP_OK) {
+            _append(&text, ", \"error\": ");
+            _append_string(&text, bmp_strerror(status), format);
+        } else {
+            _append(&text, ", \"count\": %d, \"seconds\": %.6f, \"cells\": [", count, seconds);
+            for (int i = 0; i < count; i++) {
+                _append(&text, "%s[%d, %d]", i == 0 ? "" : ", ", cells[i].x, cells[i].y);
+            }
+            _append(&text, "]");
+        }
+        _append(&text, "}\n");
+    } else {
+        _append_string(&text, path, format);
+        if (status != BMP_OK) {
+            _append(&text, ",-1,%.6f,", seconds);
+            _append_string(&text, bmp_strerror(status), format);
+        } else {
+            // Coordinates go in one field as "x:y" pairs separated by spaces
+            _append(&text, ",%d,%.6f,\"", count, seconds);
+            for (int i = 0; i < count; i++) {
+                _append(&text, "%s%d:%d", i == 0 ? "" : " ", cells[i].x, cells[i].y);
+            }
+            _append(&text, "\"");
+        }
+        _append(&text, "\n");
+    }
+    if (text.failed) {
+        free(text.data);
+        return NULL;
+    }
+    return text.data;
+}
+
+static int _queue_init(batch_queue *queue, int capacity) {
+    memset(queue, 0, sizeof(*queue));
+    queue->items = (batch_item **) calloc((size_t) capacity, sizeof(batch_item *));
+    if (queue->items == NULL) {
+        return -1;
+    }
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+// Also takes a queue _queue_init() failed on, or one that is still zeroed
+static void _queue_free(batch_queue *queue) {
+    if (queue->items == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->items);
+}
+
+// Waits while the queue is full
+static void _queue_push(batch_queue *queue, batch_item *item) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Waits for an item, returns NULL once the queue is closed and empty
+static batch_item *_queue_pop(batch_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    batch_item *item = NULL;
+    if (queue->count > 0) {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+static void _queue_close(batch_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * \brief Reader stage: opens the images in list order.
+ *
+ * The files BATCH_READ_AHEAD places further down the list are handed to
+ * bmp_prefetch(), so their reads are under way before they are needed.
+ * Without memory for the next image the reader stops, leaving job->read
+ * short of job->count.
+ */
+static void *_reader(void *arg) {
+    batch_job *job = (batch_job *) arg;
+    int prefetched = 0;
+    for (; job->read < job->count; job->read++) {
+        int i = job->read;
+        for (; prefetched < job->count && prefetched <= i + BATCH_READ_AHEAD; prefetched++) {
+            bmp_prefetch(job->paths[prefetched]);
+        }
+        batch_item *item = (batch_item *) calloc(1, sizeof(batch_item));
+        if (item == NULL) {
+            break;
+        }
+        item->index = i;
+        item->status = bmp_open(job->paths[i], &item->file);
+        _queue_push(&job->opened, item);
+    }
+    _queue_close(&job->opened);
+    return NULL;
+}
+
+/**
+ * \brief Compute stage: detects the cells of one opened image at a time per thread.
+ */
+static void _compute_task(void *arg, int index, int count) {
+    batch_job *job = (batch_job *) arg;
+    (void) index;
+    (void) count;
+    pipeline p;
+    pipeline_init(&p);
+    p.mode = job->options->mode;
+    p.threshold_mode = job->options->threshold;
+
+    batch_item *item;
+    while ((item = _queue_pop(&job->opened)) != NULL) {
+        if (item->status == BMP_OK) {
+            double begin = pipeline_clock();
+            item->status = pipeline_detect_file(&p, &item->file, NULL);
+            if (item->status == BMP_OK) {
+                item->count = p.cells.count;
+                item->cells = (cell *) malloc(((size_t) p.cells.count + 1) * sizeof(cell));
+                if (item->cells == NULL) {
+                    item->status = BMP_ERR_NOMEM;
+                    item->count = 0;
+                } else {
+                    memcpy(item->cells, p.cells.cells, (size_t) p.cells.count * sizeof(cell));
+                }
+            }
+            item->seconds = pipeline_clock() - begin;
+        }
+        _queue_push(&job->detected, item);
+    }
+    pipeline_free(&p);
+}
+
+/**
+ * \brief Writer stage: writes the marked images, then prints the result lines.
+ *
+ * Lines are printed in list order, each as soon as it and all lines
+ * before it are done. An image whose line could not be built is reported
+ * on stderr instead.
+ */
+static void *_writer(void *arg) {
+    batch_job *job = (batch_job *) arg;
+    char **lines = job->lines;
+    int printed = 0;
+
+    batch_item *item;
+    while ((item = _queue_pop(&job->detected)) != NULL) {
+        const char *path = job->paths[item->index];
+        if (item->status == BMP_OK && job->options->output_dir != NULL) {
+            char *output_path = _output_path(job->options->output_dir, path);
+            item->status = output_path == NULL ? BMP_ERR_NOMEM
+                                               : pipeline_save(&item->file, item->cells, item->count, output_path);
+            free(output_path);
+        }
+        if (item->status != BMP_OK) {
+            job->failed = 1;
+        }
+        lines[item->index] = _result_line(path, item->status, item->cells, item->count, item->seconds,
+                                          job->options->format);
+        if (lines[item->index] == NULL) {
+            fprintf(stderr, "%s: %s\n", path, bmp_strerror(BMP_ERR_NOMEM));
+            lines[item->index] = _no_line;
+            job->failed = 1;
+        }
+        bmp_close(&item->file);
+        free(item->cells);
+        free(item);
+
+        for (; printed < job->count && lines[printed] != NULL; printed++) {
+            if (lines[printed] != _no_line) {
+                fputs(lines[printed], stdout);
+                free(lines[printed]);
+            }
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+/**
+ * \brief Detects the cells of many images, one image per thread at a time.
+ *
+ * Runs as three stages connected by bounded queues: one thread opens the
+ * files, the pool detects, and one thread marks and writes. While an
+ * image is being detected the next ones are read and the previous ones
+ * written, and at most a few images per stage are held in memory.
+ *
+ * Writes one CSV or JSON line per image to stdout, in input order, and a
+ * throughput summary to stderr. A file or directory that cannot be read,
+ * or an image there is no memory for, gets an error of its own and the
+ * other images are still processed.
+ *
+ * \param inputs BMP files and directories; the BMP files of a directory are taken in name order.
+ * \param count Number of inputs.
+ * \param options Number of threads, output directory and line format.
+ * \return 0 if every image was processed, 1 otherwise.
+ */
+int batch_run(char **inputs, int count, const batch_options *options) {
+    batch_paths list = {NULL, 0, 0};
+    for (int i = 0; i < count; i++) {
+        // An input that cannot be read is kept, so its open error gets a line in its place
+        int collected = batch_collect(&list, inputs[i]);
+        if (collected == -1) {
+            collected = _add_path(&list, NULL, inputs[i]);
+        }
+        if (collected != 0) {
+            fprintf(stderr, "Failed to allocate memory for the file list.\n");
+            batch_paths_free(&list);
+            return 1;
+        }
+    }
+    if (list.count == 0) {
+        fprintf(stderr, "No BMP or PGM files found.\n");
+        batch_paths_free(&list);
+        return 1;
+    }
+
+    // More threads than images would only sit idle
+    int threads = options->threads < list.count ? options->threads : list.count;
+    batch_job job;
+    memset(&job, 0, sizeof(job));
+    job.options = options;
+    job.paths = list.paths;
+    job.count = list.count;
+    job.lines = (char **) calloc((size_t) list.count, sizeof(char *));
+    worker_pool pool;
+    int ready = job.lines != NULL && _queue_init(&job.opened, threads + BATCH_QUEUE_SLACK) == 0 &&
+                _queue_init(&job.detected, threads + BATCH_QUEUE_SLACK) == 0;
+    if (!ready) {
+        fprintf(stderr, "Failed to allocate memory for the queues.\n");
+    } else if (pool_init(&pool, threads) != 0) {
+        fprintf(stderr, "Failed to start %d threads.\n", threads);
+        ready = 0;
+    }
+    if (!ready) {
+        _queue_free(&job.opened);
+        _queue_free(&job.detected);
+        free(job.lines);
+        batch_paths_free(&list);
+        return 1;
+    }
+    if (options->format == BATCH_CSV) {
+        printf("path,count,seconds,cells\n");
+    }
+
+    double begin = pipeline_clock();
+    // The writer goes first: it ends as soon as its queue is closed, the reader only once it is done
+    pthread_t reader, writer;
+    int running = pthread_create(&writer, NULL, _writer, &job) == 0;
+    if (running && pthread_create(&reader, NULL, _reader, &job) != 0) {
+        _queue_close(&job.detected);
+        pthread_join(writer, NULL);
+        running = 0;
+    }
+    if (running) {
+        pool_run(&pool, _compute_task, &job);
+        _queue_close(&job.detected);
+        pthread_join(reader, NULL);
+        pthread_join(writer, NULL);
+        double seconds = pipeline_clock() - begin;
+        fprintf(stderr, "%d image%s in %.3f seconds, %.1f images/s on %d thread%s\n", job.read,
+                job.read == 1 ? "" : "s", seconds, job.read / seconds, threads, threads == 1 ? "" : "s");
+        if (job.read < job.count) {
+            fprintf(stderr, "Failed to allocate memory for the images, %d were not read.\n", job.count - job.read);
+        }
+    } else {
+        fprintf(stderr, "Failed to start the reader and writer threads.\n");
+    }
+
+    pool_free(&pool);
+    _queue_free(&job.opened);
+    _queue_free(&job.detected);
+    free(job.lines);
+    batch_paths_free(&list);
+    return running && !job.failed && job.read == job.count ? 0 : 1;
+}
@@ -0,0 +1,35 @@
+#ifndef BATCH_BATCH_H
+#define BATCH_BATCH_H
+
+#include "detect.h"
+#include "threshold.h"
+
+typedef enum batch_format {
+    BATCH_CSV,
+    BATCH_JSON      // one JSON object per line
+} batch_format;
+
+typedef struct batch_options {
+    int threads;                // images processed at the same time
+    const char *output_dir;     // where to write the marked images, or NULL
+    batch_format format;
+    detect_mode mode;
+    threshold_mode threshold;   // how the threshold varies over each image
+} batch_options;
+
+// The sample levels, from easy to impossible
+#define BATCH_SAMPLES 4
+extern const char *const batch_samples[BATCH_SAMPLES];
+
+// Growable list of file paths
+typedef struct batch_paths {
+    char **paths;
+    int count;
+    int size;
+} batch_paths;
+
+int batch_collect(batch_paths *list, const char *input);
+void batch_paths_free(batch_paths *list);
+int batch_run(char **inputs, int count, const batch_options *options);
+
+#endif // BATCH_BATCH_H
@@ -0,0 +1,275 @@
+#include "bench.h"
+#include "pipeline.h"
+#include "pool.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Written and removed again when no output directory is given, in a
+// directory of its own under $TMPDIR or /tmp
+#define BENCH_SCRATCH "bench_scratch.bmp"
+#define BENCH_SCRATCH_DIR "bench_XXXXXX"
+
+// Room for the scratch directory and file paths
+#define BENCH_PATH 4096
+
+// Every stage, then the whole of pipeline_process()
+#define BENCH_COLUMNS (STAGE_COUNT + 1)
+
+// The images of one input and their times, one column per stage
+typedef struct bench_level {
+    char name[64];
+    batch_paths files;
+    double *times[BENCH_COLUMNS];   // files.count * runs samples each
+    int samples;
+} bench_level;
+
+/**
+ * \brief Makes the path of the scratch file, in a new directory only this run writes to.
+ *
+ * \param dir Receives the directory, to remove once done, or "" if there is none.
+ * \param path Receives the path of the scratch file.
+ * \return 0, or -1 if the directory could not be made.
+ */
+static int _scratch_make(char dir[BENCH_PATH], char path[BENCH_PATH]) {
+#ifdef _WIN32
+    dir[0] = '\0';
+    return tmpnam(path) == NULL ? -1 : 0;
+#else
+    const char *temp = getenv("TMPDIR");
+    if (temp == NULL || temp[0] == '\0') {
+        temp = "/tmp";
+    }
+    int length = snprintf(dir, BENCH_PATH, "%s/%s", temp, BENCH_SCRATCH_DIR);
+    if (length < 0 || length >= BENCH_PATH || mkdtemp(dir) == NULL) {
+        return -1;
+    }
+    snprintf(path, BENCH_PATH, "%s/%s", dir, BENCH_SCRATCH);
+    return 0;
+#endif
+}
+
+static void _scratch_remove(const char *dir, const char *path) {
+    remove(path);
+#ifndef _WIN32
+    if (dir[0] != '\0') {
+        rmdir(dir);
+    }
+#endif
+}
+
+// Last component of a path, without trailing separators
+static void _level_name(char *name, size_t size, const char *input) {
+    size_t end = strlen(input);
+    while (end > 1 && input[end - 1] == '/') {
+        end--;
+    }
+    size_t begin = end;
+    while (begin > 0 && input[begin - 1] != '/') {
+        begin--;
+    }
+    snprintf(name, size, "%.*s", (int) (end - begin), input + begin);
+}
+
+// Returns NULL if there was no memory for the path
+static char *_output_path(const char *dir, const char *input) {
+    const char *name = strrchr(input, '/');
+    name = name == NULL ? input : name + 1;
+    size_t length = strlen(dir) + strlen(name) + 2;
+    char *path = (char *) malloc(length);
+    if (path != NULL) {
+        snprintf(path, length, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+static int _compare_doubles(const void *a, const void *b) {
+    double first = *(const double *) a;
+    double second = *(const double *) b;
+    return first < second ? -1 : first > second;
+}
+
+/**
+ * \brief Sorts the samples and returns their median and 95th percentile (nearest rank).
+ */
+static void _percentiles(double *samples, int count, double *median, double *p95) {
+    qsort(samples, (size_t) count, sizeof(double), _compare_doubles);
+    *median = count % 2 == 1 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    int rank = (int) ceil(0.95 * count);
+    *p95 = samples[rank > 0 ? rank - 1 : 0];
+}
+
+// Prints a level name as a JSON string, or as a CSV field, quoted only if it has to be
+static void _print_name(const char *name, batch_format format) {
+    int quoted = format == BATCH_JSON || strpbrk(name, ",\"\r\n") != NULL;
+    if (quoted) {
+        putchar('"');
+    }
+    for (const char *s = name; *s != '\0'; s++) {
+        if (*s == '"') {
+            fputs(format == BATCH_CSV ? "\"\"" : "\\\"", stdout);
+        } else if (format == BATCH_JSON && *s == '\\') {
+            fputs("\\\\", stdout);
+        } else if (format == BATCH_JSON && (unsigned char) *s < 0x20) {
+            printf("\\u%04x", (unsigned char) *s);
+        } else {
+            putchar(*s);
+        }
+    }
+    if (quoted) {
+        putchar('"');
+    }
+}
+
+static void _report(const char *level, const char *stage, double *samples, int count, batch_format format) {
+    double median, p95;
+    _percentiles(samples, count, &median, &p95);
+    if (format == BATCH_JSON) {
+        printf("{\"level\": ");
+        _print_name(level, format);
+        printf(", \"stage\": \"%s\", \"samples\": %d, \"median_ms\": %.4f, \"p95_ms\": %.4f}\n",
+               stage, count, median * 1e3, p95 * 1e3);
+    } else {
+        _print_name(level, format);
+        printf(",%s,%d,%.4f,%.4f\n", stage, count, median * 1e3, p95 * 1e3);
+    }
+}
+
+/**
+ * \brief Runs every image of every input through the pipeline several times and reports the time per stage.
+ *
+ * Each input is a level: a directory of BMP files, such as samples/easy,
+ * or a single file. The images are first processed once without being
+ * timed, so files are cached and buffers allocated, then options->runs
+ * times over all levels in turn. Every stage is timed on a monotonic
+ * clock (see pipeline_stage), and the median and 95th percentile of each
+ * stage are printed per level and over all levels, as one CSV or JSON
+ * line each, in milliseconds.
+ *
+ * \param inputs Directories and files, or NULL to take the four levels under samples/.
+ * \param count Number of inputs.
+ * \param options Threads, number of runs, output directory, line format and detection mode.
+ * \return 0 if every image was processed, 1 otherwise.
+ */
+int bench_run(char **inputs, int count, const bench_options *options) {
+    if (inputs == NULL) {
+        inputs = (char **) batch_samples;
+        count = BATCH_SAMPLES;
+    }
+    bench_level *levels = (bench_level *) calloc((size_t) count + 1, sizeof(bench_level));
+    if (levels == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the benchmark.\n");
+        return 1;
+    }
+    // Everything below is undone by the cleanup at the end, whatever failed
+    int failed = 0;
+    int images = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        if (batch_collect(&levels[i].files, inputs[i]) != 0 || levels[i].files.count == 0) {
+            fprintf(stderr, "No BMP or PGM files found in %s\n", inputs[i]);
+            failed = 1;
+        }
+        _level_name(levels[i].name, sizeof(levels[i].name), inputs[i]);
+        images += levels[i].files.count;
+    }
+    // The last level gathers the samples of all the others
+    bench_level *all = &levels[count];
+    snprintf(all->name, sizeof(all->name), "all");
+    for (int i = 0; i <= count && !failed; i++) {
+        int samples = (i < count ? levels[i].files.count : images) * options->runs;
+        for (int c = 0; c < BENCH_COLUMNS && !failed; c++) {
+            levels[i].times[c] = (double *) malloc((size_t) samples * sizeof(double));
+            if (levels[i].times[c] == NULL) {
+                fprintf(stderr, "Failed to allocate memory for the benchmark.\n");
+                failed = 1;
+            }
+        }
+    }
+
+    char scratch_dir[BENCH_PATH] = "";
+    char scratch[BENCH_PATH] = "";
+    if (!failed && options->output_dir == NULL && _scratch_make(scratch_dir, scratch) != 0) {
+        fprintf(stderr, "Failed to make a scratch directory for the marked images.\n");
+        failed = 1;
+    }
+    worker_pool pool;
+    int pooled = 0;
+    if (!failed) {
+        pooled = pool_init(&pool, options->threads) == 0;
+        if (!pooled) {
+            fprintf(stderr, "Failed to start %d threads.\n", options->threads);
+            failed = 1;
+        }
+    }
+    pipeline p;
+    pipeline_init(&p);
+    p.mode = options->mode;
+    p.threshold_mode = options->threshold;
+
+    for (int run = -1; run < options->runs && !failed; run++) {
+        for (int i = 0; i < count && !failed; i++) {
+            bench_level *level = &levels[i];
+            for (int f = 0; f < level->files.count; f++) {
+                const char *path = level->files.paths[f];
+                char *output_path = options->output_dir == NULL ? scratch : _output_path(options->output_dir, path);
+                double begin = pipeline_clock();
+                bmp_status status = output_path == NULL ? BMP_ERR_NOMEM : pipeline_process(&p, path, output_path, &pool);
+                double total = pipeline_clock() - begin;
+                if (output_path != scratch) {
+                    free(output_path);
+                }
+                if (status != BMP_OK) {
+                    fprintf(stderr, "%s: %s\n", path, bmp_strerror(status));
+                    failed = 1;
+                    break;
+                }
+                // The first pass only warms up
+                if (run < 0) {
+                    continue;
+                }
+                for (int c = 0; c < BENCH_COLUMNS; c++) {
+                    double seconds = c < STAGE_COUNT ? p.seconds[c] : total;
+                    level->times[c][level->samples] = seconds;
+                    all->times[c][all->samples] = seconds;
+                }
+                level->samples++;
+                all->samples++;
+            }
+        }
+    }
+    if (scratch[0] != '\0') {
+        _scratch_remove(scratch_dir, scratch);
+    }
+
+    if (!failed) {
+        if (options->format == BATCH_CSV) {
+            printf("level,stage,samples,median_ms,p95_ms\n");
+        }
+        for (int i = 0; i <= count; i++) {
+            for (int c = 0; c < BENCH_COLUMNS; c++) {
+                const char *stage = c < STAGE_COUNT ? pipeline_stage_name((pipeline_stage) c) : "total";
+                _report(levels[i].name, stage, levels[i].times[c], levels[i].samples, options->format);
+            }
+        }
+        fprintf(stderr, "%d image%s, %d run%s each, on %d thread%s\n", images, images == 1 ? "" : "s", options->runs,
+                options->runs == 1 ? "" : "s", options->threads, options->threads == 1 ? "" : "s");
+    }
+
+    pipeline_free(&p);
+    if (pooled) {
+        pool_free(&pool);
+    }
+    for (int i = 0; i <= count; i++) {
+        batch_paths_free(&levels[i].files);
+        for (int c = 0; c < BENCH_COLUMNS; c++) {
+            free(levels[i].times[c]);
+        }
+    }
+    free(levels);
+    return failed;
+}
@@ -0,0 +1,18 @@
+#ifndef BENCH_BENCH_H
+#define BENCH_BENCH_H
+
+#include "batch.h"
+#include "detect.h"
+
+typedef struct bench_options {
+    int threads;                // threads each stage is split across
+    int runs;                   // times every image is processed
+    const char *output_dir;     // where to write the marked images, or NULL for a scratch file under $TMPDIR
+    batch_format format;
+    detect_mode mode;
+    threshold_mode threshold;
+} bench_options;
+
+int bench_run(char **inputs, int count, const bench_options *options);
+
+#endif // BENCH_BENCH_H
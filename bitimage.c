@@ -0,0 +1,68 @@
+#include "bitimage.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * \brief Allocates an all-black bit image with zeroed guard rows and words.
+ *
+ * \return 0 on success, -1 if the size is invalid or memory ran out.
+ */
+int bitimage_alloc(bitimage *img, int width, int height) {
+    memset(img, 0, sizeof(*img));
+    if (width <= 0 || height <= 0) {
+        return -1;
+    }
+    size_t words = ((size_t) width + 63) / 64 + 2 * BITIMAGE_MARGIN_WORDS;
+    size_t rows = (size_t) height + 2 * BITIMAGE_MARGIN_ROWS;
+    uint64_t *buffer = (uint64_t *) calloc(rows * words, sizeof(uint64_t));
+    if (buffer == NULL) {
+        return -1;
+    }
+    img->width = width;
+    img->height = height;
+    img->words = (int) words;
+    img->buffer = buffer;
+    img->data = buffer + BITIMAGE_MARGIN_ROWS * words + BITIMAGE_MARGIN_WORDS;
+    return 0;
+}
+
+void bitimage_free(bitimage *img) {
+    free(img->buffer);
+    img->buffer = NULL;
+    img->data = NULL;
+}
+
+/**
+ * \brief Sets every pixel, guard area included, to black.
+ */
+void bitimage_clear(bitimage *img) {
+    size_t rows = (size_t) img->height + 2 * BITIMAGE_MARGIN_ROWS;
+    memset(img->buffer, 0, rows * (size_t) img->words * sizeof(uint64_t));
+}
+
+/**
+ * \brief Packs a single-channel image, every non-zero pixel becomes white.
+ *
+ * \param src Image with the same size as dst.
+ * \param dst The bit image to overwrite.
+ */
+void bitimage_pack(const image *src, bitimage *dst) {
+    bitimage_clear(dst);
+    for (int y = 0; y < dst->height; y++) {
+        uint64_t *row = BITIMAGE_ROW(dst, y);
+        for (int x = 0; x < dst->width; x++) {
+            row[x >> 6] |= (uint64_t) (IMAGE_AT(src, x, y) != 0) << (x & 63);
+        }
+    }
+}
+
+/**
+ * \brief Expands a bit image into a single-channel 0/255 image of the same size.
+ */
+void bitimage_unpack(const bitimage *src, image *dst) {
+    for (int y = 0; y < src->height; y++) {
+        for (int x = 0; x < src->width; x++) {
+            IMAGE_AT(dst, x, y) = BITIMAGE_GET(src, x, y) ? 255 : 0;
+        }
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef BITIMAGE_BITIMAGE_H
+#define BITIMAGE_BITIMAGE_H
+
+#include <stdint.h>
+#include "image.h"
+
+// Zeroed guard rows kept above and below, and guard words kept left and
+// right of every row, so kernels may look a few pixels past the edges
+#define BITIMAGE_MARGIN_ROWS 8
+#define BITIMAGE_MARGIN_WORDS 1
+
+/**
+ * \brief Binary image packed 64 pixels per word.
+ *
+ * Pixel x of a row is bit (x & 63) of word (x >> 6); white is 1. Bits past
+ * the width of a row are always 0.
+ */
+typedef struct bitimage {
+    int width;
+    int height;
+    int words;          // 64-bit words between the starts of two consecutive rows
+    uint64_t *data;     // word holding pixels 0..63 of row 0
+    uint64_t *buffer;   // owned allocation
+} bitimage;
+
+#define BITIMAGE_ROW(img, y) ((img)->data + (ptrdiff_t) (y) * (img)->words)
+
+// Pixel access, valid for -64 <= x < width + 64 thanks to the guard words
+#define BITIMAGE_GET(img, x, y) ((BITIMAGE_ROW(img, y)[(x) >> 6] >> ((x) & 63)) & 1)
+
+int bitimage_alloc(bitimage *img, int width, int height);
+void bitimage_free(bitimage *img);
+void bitimage_clear(bitimage *img);
+void bitimage_pack(const image *src, bitimage *dst);
+void bitimage_unpack(const bitimage *src, image *dst);
+
+/**
+ * \brief Counts the white pixels of a word.
+ */
+static inline int bitimage_popcount(uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_popcountll(bits);
+#else
+    int count = 0;
+    for (; bits != 0; bits &= bits - 1) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+/**
+ * \brief Index of the lowest white pixel of a non-zero word.
+ */
+static inline int bitimage_ctz(uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int index = 0;
+    for (; (bits & 1) == 0; bits >>= 1) {
+        index++;
+    }
+    return index;
+#endif
+}
+
+/**
+ * \brief Returns n < 64 consecutive pixels of a row starting at x, pixel x in bit 0.
+ */
+static inline uint64_t bitimage_window(const uint64_t *row, int x, int n) {
+    int w = x >> 6;
+    int b = x & 63;
+    uint64_t bits = row[w] >> b;
+    if (b + n > 64) {
+        bits |= row[w + 1] << (64 - b);
+    }
+    return bits & ((UINT64_C(1) << n) - 1);
+}
+
+/**
+ * \brief Sets n < 64 consecutive pixels of a row starting at x to black.
+ */
+static inline void bitimage_clear_span(uint64_t *row, int x, int n) {
+    int w = x >> 6;
+    int b = x & 63;
+    uint64_t mask = (UINT64_C(1) << n) - 1;
+    row[w] &= ~(mask << b);
+    if (b + n > 64) {
+        row[w + 1] &= ~(mask >> (64 - b));
+    }
+}
+
+#endif // BITIMAGE_BITIMAGE_H
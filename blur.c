@@ -0,0 +1,292 @@
+#include "blur.h"
+#include "minmax.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Build with -DBLUR_SCALAR to force the portable passes
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(BLUR_SCALAR)
+#define BLUR_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Extra lanes allocated past the end of every scratch row, so the vector
+// loops of the horizontal pass never need a scalar tail
+#define BLUR_SLACK 32
+
+const blur_kernel blur_default_kernel = {
+    {34, 59, 70, 59, 34},
+    {8675, 15051, 18084, 15051, 8675}
+};
+
+typedef void (*hpass_fn)(const unsigned char *src, unsigned short *dst, int first, int end,
+                         const unsigned short *taps);
+typedef void (*vpass_fn)(const unsigned short *const *rows, unsigned char *dst, int first, int end,
+                         const unsigned short *taps);
+
+/**
+ * \brief Rounds normalised weights to integers summing exactly to total.
+ */
+static void _quantize(const double *weights, unsigned short *taps, int total) {
+    int sum = 0;
+    for (int i = 0; i < BLUR_TAPS; i++) {
+        taps[i] = (unsigned short) lround(weights[i] * total);
+        sum += taps[i];
+    }
+    // Any rounding error goes to the centre tap
+    taps[BLUR_RADIUS] = (unsigned short) (taps[BLUR_RADIUS] + total - sum);
+}
+
+/**
+ * \brief Builds the fixed-point taps of a 5-tap Gaussian.
+ *
+ * \param kernel The kernel to fill in.
+ * \param sigma The standard deviation for the Gaussian distribution.
+ */
+void blur_make_kernel(blur_kernel *kernel, double sigma) {
+    double weights[BLUR_TAPS];
+    double sum = 0.0;
+    for (int i = -BLUR_RADIUS; i <= BLUR_RADIUS; i++) {
+        weights[i + BLUR_RADIUS] = exp(-(i * i) / (2 * sigma * sigma));
+        sum += weights[i + BLUR_RADIUS];
+    }
+    for (int i = 0; i < BLUR_TAPS; i++) {
+        weights[i] /= sum;
+    }
+    _quantize(weights, kernel->h, 256);
+    _quantize(weights, kernel->v, 65536);
+}
+
+// Scalar passes, these define the exact result the vector passes reproduce
+
+#ifndef BLUR_SIMD
+static void _hpass_scalar(const unsigned char *src, unsigned short *dst, int first, int end,
+                          const unsigned short *taps) {
+    for (int x = first; x < end; x++) {
+        unsigned int sum = 0;
+        for (int i = 0; i < BLUR_TAPS; i++) {
+            sum += taps[i] * src[x - BLUR_RADIUS + i];
+        }
+        dst[x] = (unsigned short) sum;
+    }
+}
+#endif
+
+static void _vpass_scalar(const unsigned short *const *rows, unsigned char *dst, int first, int end,
+                          const unsigned short *taps) {
+    for (int x = first; x < end; x++) {
+        // At most 65280 * 65536, the taps summing to 65536, so 32 bits hold it
+        unsigned int sum = 0;
+        for (int j = 0; j < BLUR_TAPS; j++) {
+            sum += (unsigned int) rows[j][x] * taps[j];
+        }
+        dst[x] = (unsigned char) (sum >> 24);
+    }
+}
+
+#ifdef BLUR_SIMD
+static void _hpass_sse2(const unsigned char *src, unsigned short *dst, int first, int end,
+                        const unsigned short *taps) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i k[BLUR_TAPS];
+    for (int i = 0; i < BLUR_TAPS; i++) {
+        k[i] = _mm_set1_epi16((short) taps[i]);
+    }
+    for (int x = first; x < end; x += 8) {
+        __m128i sum = zero;
+        for (int i = 0; i < BLUR_TAPS; i++) {
+            __m128i p = _mm_loadl_epi64((const __m128i *) (src + x - BLUR_RADIUS + i));
+            sum = _mm_add_epi16(sum, _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), k[i]));
+        }
+        _mm_storeu_si128((__m128i *) (dst + x), sum);
+    }
+}
+
+static void _vpass_sse2(const unsigned short *const *rows, unsigned char *dst, int first, int end,
+                        const unsigned short *taps) {
+    __m128i k[BLUR_TAPS];
+    for (int j = 0; j < BLUR_TAPS; j++) {
+        k[j] = _mm_set1_epi16((short) taps[j]);
+    }
+    int x = first;
+    for (; x + 8 <= end; x += 8) {
+        __m128i low = _mm_setzero_si128();
+        __m128i high = _mm_setzero_si128();
+        for (int j = 0; j < BLUR_TAPS; j++) {
+            __m128i h = _mm_loadu_si128((const __m128i *) (rows[j] + x));
+            __m128i product_low = _mm_mullo_epi16(h, k[j]);
+            __m128i product_high = _mm_mulhi_epu16(h, k[j]);
+            low = _mm_add_epi32(low, _mm_unpacklo_epi16(product_low, product_high));
+            high = _mm_add_epi32(high, _mm_unpackhi_epi16(product_low, product_high));
+        }
+        __m128i sum = _mm_packs_epi32(_mm_srli_epi32(low, 24), _mm_srli_epi32(high, 24));
+        _mm_storel_epi64((__m128i *) (dst + x), _mm_packus_epi16(sum, sum));
+    }
+    _vpass_scalar(rows, dst, x, end, taps);
+}
+
+__attribute__((target("avx2")))
+static void _hpass_avx2(const unsigned char *src, unsigned short *dst, int first, int end,
+                        const unsigned short *taps) {
+    __m256i k[BLUR_TAPS];
+    for (int i = 0; i < BLUR_TAPS; i++) {
+        k[i] = _mm256_set1_epi16((short) taps[i]);
+    }
+    for (int x = first; x < end; x += 16) {
+        __m256i sum = _mm256_setzero_si256();
+        for (int i = 0; i < BLUR_TAPS; i++) {
+            __m128i p = _mm_loadu_si128((const __m128i *) (src + x - BLUR_RADIUS + i));
+            sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(p), k[i]));
+        }
+        _mm256_storeu_si256((__m256i *) (dst + x), sum);
+    }
+}
+
+__attribute__((target("avx2")))
+static void _vpass_avx2(const unsigned short *const *rows, unsigned char *dst, int first, int end,
+                        const unsigned short *taps) {
+    __m256i k[BLUR_TAPS];
+    for (int j = 0; j < BLUR_TAPS; j++) {
+        k[j] = _mm256_set1_epi16((short) taps[j]);
+    }
+    int x = first;
+    for (; x + 16 <= end; x += 16) {
+        __m256i low = _mm256_setzero_si256();
+        __m256i high = _mm256_setzero_si256();
+        for (int j = 0; j < BLUR_TAPS; j++) {
+            __m256i h = _mm256_loadu_si256((const __m256i *) (rows[j] + x));
+            __m256i product_low = _mm256_mullo_epi16(h, k[j]);
+            __m256i product_high = _mm256_mulhi_epu16(h, k[j]);
+            low = _mm256_add_epi32(low, _mm256_unpacklo_epi16(product_low, product_high));
+            high = _mm256_add_epi32(high, _mm256_unpackhi_epi16(product_low, product_high));
+        }
+        // Unpacking and packing both stay within each 128-bit lane, so the pixels are back in order
+        __m256i sum = _mm256_packs_epi32(_mm256_srli_epi32(low, 24), _mm256_srli_epi32(high, 24));
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), 0x08);
+        _mm_storeu_si128((__m128i *) (dst + x), _mm256_castsi256_si128(packed));
+    }
+    _vpass_sse2(rows, dst, x, end, taps);
+}
+#endif
+
+static void _select_passes(hpass_fn *hpass, vpass_fn *vpass) {
+#ifdef BLUR_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        *hpass = _hpass_avx2;
+        *vpass = _vpass_avx2;
+    } else {
+        *hpass = _hpass_sse2;
+        *vpass = _vpass_sse2;
+    }
+#else
+    *hpass = _hpass_scalar;
+    *vpass = _vpass_scalar;
+#endif
+}
+
+/**
+ * \brief Applies a separable Gaussian blur to a single-channel image.
+ *
+ * Pixels with x, y >= BLUR_RADIUS are filtered; reads past the right and
+ * bottom edges are clamped to the last column and row, which is done once
+ * per row instead of per tap. Filtered rows are kept in a five-row ring, so
+ * the result only depends on the input pixels even when output == input.
+ *
+ * \param input The image to filter.
+ * \param output Image of the same size that receives the result, may be input.
+ * \param kernel Fixed-point taps, e.g. &blur_default_kernel.
+ * \return 0 on success, -1 if the scratch rows could not be allocated.
+ */
+int gaussian_blur(const image *input, image *output, const blur_kernel *kernel) {
+    return gaussian_blur_rows(input, output, kernel, 0, input->height);
+}
+
+static void _image_source(void *context, int y, unsigned char *row) {
+    const image *input = (const image *) context;
+    memcpy(row, &IMAGE_AT(input, 0, y), (size_t) input->width);
+}
+
+/**
+ * \brief Blurs output rows [first, end) only, see gaussian_blur().
+ *
+ * Reads input rows first - BLUR_RADIUS to end + BLUR_RADIUS, so bands of
+ * one image can be filtered concurrently as long as output != input.
+ *
+ * \return 0 on success, -1 if the scratch rows could not be allocated.
+ */
+int gaussian_blur_rows(const image *input, image *output, const blur_kernel *kernel, int first, int end) {
+    return gaussian_blur_stream(_image_source, NULL, (void *) input, output, kernel, first, end);
+}
+
+/**
+ * \brief Blurs output rows [first, end) of an image that is produced row by row.
+ *
+ * Each input row is asked from the source once, right before the horizontal
+ * pass needs it, and only the five filtered rows of the ring are kept, so
+ * the input never has to exist as a whole image. Each output row is handed
+ * to the sink, if any, while it is still in cache.
+ *
+ * \param source Writes input row y, output->width pixels, into the row it is given.
+ * \param sink Called with every output row once it is filtered, or NULL.
+ * \param context Passed to source and sink.
+ * \param output Receives the result, its size is that of the input.
+ * \param kernel Fixed-point taps, e.g. &blur_default_kernel.
+ * \param first First output row.
+ * \param end One past the last output row.
+ * \return 0 on success, -1 if the scratch rows could not be allocated.
+ */
+int gaussian_blur_stream(blur_source source, blur_sink sink, void *context, image *output,
+                         const blur_kernel *kernel, int first, int end) {
+    int width = output->width;
+    int height = output->height;
+    if (width <= BLUR_RADIUS || height <= BLUR_RADIUS) {
+        return 0;
+    }
+    first = max(first, BLUR_RADIUS);
+    end = min(end, height);
+    if (first >= end) {
+        return 0;
+    }
+
+    size_t lanes = (size_t) width + BLUR_RADIUS + BLUR_SLACK;
+    unsigned char *line = (unsigned char *) calloc(lanes, 1);
+    unsigned short *ring = (unsigned short *) calloc(BLUR_TAPS * lanes, sizeof(unsigned short));
+    if (line == NULL || ring == NULL) {
+        free(line);
+        free(ring);
+        return -1;
+    }
+
+    hpass_fn hpass;
+    vpass_fn vpass;
+    _select_passes(&hpass, &vpass);
+
+    int last = height - 1;
+    int next = first - BLUR_RADIUS;
+    for (int y = first; y < end; y++) {
+        // Run the horizontal pass up to the lowest row this output row needs
+        int needed = min(y + BLUR_RADIUS, last);
+        for (; next <= needed; next++) {
+            source(context, next, line);
+            for (int i = 0; i < BLUR_RADIUS; i++) {
+                line[width + i] = line[width - 1];
+            }
+            hpass(line, ring + (size_t) (next % BLUR_TAPS) * lanes, BLUR_RADIUS, width, kernel->h);
+        }
+
+        const unsigned short *rows[BLUR_TAPS];
+        for (int j = 0; j < BLUR_TAPS; j++) {
+            int r = min(y - BLUR_RADIUS + j, last);
+            rows[j] = ring + (size_t) (r % BLUR_TAPS) * lanes;
+        }
+        unsigned char *filtered = &IMAGE_AT(output, 0, y);
+        vpass(rows, filtered, BLUR_RADIUS, width, kernel->v);
+        if (sink != NULL) {
+            sink(context, y, filtered);
+        }
+    }
+
+    free(line);
+    free(ring);
+    return 0;
+}
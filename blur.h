@@ -0,0 +1,36 @@
+#ifndef BLUR_BLUR_H
+#define BLUR_BLUR_H
+
+#include "image.h"
+
+#define BLUR_TAPS 5
+#define BLUR_RADIUS (BLUR_TAPS / 2)
+
+/**
+ * \brief Separable 5-tap Gaussian kernel in 16-bit fixed point.
+ *
+ * The horizontal pass uses Q8 taps (sum 256), so a filtered row fits in
+ * 16 bits exactly. The vertical pass uses Q16 taps (sum 65536), summed in
+ * 32 bits and truncated like the double kernel gaussian_filter used to
+ * have, so a flat image stays flat.
+ */
+typedef struct blur_kernel {
+    unsigned short h[BLUR_TAPS];
+    unsigned short v[BLUR_TAPS];
+} blur_kernel;
+
+// Writes row y of a streamed input image into row
+typedef void (*blur_source)(void *context, int y, unsigned char *row);
+// Receives row y of the output as soon as it has been filtered
+typedef void (*blur_sink)(void *context, int y, const unsigned char *row);
+
+// Kernel for sigma = 1.65, the value gaussian_filter has always used
+extern const blur_kernel blur_default_kernel;
+
+void blur_make_kernel(blur_kernel *kernel, double sigma);
+int gaussian_blur(const image *input, image *output, const blur_kernel *kernel);
+int gaussian_blur_rows(const image *input, image *output, const blur_kernel *kernel, int first, int end);
+int gaussian_blur_stream(blur_source source, blur_sink sink, void *context, image *output,
+                         const blur_kernel *kernel, int first, int end);
+
+#endif // BLUR_BLUR_H
@@ -1,413 +1,1033 @@
-
 #include "cbmp.h"
+#include <string.h>
+
+#ifdef _WIN32
+#define CBMP_NO_MMAP
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
+
+// Pieces handed to one writev() call
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define CBMP_IOV IOV_MAX
+#else
+#define CBMP_IOV 1024
+#endif
+
+// Appended to the output path for the file bmp_write_patched() renames over it
+#define CBMP_TEMP_SUFFIX ".tmp"
 
 // Constants
 
-#define BITS_PER_BYTE 8
-
 #define BLUE 0
 #define GREEN 1
 #define RED 2
 #define ALPHA 3
 
-#define PIXEL_ARRAY_START_BYTES 4
-#define PIXEL_ARRAY_START_OFFSET 10
+#define FILE_HEADER_SIZE 14
+#define INFO_HEADER_MIN_SIZE 40
 
-#define WIDTH_BYTES 4
+#define PIXEL_ARRAY_START_OFFSET 10
+#define INFO_HEADER_SIZE_OFFSET 14
 #define WIDTH_OFFSET 18
-
-#define HEIGHT_BYTES 4
 #define HEIGHT_OFFSET 22
-
-#define DEPTH_BYTES 2
+#define PLANES_OFFSET 26
 #define DEPTH_OFFSET 28
+#define COMPRESSION_OFFSET 30
+#define IMAGE_SIZE_OFFSET 34
+#define COLOURS_USED_OFFSET 46
 
+#define COMPRESSION_RGB 0
+#define COMPRESSION_BITFIELDS 3
 
-// Pixel structure
-typedef struct pixel_data
-{
-    unsigned char red;
-    unsigned char green;
-    unsigned char blue;
-    unsigned char alpha;
-} pixel;
-
-// BMP structure
-typedef struct BMP_data
-{
-    unsigned int file_byte_number;
-    unsigned char* file_byte_contents;
-
-    unsigned int pixel_array_start;
-
-    unsigned int width;
-    unsigned int height;
-    unsigned int depth;
+// Red, green and blue masks of a BITFIELDS file, right after the first 40 bytes of the info header
+#define MASKS_OFFSET 54
+#define RED_MASK 0x00FF0000u
+#define GREEN_MASK 0x0000FF00u
+#define BLUE_MASK 0x000000FFu
 
-    pixel* pixels;
-} BMP;
-
-BMP* out_bmp = NULL;
-
-// Private (ex-public) function declarations
-BMP* bopen(char* file_path);
-BMP* b_deep_copy(BMP* to_copy);
-int get_width(BMP* bmp);
-int get_height(BMP* bmp);
-unsigned int get_depth(BMP* bmp);
-void get_pixel_rgb(BMP* bmp, int x, int y, unsigned char* r, unsigned char* g, unsigned char* b);
-void set_pixel_rgb(BMP* bmp, int x, int y, unsigned char r, unsigned char g, unsigned char b);
-void bwrite(BMP* bmp, char* file_name);
-void bclose(BMP* bmp);
+// Copy of the first file read, used as the template for write_bitmap
+static bmp_file out_bmp;
+static unsigned char* out_bytes = NULL;
 
 // Private function declarations
-void _throw_error(char* message);
-unsigned int _get_int_from_buffer(unsigned int bytes,
-                                  unsigned int offset,
-                                  unsigned char* buffer);
-unsigned int _get_file_byte_number(FILE* fp);
-unsigned char* _get_file_byte_contents(FILE* fp, unsigned int file_byte_number);
-int _validate_file_type(unsigned char* file_byte_contents);
-int _validate_depth(unsigned int depth);
-unsigned int _get_pixel_array_start(unsigned char* file_byte_contents);
-int _get_width(unsigned char* file_byte_contents);
-int _get_height(unsigned char* file_byte_contents);
-unsigned int _get_depth(unsigned char* file_byte_contents);
-void _update_file_byte_contents(BMP* bmp, int index, int offset, int channel);
-void _populate_pixel_array(BMP* bmp);
-void _map(BMP* bmp, void (*f)(BMP* bmp, int, int, int));
-void _get_pixel(BMP* bmp, int index, int offset, int channel);
+static unsigned int _read_le16(const unsigned char* buffer);
+static void _write_le32(unsigned char* buffer, unsigned int value);
+static unsigned int _read_le32(const unsigned char* buffer);
+static bmp_status _map_file(const char* file_path, bmp_file* bmp);
+static bmp_status _parse_header(bmp_file* bmp);
+static bmp_status _parse_pgm(bmp_file* bmp);
+static unsigned char _nearest_value(const bmp_file* bmp, const unsigned char* rgb);
 
 // Public function implementations
-void read_bitmap(char * input_file_path, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]){
-  // Read image into BMP struct
-  BMP* in_bmp = bopen(input_file_path);
-  int width = get_width(in_bmp);
-  int height = get_height(in_bmp);
-  if (width != BMP_WIDTH || height != BMP_HEIGTH) {
-    _throw_error("Invalid bitmap width and/or height. Must be 950x950 pixels.");
+
+/**
+ * \brief Reads a BMP file into a newly allocated RGB image of the file's size.
+ *
+ * The first file read is kept as the template that write_bitmap() fills in.
+ * That template is shared by the whole process, so these two functions are
+ * not reentrant; code that may run more than once at a time uses bmp_open()
+ * and bmp_save(), or the context of celldetect.h.
+ *
+ * \param input_file_path Path of the file to read.
+ * \param output_image Descriptor allocated and filled in on success.
+ * \return BMP_OK, or the reason the file could not be read.
+ */
+bmp_status read_bitmap(const char * input_file_path, image * output_image){
+  bmp_file bmp;
+  bmp_status status = bmp_open(input_file_path, &bmp);
+  if (status != BMP_OK) {
+    return status;
   }
-  if (out_bmp==NULL) {
-    out_bmp = b_deep_copy(in_bmp);
+  if (image_alloc(output_image, bmp.width, bmp.height, BMP_CHANNELS) != 0) {
+    bmp_close(&bmp);
+    return BMP_ERR_NOMEM;
   }
-  // Convert to RGB array
-  unsigned char r;
-  unsigned char g;
-  unsigned char b;
-  for (int x = 0; x < BMP_WIDTH; x++)
-  {
-      for (int y = 0; y < BMP_HEIGTH; y++)
-      {
-          get_pixel_rgb(in_bmp, x, y, &r, &g, &b);
-          output_image_array[x][BMP_HEIGTH-1-y][0] = r;
-          output_image_array[x][BMP_HEIGTH-1-y][1] = g;
-          output_image_array[x][BMP_HEIGTH-1-y][2] = b;
-      }
+  if (out_bytes == NULL) {
+    if (bmp_clone(&bmp, &out_bmp) != BMP_OK) {
+      bmp_close(&bmp);
+      image_free(output_image);
+      return BMP_ERR_NOMEM;
+    }
+    out_bytes = (unsigned char*) out_bmp.bytes;
   }
-  bclose(in_bmp);
+  bmp_decode(&bmp, output_image);
+  bmp_close(&bmp);
+  return BMP_OK;
 }
 
-void write_bitmap(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], char * output_file_path){
-  if (out_bmp == NULL) {
-    _throw_error("The function 'read_bitmap' must be called at least once before calling the function 'write_bitmap'.");
-  }
-  unsigned char r;
-  unsigned char g;
-  unsigned char b;
-  for (int x = 0; x < BMP_WIDTH; x++)
-  {
-    for (int y = 0; y < BMP_HEIGTH; y++)
-    {
-      r = input_image_array[x][BMP_HEIGTH-1-y][0];
-      g = input_image_array[x][BMP_HEIGTH-1-y][1];
-      b = input_image_array[x][BMP_HEIGTH-1-y][2];
-      set_pixel_rgb(out_bmp, x, y, r, g, b);
-    }
+/**
+ * \brief Writes an RGB image using the header of the first file read.
+ *
+ * \param input_image Image with the same size as the file read first.
+ * \param output_file_path Path of the file to write.
+ * \return BMP_OK, or the reason the file could not be written.
+ */
+bmp_status write_bitmap(const image * input_image, const char * output_file_path){
+  if (out_bytes == NULL) {
+    return BMP_ERR_TEMPLATE;
   }
-  bwrite(out_bmp, output_file_path);
+  return bmp_save(input_image, &out_bmp, output_file_path);
 }
 
-// Private (ex-public) function declarations
-BMP* bopen(char* file_path)
+/**
+ * \brief Decodes the pixels of an opened BMP file into an RGB image.
+ *
+ * Rows are decoded in file order, so a mapping is walked in a single
+ * linear pass.
+ *
+ * \param bmp An opened BMP file.
+ * \param output_image Image of the file's size with BMP_CHANNELS channels.
+ */
+void bmp_decode(const bmp_file* bmp, image* output_image)
 {
-    FILE* fp = fopen(file_path, "rb");
-
-    if (fp == NULL)
+    for (int s = 0; s < bmp->height; s++)
     {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+        int y = bmp->top_down ? s : bmp->height - 1 - s;
+        const unsigned char* row = bmp->pixels + (size_t) s * bmp->row_size;
+        unsigned char* pixel = IMAGE_PIXEL(output_image, 0, y);
+        if (bmp->channels == 1)
+        {
+            // Palette colours as they are, grey values as their level
+            for (int x = 0; x < bmp->width; x++, pixel += BMP_CHANNELS)
+            {
+                if (bmp->palette != NULL && row[x] < bmp->colours)
+                {
+                    const unsigned char* colour = bmp->palette + 4 * (size_t) row[x];
+                    pixel[0] = colour[RED];
+                    pixel[1] = colour[GREEN];
+                    pixel[2] = colour[BLUE];
+                }
+                else
+                {
+                    memset(pixel, bmp->grey[row[x]], BMP_CHANNELS);
+                }
+            }
+            continue;
+        }
+        for (int x = 0; x < bmp->width; x++, row += bmp->channels, pixel += BMP_CHANNELS)
+        {
+            pixel[0] = row[RED];
+            pixel[1] = row[GREEN];
+            pixel[2] = row[BLUE];
+        }
     }
+}
 
-    BMP* bmp = (BMP*) malloc(sizeof(BMP));
-    bmp->file_byte_number = _get_file_byte_number(fp);
-    bmp->file_byte_contents = _get_file_byte_contents(fp, bmp->file_byte_number);
-    fclose(fp);
-
-    if(!_validate_file_type(bmp->file_byte_contents))
+/**
+ * \brief Writes an RGB image in the format of another BMP file.
+ *
+ * Header, padding and any alpha channel are taken from the template, so
+ * the result differs from it only in the colour of the pixels. Unlike
+ * write_bitmap() this keeps no state and is safe to call from several
+ * threads at once.
+ *
+ * \param input_image Image with the same size as the template.
+ * \param like The template file, e.g. the file the image was read from.
+ * \param output_file_path Path of the file to write.
+ * \return BMP_OK, or the reason the file could not be written.
+ */
+bmp_status bmp_save(const image* input_image, const bmp_file* like, const char* output_file_path)
+{
+    if (input_image->width != like->width || input_image->height != like->height) {
+        return BMP_ERR_TEMPLATE;
+    }
+    bmp_file copy;
+    bmp_status status = bmp_clone(like, &copy);
+    if (status != BMP_OK) {
+        return status;
+    }
+    for (int y = 0; y < like->height; y++)
     {
-        _throw_error("Invalid file type");
+        const unsigned char* pixel = IMAGE_PIXEL(input_image, 0, y);
+        for (int x = 0; x < like->width; x++, pixel += input_image->channels)
+        {
+            bmp_set_pixel(&copy, x, y, pixel);
+        }
     }
+    status = bmp_write(&copy, output_file_path);
+    bmp_close(&copy);
+    return status;
+}
 
-    bmp->pixel_array_start = _get_pixel_array_start(bmp->file_byte_contents);
-
-    bmp->width = _get_width(bmp->file_byte_contents);
-    bmp->height = _get_height(bmp->file_byte_contents);
-    bmp->depth = _get_depth(bmp->file_byte_contents);
-
-	//printf("bmp->width %d\n", bmp->width);
-	//printf("bmp->height %d\n", bmp->height);
-	//printf("bmp->depth %d\n", bmp->depth);
-
-    while (!_validate_depth(bmp->depth)) {
-        //_throw_error("Invalid file depth");
-        // fprintf(stderr, "Error: Invalid file depth \n");
-        free(bmp->file_byte_contents);
-        free(bmp);
-        bopen(file_path);
+/**
+ * \brief Makes a private, writable copy of an opened BMP file.
+ *
+ * \param bmp An opened BMP file.
+ * \param copy Descriptor filled in on success, release it with bmp_close().
+ * \return BMP_OK or BMP_ERR_NOMEM.
+ */
+bmp_status bmp_clone(const bmp_file* bmp, bmp_file* copy)
+{
+    unsigned char* bytes = (unsigned char*) malloc(bmp->size);
+    if (bytes == NULL) {
+        return BMP_ERR_NOMEM;
     }
-
-    _populate_pixel_array(bmp);
-
-    return bmp;
+    memcpy(bytes, bmp->bytes, bmp->size);
+    *copy = *bmp;
+    copy->bytes = bytes;
+    copy->pixels = bytes + (bmp->pixels - bmp->bytes);
+    if (bmp->palette != NULL) {
+        copy->palette = bytes + (bmp->palette - bmp->bytes);
+    }
+    copy->mapped = 0;
+    return BMP_OK;
 }
 
-BMP* b_deep_copy(BMP* to_copy)
+/**
+ * \brief Sets the colour of one pixel, leaving any alpha channel as it is.
+ *
+ * A file of one channel takes the value that shows closest to the colour.
+ *
+ * \param bmp A copy made by bmp_clone(), the only kind whose bytes may be written.
+ * \param x Column of the pixel.
+ * \param y Row of the pixel, counted from the top of the image.
+ * \param rgb The red, green and blue value.
+ */
+void bmp_set_pixel(bmp_file* bmp, int x, int y, const unsigned char* rgb)
 {
-    BMP* copy = (BMP*) malloc(sizeof(BMP));
-    copy->file_byte_number = to_copy->file_byte_number;
-    copy->pixel_array_start = to_copy->pixel_array_start;
-    copy->width = to_copy->width;
-    copy->height = to_copy->height;
-    copy->depth = to_copy->depth;
-
-    copy->file_byte_contents = (unsigned char*) malloc(copy->file_byte_number * sizeof(unsigned char));
-
-    unsigned int i;
-    for (i = 0; i < copy->file_byte_number; i++)
-    {
-        copy->file_byte_contents[i] = to_copy->file_byte_contents[i];
+    unsigned char* pixel = (unsigned char*) bmp_row(bmp, y) + (size_t) x * bmp->channels;
+    if (bmp->channels == 1) {
+        pixel[0] = _nearest_value(bmp, rgb);
+        return;
     }
+    pixel[RED] = rgb[0];
+    pixel[GREEN] = rgb[1];
+    pixel[BLUE] = rgb[2];
+}
 
-    copy->pixels = (pixel*) malloc(copy->width * copy->height * sizeof(pixel));
+/**
+ * \brief Writes the bytes of a BMP file unchanged.
+ *
+ * \param bmp An opened or cloned BMP file.
+ * \param output_file_path Path of the file to write.
+ * \return BMP_OK, or the reason the file could not be written.
+ */
+bmp_status bmp_write(const bmp_file* bmp, const char* output_file_path)
+{
+    FILE* fp = fopen(output_file_path, "wb");
+    if (fp == NULL) {
+        return BMP_ERR_WRITE;
+    }
+    size_t written = fwrite(bmp->bytes, 1, bmp->size, fp);
+    if (fclose(fp) != 0 || written != bmp->size) {
+        return BMP_ERR_WRITE;
+    }
+    return BMP_OK;
+}
 
-    unsigned int x, y;
-    int index;
-    for (y = 0; y < copy->height; y++)
+/**
+ * \brief Writes an RGB image as a new 24-bit BMP file, without a template.
+ *
+ * \param input_image Image with BMP_CHANNELS channels.
+ * \param output_file_path Path of the file to write.
+ * \return BMP_OK, or the reason the file could not be written.
+ */
+bmp_status bmp_write_image(const image* input_image, const char* output_file_path)
+{
+    size_t row_size = ((size_t) input_image->width * 3 + 3) / 4 * 4;
+    size_t pixel_bytes = row_size * (size_t) input_image->height;
+    unsigned char header[FILE_HEADER_SIZE + INFO_HEADER_MIN_SIZE] = {'B', 'M'};
+    _write_le32(header + 2, (unsigned int) (sizeof(header) + pixel_bytes));
+    _write_le32(header + PIXEL_ARRAY_START_OFFSET, sizeof(header));
+    _write_le32(header + INFO_HEADER_SIZE_OFFSET, INFO_HEADER_MIN_SIZE);
+    _write_le32(header + WIDTH_OFFSET, (unsigned int) input_image->width);
+    _write_le32(header + HEIGHT_OFFSET, (unsigned int) input_image->height);
+    header[PLANES_OFFSET] = 1;
+    header[DEPTH_OFFSET] = 24;
+    _write_le32(header + IMAGE_SIZE_OFFSET, (unsigned int) pixel_bytes);
+
+    unsigned char* row = (unsigned char*) calloc(row_size, 1);
+    if (row == NULL) {
+        return BMP_ERR_NOMEM;
+    }
+    FILE* fp = fopen(output_file_path, "wb");
+    if (fp == NULL) {
+        free(row);
+        return BMP_ERR_WRITE;
+    }
+    int failed = fwrite(header, 1, sizeof(header), fp) != sizeof(header);
+    // Bottom row first
+    for (int y = input_image->height - 1; y >= 0 && !failed; y--)
     {
-        for (x = 0; x < copy->width; x++)
+        const unsigned char* pixel = IMAGE_PIXEL(input_image, 0, y);
+        for (int x = 0; x < input_image->width; x++, pixel += input_image->channels)
         {
-            index = y * copy->width + x;
-            copy->pixels[index].red = to_copy->pixels[index].red;
-            copy->pixels[index].green = to_copy->pixels[index].green;
-            copy->pixels[index].blue = to_copy->pixels[index].blue;
-            copy->pixels[index].alpha = to_copy->pixels[index].alpha;
+            row[3 * x + RED] = pixel[0];
+            row[3 * x + GREEN] = pixel[1];
+            row[3 * x + BLUE] = pixel[2];
         }
+        failed = fwrite(row, 1, row_size, fp) != row_size;
     }
-
-    return copy;
+    free(row);
+    if (fclose(fp) != 0 || failed) {
+        return BMP_ERR_WRITE;
+    }
+    return BMP_OK;
 }
 
-int get_width(BMP* bmp)
+void bmp_patches_init(bmp_patches* patches)
 {
-    return bmp->width;
+    memset(patches, 0, sizeof(*patches));
 }
 
-int get_height(BMP* bmp)
+// Forgets the patches, keeping the buffers
+void bmp_patches_clear(bmp_patches* patches)
 {
-    return bmp->height;
+    patches->count = 0;
 }
 
-unsigned int get_depth(BMP* bmp)
+// Offset in the file of pixel (x, y)
+static size_t _pixel_offset(const bmp_file* bmp, int x, int y)
 {
-    return bmp->depth;
+    return (size_t) (bmp_row(bmp, y) - bmp->bytes) + (size_t) x * bmp->channels;
 }
 
-void get_pixel_rgb(BMP* bmp, int x, int y, unsigned char* r, unsigned char* g, unsigned char* b)
+/**
+ * \brief Marks a run of pixels of one row as about to change.
+ *
+ * Runs may overlap and come in any order until bmp_patches_merge().
+ *
+ * \param patches The patches of bmp.
+ * \param bmp An opened BMP file.
+ * \param x First pixel of the run, the run must lie inside the row.
+ * \param y Row of the run, counted from the top of the image.
+ * \param count Number of pixels.
+ * \return BMP_OK or BMP_ERR_NOMEM.
+ */
+bmp_status bmp_patch_pixels(bmp_patches* patches, const bmp_file* bmp, int x, int y, int count)
 {
-    int index = y * bmp->width + x;
-    *r = bmp->pixels[index].red;
-    *g = bmp->pixels[index].green;
-    *b = bmp->pixels[index].blue;
+    if (patches->count == patches->capacity) {
+        int capacity = patches->capacity == 0 ? 64 : patches->capacity * 2;
+        bmp_patch* items = (bmp_patch*) realloc(patches->items, (size_t) capacity * sizeof(bmp_patch));
+        if (items == NULL) {
+            return BMP_ERR_NOMEM;
+        }
+        patches->items = items;
+        patches->capacity = capacity;
+    }
+    bmp_patch* patch = &patches->items[patches->count++];
+    patch->offset = _pixel_offset(bmp, x, y);
+    patch->length = (size_t) count * bmp->channels;
+    patch->at = 0;
+    return BMP_OK;
 }
 
-void set_pixel_rgb(BMP* bmp, int x, int y, unsigned char r, unsigned char g, unsigned char b)
+static int _compare_patches(const void* a, const void* b)
 {
-    int index = y * bmp->width + x;
-    bmp->pixels[index].red = r;
-    bmp->pixels[index].green = g;
-    bmp->pixels[index].blue = b;
+    size_t first = ((const bmp_patch*) a)->offset;
+    size_t second = ((const bmp_patch*) b)->offset;
+    return first < second ? -1 : first > second;
 }
 
-void bwrite(BMP* bmp, char* file_name)
+/**
+ * \brief Sorts the patches, joins the ones that overlap or touch, and copies the file's bytes into them.
+ *
+ * The patched bytes can then be changed with bmp_patch_set_pixels(). Only
+ * the patched bytes are copied, so the cost follows the number of
+ * patches, not the size of the file.
+ *
+ * \param patches The patches of bmp.
+ * \param bmp An opened BMP file.
+ * \return BMP_OK or BMP_ERR_NOMEM.
+ */
+bmp_status bmp_patches_merge(bmp_patches* patches, const bmp_file* bmp)
 {
-    _map(bmp, _update_file_byte_contents);
+    if (patches->count == 0) {
+        return BMP_OK;
+    }
+    qsort(patches->items, (size_t) patches->count, sizeof(bmp_patch), _compare_patches);
+    int count = 1;
+    for (int i = 1; i < patches->count; i++) {
+        bmp_patch* last = &patches->items[count - 1];
+        const bmp_patch* next = &patches->items[i];
+        if (next->offset <= last->offset + last->length) {
+            size_t end = next->offset + next->length;
+            if (end > last->offset + last->length) {
+                last->length = end - last->offset;
+            }
+        } else {
+            patches->items[count++] = *next;
+        }
+    }
+    patches->count = count;
 
-    FILE* fp = fopen(file_name, "wb");
-    fwrite(bmp->file_byte_contents, sizeof(char), bmp->file_byte_number, fp);
-    fclose(fp);
+    size_t size = 0;
+    for (int i = 0; i < count; i++) {
+        patches->items[i].at = size;
+        size += patches->items[i].length;
+    }
+    if (size > patches->data_capacity) {
+        unsigned char* data = (unsigned char*) realloc(patches->data, size);
+        if (data == NULL) {
+            return BMP_ERR_NOMEM;
+        }
+        patches->data = data;
+        patches->data_capacity = size;
+    }
+    for (int i = 0; i < count; i++) {
+        const bmp_patch* patch = &patches->items[i];
+        memcpy(patches->data + patch->at, bmp->bytes + patch->offset, patch->length);
+    }
+    return BMP_OK;
 }
 
-void bclose(BMP* bmp)
+/**
+ * \brief Sets the colour of a run of patched pixels, leaving any alpha channel as it is.
+ *
+ * A file of one channel takes the value that shows closest to each colour,
+ * as with bmp_set_pixel().
+ *
+ * \param patches Patches of bmp, merged by bmp_patches_merge().
+ * \param bmp An opened BMP file, which is not changed.
+ * \param x First pixel of the run.
+ * \param y Row of the run, counted from the top of the image.
+ * \param rgb The red, green and blue value of each pixel of the run.
+ * \param count Number of pixels.
+ * \return 1 if the pixels were set, 0 if no single patch covers them all.
+ */
+int bmp_patch_set_pixels(bmp_patches* patches, const bmp_file* bmp, int x, int y, const unsigned char* rgb, int count)
 {
-    free(bmp->pixels);
-    bmp->pixels = NULL;
-    free(bmp->file_byte_contents);
-    bmp->file_byte_contents = NULL;
-    free(bmp);
-    bmp = NULL;
+    size_t offset = _pixel_offset(bmp, x, y);
+    size_t length = (size_t) count * bmp->channels;
+    // Last patch starting at or before the run
+    int low = 0;
+    int high = patches->count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (patches->items[middle].offset <= offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == 0) {
+        return 0;
+    }
+    const bmp_patch* patch = &patches->items[low - 1];
+    if (offset + length > patch->offset + patch->length) {
+        return 0;
+    }
+    unsigned char* pixel = patches->data + patch->at + (offset - patch->offset);
+    if (bmp->channels == 1) {
+        // Markers have few colours, so each is looked up once per run of it
+        const unsigned char* last = NULL;
+        unsigned char value = 0;
+        for (int i = 0; i < count; i++, rgb += 3) {
+            if (last == NULL || memcmp(last, rgb, 3) != 0) {
+                value = _nearest_value(bmp, rgb);
+                last = rgb;
+            }
+            pixel[i] = value;
+        }
+        return 1;
+    }
+    for (int i = 0; i < count; i++, pixel += bmp->channels, rgb += 3) {
+        pixel[RED] = rgb[0];
+        pixel[GREEN] = rgb[1];
+        pixel[BLUE] = rgb[2];
+    }
+    return 1;
 }
 
-
-// Private function implementations
-
-void _throw_error(char* message)
+#ifndef CBMP_NO_MMAP
+// Writes all the pieces, picking up after short writes
+static int _writev_all(int fd, struct iovec* pieces, int count)
 {
-    fprintf(stderr, "%s\n", message);
-    exit(1);
+    while (count > 0) {
+        ssize_t written = writev(fd, pieces, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t) written >= pieces->iov_len) {
+            written -= (ssize_t) pieces->iov_len;
+            pieces++;
+            count--;
+        }
+        if (count > 0) {
+            pieces->iov_base = (char*) pieces->iov_base + written;
+            pieces->iov_len -= (size_t) written;
+        }
+    }
+    return 0;
+}
+#endif
+
+/**
+ * \brief Writes a BMP file with its patched bytes replaced, without copying it.
+ *
+ * The output is gathered from the file's own bytes, mapped or read, and
+ * the patches, and handed to writev() in one call per CBMP_IOV pieces.
+ * The pieces go to the output path with CBMP_TEMP_SUFFIX appended, which
+ * is then renamed over the output, so the output may be the mapped file
+ * itself. Where writev() is not available the file has been read into
+ * memory, and each piece is written with fwrite().
+ *
+ * \param bmp An opened BMP file.
+ * \param patches Patches of bmp, merged by bmp_patches_merge().
+ * \param output_file_path Path of the file to write.
+ * \return BMP_OK, or the reason the file could not be written.
+ */
+bmp_status bmp_write_patched(const bmp_file* bmp, const bmp_patches* patches, const char* output_file_path)
+{
+#ifdef CBMP_NO_MMAP
+    FILE* fp = fopen(output_file_path, "wb");
+    if (fp == NULL) {
+        return BMP_ERR_WRITE;
+    }
+    int failed = 0;
+    size_t done = 0;
+    for (int i = 0; i <= patches->count && !failed; i++) {
+        size_t next = i < patches->count ? patches->items[i].offset : bmp->size;
+        failed |= fwrite(bmp->bytes + done, 1, next - done, fp) != next - done;
+        if (i < patches->count) {
+            const bmp_patch* patch = &patches->items[i];
+            failed |= fwrite(patches->data + patch->at, 1, patch->length, fp) != patch->length;
+            done = patch->offset + patch->length;
+        }
+    }
+    if (fclose(fp) != 0 || failed) {
+        return BMP_ERR_WRITE;
+    }
+    return BMP_OK;
+#else
+    // Truncating the output in place would truncate the mapped input with it
+    size_t length = strlen(output_file_path);
+    char* temp_path = (char*) malloc(length + sizeof(CBMP_TEMP_SUFFIX));
+    if (temp_path == NULL) {
+        return BMP_ERR_NOMEM;
+    }
+    memcpy(temp_path, output_file_path, length);
+    memcpy(temp_path + length, CBMP_TEMP_SUFFIX, sizeof(CBMP_TEMP_SUFFIX));
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        free(temp_path);
+        return BMP_ERR_WRITE;
+    }
+    struct iovec pieces[CBMP_IOV];
+    int count = 0;
+    int failed = 0;
+    size_t done = 0;
+    for (int i = 0; i <= patches->count && !failed; i++) {
+        // Room for the unchanged bytes before the patch and the patch itself
+        if (count > CBMP_IOV - 2) {
+            failed = _writev_all(fd, pieces, count) != 0;
+            count = 0;
+        }
+        size_t next = i < patches->count ? patches->items[i].offset : bmp->size;
+        if (next > done) {
+            pieces[count].iov_base = (void*) (bmp->bytes + done);
+            pieces[count++].iov_len = next - done;
+        }
+        if (i < patches->count) {
+            const bmp_patch* patch = &patches->items[i];
+            pieces[count].iov_base = patches->data + patch->at;
+            pieces[count++].iov_len = patch->length;
+            done = patch->offset + patch->length;
+        }
+    }
+    if (!failed && count > 0) {
+        failed = _writev_all(fd, pieces, count) != 0;
+    }
+    failed |= close(fd) != 0;
+    if (!failed && rename(temp_path, output_file_path) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        unlink(temp_path);
+    }
+    free(temp_path);
+    return failed ? BMP_ERR_WRITE : BMP_OK;
+#endif
 }
 
-unsigned int _get_int_from_buffer(unsigned int bytes,
-                                  unsigned int offset,
-                                  unsigned char* buffer)
+void bmp_patches_free(bmp_patches* patches)
 {
-    unsigned char* _buffer = (unsigned char*) malloc(bytes * sizeof(unsigned char));
+    free(patches->items);
+    free(patches->data);
+    bmp_patches_init(patches);
+}
 
-    unsigned int i;
-    for (i = 0; i < bytes; i++)
-    {
-        _buffer[i] = buffer[i + offset];
+/**
+ * \brief Maps a BMP file into memory and validates its header once.
+ *
+ * Binary PGM files are recognised by their "P5" signature and opened as
+ * files of one channel, like 8-bit BMP files.
+ *
+ * \param file_path Path of the file to open.
+ * \param bmp Descriptor filled in on success.
+ * \return BMP_OK, or the reason the file was rejected.
+ */
+bmp_status bmp_open(const char* file_path, bmp_file* bmp)
+{
+    memset(bmp, 0, sizeof(*bmp));
+    bmp_status status = _map_file(file_path, bmp);
+    if (status != BMP_OK) {
+        return status;
+    }
+    if (bmp->size >= 2 && bmp->bytes[0] == 'P' && bmp->bytes[1] == '5') {
+        status = _parse_pgm(bmp);
+    } else {
+        status = _parse_header(bmp);
+    }
+    if (status != BMP_OK) {
+        bmp_close(bmp);
     }
+    return status;
+}
 
-    unsigned int value = *(unsigned int*) _buffer;
-    free(_buffer);
-    return value;
+/**
+ * \brief Maps a headerless frame of 8-bit grey values, stored top row first without padding.
+ *
+ * \param file_path Path of the file to open.
+ * \param width Width of the frame, which the file cannot tell.
+ * \param height Height of the frame.
+ * \param bmp Descriptor filled in on success.
+ * \return BMP_OK, or the reason the file was rejected.
+ */
+bmp_status bmp_open_raw(const char* file_path, int width, int height, bmp_file* bmp)
+{
+    memset(bmp, 0, sizeof(*bmp));
+    if (width <= 0 || height <= 0) {
+        return BMP_ERR_SIZE;
+    }
+    bmp_status status = _map_file(file_path, bmp);
+    if (status != BMP_OK) {
+        return status;
+    }
+    if ((size_t) height > bmp->size / (size_t) width) {
+        bmp_close(bmp);
+        return BMP_ERR_SIZE;
+    }
+    bmp->pixels = bmp->bytes;
+    bmp->width = width;
+    bmp->height = height;
+    bmp->depth = 8;
+    bmp->channels = 1;
+    bmp->row_size = (size_t) width;
+    bmp->top_down = 1;
+    bmp_grey_levels(bmp, 256);
+    return BMP_OK;
 }
 
-unsigned int _get_file_byte_number(FILE* fp)
+/**
+ * \brief Makes the pixels of a file of one channel grey values from 0 to levels - 1.
+ *
+ * They are stretched to 0 to 255, so black and white stay black and white
+ * whatever the number of levels.
+ *
+ * \param bmp A file of one channel without a palette.
+ * \param levels Number of grey levels, 2 to 256.
+ */
+void bmp_grey_levels(bmp_file* bmp, int levels)
 {
-    unsigned int byte_number;
-    fseek(fp, 0, SEEK_END);
-    byte_number = ftell(fp);
-    rewind(fp);
-    return byte_number;
+    bmp->palette = NULL;
+    bmp->colours = levels;
+    for (int i = 0; i < 256; i++) {
+        int value = i < levels ? i : levels - 1;
+        bmp->grey[i] = (unsigned char) ((value * 255 + (levels - 1) / 2) / (levels - 1));
+    }
+    bmp->plain_grey = levels == 256;
 }
 
-unsigned char* _get_file_byte_contents(FILE* fp, unsigned int file_byte_number)
+/**
+ * \brief Returns the stored pixels of an image row without copying them.
+ *
+ * \param bmp An opened BMP file.
+ * \param y Row index counted from the top of the image.
+ * \return Pointer to `width` pixels of `channels` bytes each, in BGR(A) order.
+ */
+const unsigned char* bmp_row(const bmp_file* bmp, int y)
 {
-    unsigned char* buffer = (unsigned char*) malloc(file_byte_number * sizeof(char));
-    unsigned int result = fread(buffer, 1, file_byte_number, fp);
+    int stored = bmp->top_down ? y : bmp->height - 1 - y;
+    return bmp->pixels + (size_t) stored * bmp->row_size;
+}
 
-    if (result != file_byte_number)
-    {
-        _throw_error("There was a problem reading the file");
+void bmp_close(bmp_file* bmp)
+{
+    if (bmp->bytes != NULL) {
+#ifndef CBMP_NO_MMAP
+        if (bmp->mapped) {
+            munmap((void*) bmp->bytes, bmp->size);
+        } else
+#endif
+        {
+            free((void*) bmp->bytes);
+        }
     }
+    bmp->bytes = NULL;
+    bmp->pixels = NULL;
+}
 
-
-    return buffer;
+/**
+ * \brief Describes a rectangle of an opened BMP file as a file of its own, without copying.
+ *
+ * Only the pixel fields of the view are meaningful: rows are read with
+ * bmp_row() as usual, and closing the view does nothing. It stays valid
+ * as long as bmp is open.
+ *
+ * \param bmp An opened BMP file.
+ * \param x Left column of the rectangle.
+ * \param y Top row of the rectangle.
+ * \param width Width of the rectangle, which must lie inside the image.
+ * \param height Height of the rectangle.
+ * \param view Descriptor filled in.
+ */
+void bmp_view(const bmp_file* bmp, int x, int y, int width, int height, bmp_file* view)
+{
+    *view = *bmp;
+    view->bytes = NULL;
+    view->size = 0;
+    view->width = width;
+    view->height = height;
+    view->mapped = 0;
+    // The first stored row of the view is its top row, or its bottom row in a bottom-up file
+    int stored = bmp->top_down ? y : bmp->height - y - height;
+    view->pixels = bmp->pixels + (size_t) stored * bmp->row_size + (size_t) x * bmp->channels;
 }
 
-int _validate_file_type(unsigned char* file_byte_contents)
+/**
+ * \brief Tells the operating system that rows of a mapped file will not be read again soon.
+ *
+ * Their pages are dropped from the mapping, and read back from the file
+ * if they are needed after all, so a file much larger than memory can be
+ * walked with a bounded footprint. Only whole pages inside the rows are
+ * dropped. Does nothing for files that were read instead of mapped.
+ *
+ * \param bmp An opened BMP file.
+ * \param first First row, counted from the top of the image.
+ * \param end One past the last row.
+ */
+void bmp_release_rows(const bmp_file* bmp, int first, int end)
 {
-    return file_byte_contents[0] == 'B' && file_byte_contents[1] == 'M';
+#if !defined(CBMP_NO_MMAP) && defined(MADV_DONTNEED)
+    if (!bmp->mapped || first >= end) {
+        return;
+    }
+    int stored_first = bmp->top_down ? first : bmp->height - end;
+    size_t begin = (size_t) (bmp->pixels - bmp->bytes) + (size_t) stored_first * bmp->row_size;
+    size_t stop = begin + (size_t) (end - first) * bmp->row_size;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    begin = (begin + page - 1) / page * page;
+    stop = stop / page * page;
+    if (begin < stop) {
+        madvise((void*) (bmp->bytes + begin), stop - begin, MADV_DONTNEED);
+    }
+#else
+    (void) bmp;
+    (void) first;
+    (void) end;
+#endif
 }
 
-int _validate_depth(unsigned int depth)
+/**
+ * \brief Asks the operating system to start reading a file in the background.
+ *
+ * Only a hint, so a file that cannot be opened is silently skipped. Does
+ * nothing where posix_fadvise() is not available.
+ *
+ * \param file_path Path of a file that will be opened soon.
+ */
+void bmp_prefetch(const char* file_path)
 {
-    return depth == 24 || depth == 32;
+#if !defined(CBMP_NO_MMAP) && defined(POSIX_FADV_WILLNEED)
+    int fd = open(file_path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+#else
+    (void) file_path;
+#endif
 }
 
-unsigned int _get_pixel_array_start(unsigned char* file_byte_contents)
+const char* bmp_strerror(bmp_status status)
 {
-    return _get_int_from_buffer(PIXEL_ARRAY_START_BYTES, PIXEL_ARRAY_START_OFFSET, file_byte_contents);
+    switch (status) {
+        case BMP_OK:
+            return "No error";
+        case BMP_ERR_OPEN:
+            return "Error opening file";
+        case BMP_ERR_TYPE:
+            return "Invalid file type";
+        case BMP_ERR_DEPTH:
+            return "Invalid file depth. Must be 8, 24 or 32 bits per pixel, uncompressed or BGRA bit fields,"
+                   " or an 8-bit binary PGM.";
+        case BMP_ERR_SIZE:
+            return "There was a problem reading the file";
+        case BMP_ERR_NOMEM:
+            return "Out of memory";
+        case BMP_ERR_WRITE:
+            return "There was a problem writing the file";
+        case BMP_ERR_TEMPLATE:
+            return "The function 'read_bitmap' must be called with an image of the same size before calling the function 'write_bitmap'.";
+    }
+    return "Unknown error";
 }
 
-int _get_width(unsigned char* file_byte_contents)
+
+// Private function implementations
+
+static unsigned int _read_le16(const unsigned char* buffer)
 {
-    return (int) _get_int_from_buffer(WIDTH_BYTES, WIDTH_OFFSET, file_byte_contents);
+    return (unsigned int) buffer[0] | ((unsigned int) buffer[1] << 8);
 }
 
-int _get_height(unsigned char* file_byte_contents)
+static void _write_le32(unsigned char* buffer, unsigned int value)
 {
-    return (int) _get_int_from_buffer(HEIGHT_BYTES, HEIGHT_OFFSET, file_byte_contents);
+    buffer[0] = (unsigned char) value;
+    buffer[1] = (unsigned char) (value >> 8);
+    buffer[2] = (unsigned char) (value >> 16);
+    buffer[3] = (unsigned char) (value >> 24);
 }
 
-unsigned int _get_depth(unsigned char* file_byte_contents)
+static unsigned int _read_le32(const unsigned char* buffer)
 {
-    if(_get_int_from_buffer(DEPTH_BYTES, DEPTH_OFFSET, file_byte_contents)==32 || _get_int_from_buffer(DEPTH_BYTES, DEPTH_OFFSET, file_byte_contents)==24){
-		return _get_int_from_buffer(DEPTH_BYTES, DEPTH_OFFSET, file_byte_contents);
-	}else{
-		//We are in a windows environment (patch)
-		//printf("%d", (_get_int_from_buffer(DEPTH_BYTES, DEPTH_OFFSET, file_byte_contents)) & 0xFF );
-		return (_get_int_from_buffer(DEPTH_BYTES, DEPTH_OFFSET, file_byte_contents)) & 0xFF;
-	}
-		
+    return (unsigned int) buffer[0] | ((unsigned int) buffer[1] << 8) |
+           ((unsigned int) buffer[2] << 16) | ((unsigned int) buffer[3] << 24);
 }
 
-void _update_file_byte_contents(BMP* bmp, int index, int offset, int channel)
+static bmp_status _map_file(const char* file_path, bmp_file* bmp)
 {
-    char value;
-    switch(channel)
-    {
-        case BLUE:
-            value = bmp->pixels[index].blue;
-            break;
-        case GREEN:
-            value = bmp->pixels[index].green;
-            break;
-        case RED:
-            value = bmp->pixels[index].red;
-            break;
-        case ALPHA:
-            value = bmp->pixels[index].alpha;
-            break;
+#ifdef CBMP_NO_MMAP
+    FILE* fp = fopen(file_path, "rb");
+    if (fp == NULL) {
+        return BMP_ERR_OPEN;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    if (size <= 0) {
+        fclose(fp);
+        return BMP_ERR_TYPE;
+    }
+    unsigned char* buffer = (unsigned char*) malloc((size_t) size);
+    if (buffer == NULL) {
+        fclose(fp);
+        return BMP_ERR_NOMEM;
+    }
+    if (fread(buffer, 1, (size_t) size, fp) != (size_t) size) {
+        free(buffer);
+        fclose(fp);
+        return BMP_ERR_SIZE;
+    }
+    fclose(fp);
+    bmp->bytes = buffer;
+    bmp->size = (size_t) size;
+    bmp->mapped = 0;
+#else
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        return BMP_ERR_OPEN;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return BMP_ERR_OPEN;
     }
-    bmp->file_byte_contents[offset + channel] = value;
+    if (st.st_size <= 0) {
+        close(fd);
+        return BMP_ERR_TYPE;
+    }
+    void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return BMP_ERR_OPEN;
+    }
+    madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+    bmp->bytes = (const unsigned char*) map;
+    bmp->size = (size_t) st.st_size;
+    bmp->mapped = 1;
+#endif
+    return BMP_OK;
 }
 
-void _populate_pixel_array(BMP* bmp)
+static bmp_status _parse_header(bmp_file* bmp)
 {
-    bmp->pixels = (pixel*) malloc(bmp->width * bmp->height * sizeof(pixel));
-    _map(bmp, _get_pixel);
+    const unsigned char* bytes = bmp->bytes;
+    if (bmp->size < FILE_HEADER_SIZE + INFO_HEADER_MIN_SIZE || bytes[0] != 'B' || bytes[1] != 'M') {
+        return BMP_ERR_TYPE;
+    }
+
+    unsigned int pixel_array_start = _read_le32(bytes + PIXEL_ARRAY_START_OFFSET);
+    int width = (int) _read_le32(bytes + WIDTH_OFFSET);
+    int height = (int) _read_le32(bytes + HEIGHT_OFFSET);
+    unsigned int depth = _read_le16(bytes + DEPTH_OFFSET);
+    unsigned int compression = _read_le32(bytes + COMPRESSION_OFFSET);
+
+    if (depth != 8 && depth != 24 && depth != 32) {
+        return BMP_ERR_DEPTH;
+    }
+    if (compression != COMPRESSION_RGB && !(compression == COMPRESSION_BITFIELDS && depth == 32)) {
+        return BMP_ERR_DEPTH;
+    }
+    // Pixels are read as BGRA, so BITFIELDS files must lay them out that way
+    if (compression == COMPRESSION_BITFIELDS) {
+        if (pixel_array_start < MASKS_OFFSET + 12 || bmp->size < MASKS_OFFSET + 12) {
+            return BMP_ERR_SIZE;
+        }
+        if (_read_le32(bytes + MASKS_OFFSET) != RED_MASK || _read_le32(bytes + MASKS_OFFSET + 4) != GREEN_MASK ||
+            _read_le32(bytes + MASKS_OFFSET + 8) != BLUE_MASK) {
+            return BMP_ERR_DEPTH;
+        }
+    }
+    if (width <= 0 || height == 0 || height == (int) 0x80000000) {
+        return BMP_ERR_TYPE;
+    }
+
+    // A negative height marks a top-down bitmap
+    bmp->top_down = height < 0;
+    bmp->width = width;
+    bmp->height = height < 0 ? -height : height;
+    bmp->depth = (int) depth;
+    bmp->channels = (int) depth / 8;
+    bmp->row_size = (((size_t) depth * (size_t) width + 31) / 32) * 4;
+
+    if (pixel_array_start > bmp->size ||
+        (size_t) bmp->height > (bmp->size - pixel_array_start) / bmp->row_size) {
+        return BMP_ERR_SIZE;
+    }
+    bmp->pixels = bytes + pixel_array_start;
+    if (depth == 8) {
+        // The palette follows the info header, 256 colours unless it says otherwise
+        size_t palette_start = FILE_HEADER_SIZE + (size_t) _read_le32(bytes + INFO_HEADER_SIZE_OFFSET);
+        unsigned int colours = _read_le32(bytes + COLOURS_USED_OFFSET);
+        colours = colours == 0 || colours > 256 ? 256 : colours;
+        if (palette_start > pixel_array_start || colours > (pixel_array_start - palette_start) / 4) {
+            return BMP_ERR_SIZE;
+        }
+        bmp->palette = bytes + palette_start;
+        bmp->colours = (int) colours;
+        bmp->plain_grey = 1;
+        for (int i = 0; i < 256; i++) {
+            const unsigned char* colour = bmp->palette + 4 * i;
+            bmp->grey[i] = i < bmp->colours ? (unsigned char) ((colour[BLUE] + colour[GREEN] + colour[RED]) / 3) : 0;
+            bmp->plain_grey &= bmp->grey[i] == i;
+        }
+    }
+    return BMP_OK;
 }
 
-void _map(BMP* bmp, void (*f)(BMP*, int, int, int))
+// Skips whitespace and comments, then reads a decimal number of a PGM header
+static int _pgm_number(const bmp_file* bmp, size_t* at)
 {
-    int channels = bmp->depth / (sizeof(unsigned char) * BITS_PER_BYTE);
-    int row_size = ((int) (bmp->depth * bmp->width + 31) / 32) * 4;
-    int padding = row_size - bmp->width * channels;
-
-    int c;
-    unsigned int x, y, index, offset;
-    for (y = 0; y < bmp->height; y++)
-    {
-        for (x = 0; x < bmp->width; x++)
-        {
-            index = y * bmp->width + x;
-            offset = bmp->pixel_array_start + index * channels + y * padding;
-            for (c = 0; c < channels; c++)
-            {
-                (*f)(bmp, index, offset, c);
+    const unsigned char* bytes = bmp->bytes;
+    while (*at < bmp->size && (bytes[*at] == '#' || bytes[*at] == ' ' || bytes[*at] == '\t' ||
+                               bytes[*at] == '\n' || bytes[*at] == '\r')) {
+        if (bytes[*at] == '#') {
+            while (*at < bmp->size && bytes[*at] != '\n') {
+                (*at)++;
             }
+        } else {
+            (*at)++;
         }
     }
+    int value = 0;
+    int digits = 0;
+    for (; *at < bmp->size && bytes[*at] >= '0' && bytes[*at] <= '9' && value < 1 << 24; (*at)++, digits++) {
+        value = value * 10 + (bytes[*at] - '0');
+    }
+    return digits == 0 ? -1 : value;
 }
 
-void _get_pixel(BMP* bmp, int index, int offset, int channel)
+static bmp_status _parse_pgm(bmp_file* bmp)
 {
-    unsigned char value = _get_int_from_buffer(sizeof(unsigned char), offset + channel, bmp->file_byte_contents);
-    switch(channel)
-    {
-        case BLUE:
-            bmp->pixels[index].blue = value;
-            break;
-        case GREEN:
-            bmp->pixels[index].green = value;
-            break;
-        case RED:
-            bmp->pixels[index].red = value;
-            break;
-        case ALPHA:
-            bmp->pixels[index].alpha = value;
-            break;
+    size_t at = 2;
+    int width = _pgm_number(bmp, &at);
+    int height = _pgm_number(bmp, &at);
+    int maxval = _pgm_number(bmp, &at);
+    // One whitespace character separates the header from the pixels
+    if (width <= 0 || height <= 0 || maxval <= 0 || at >= bmp->size) {
+        return BMP_ERR_TYPE;
+    }
+    if (maxval > 255) {
+        return BMP_ERR_DEPTH;
+    }
+    at++;
+    if ((size_t) height > (bmp->size - at) / (size_t) width) {
+        return BMP_ERR_SIZE;
+    }
+    bmp->pixels = bmp->bytes + at;
+    bmp->width = width;
+    bmp->height = height;
+    bmp->depth = 8;
+    bmp->channels = 1;
+    bmp->row_size = (size_t) width;
+    bmp->top_down = 1;
+    bmp_grey_levels(bmp, maxval + 1);
+    return BMP_OK;
+}
+
+// Value of a file of one channel that shows closest to a colour
+static unsigned char _nearest_value(const bmp_file* bmp, const unsigned char* rgb)
+{
+    int grey = (rgb[0] + rgb[1] + rgb[2]) / 3;
+    int best = 0;
+    long best_distance = -1;
+    for (int v = 0; v < bmp->colours; v++) {
+        long distance;
+        if (bmp->palette != NULL) {
+            const unsigned char* colour = bmp->palette + 4 * v;
+            long red = colour[RED] - rgb[0];
+            long green = colour[GREEN] - rgb[1];
+            long blue = colour[BLUE] - rgb[2];
+            distance = red * red + green * green + blue * blue;
+        } else {
+            distance = labs((long) bmp->grey[v] - grey);
+        }
+        if (best_distance < 0 || distance < best_distance) {
+            best = v;
+            best_distance = distance;
+        }
     }
+    return (unsigned char) best;
 }
@@ -1,14 +1,95 @@
 #ifndef CBMP_CBMP_H
 #define CBMP_CBMP_H
 
-#define BMP_WIDTH 950
-#define BMP_HEIGTH 950
 #define BMP_CHANNELS 3
 
 #include <stdlib.h>
 #include <stdio.h>
+#include "image.h"
+
+// Status codes returned by the bmp_* loader functions
+typedef enum bmp_status {
+    BMP_OK = 0,
+    BMP_ERR_OPEN,       // file could not be opened, sized or mapped
+    BMP_ERR_TYPE,       // missing 'BM' signature or truncated header
+    BMP_ERR_DEPTH,      // unsupported bit depth or compression
+    BMP_ERR_SIZE,       // pixel array does not fit inside the file
+    BMP_ERR_NOMEM,
+    BMP_ERR_WRITE,      // output file could not be created or written
+    BMP_ERR_TEMPLATE    // write_bitmap without a matching read_bitmap
+} bmp_status;
+
+// A BMP file mapped read-only into memory. The header is validated once
+// by bmp_open(); rows can then be handed out without any copying.
+// Binary PGM files and headerless 8-bit frames are read the same way, as
+// files of one channel whose values are looked up in grey.
+typedef struct bmp_file {
+    const unsigned char *bytes;     // the whole file
+    size_t size;
+    const unsigned char *pixels;    // first stored row of the pixel array
+    int width;
+    int height;                     // always positive, see top_down
+    int depth;                      // 8, 24 or 32
+    int channels;                   // bytes per pixel (1, 3 or 4)
+    size_t row_size;                // bytes per stored row, padding included
+    int top_down;                   // 1 if the first stored row is the top one
+    int mapped;                     // 1 if bytes must be munmap'ed, 0 if free'd
+    const unsigned char *palette;   // BGRX colours of an 8-bit BMP, NULL for plain grey values
+    int colours;                    // values a pixel of one channel may take
+    int plain_grey;                 // 1 if grey is the identity, so rows are used as they are
+    unsigned char grey[256];        // grey level of each value of one channel, as greyscale() gives it
+} bmp_file;
+
+// Bytes [offset, offset + length) of a file, replaced when it is written
+typedef struct bmp_patch {
+    size_t offset;
+    size_t length;
+    size_t at;              // where its new bytes start in bmp_patches.data, once merged
+} bmp_patch;
+
+/**
+ * \brief Changes to a BMP file that are written without copying the rest of it.
+ *
+ * Once merged, the patches are sorted by offset and never overlap, and
+ * data holds their new bytes one after the other. Buffers are kept when
+ * the set is cleared, so it can be refilled for file after file.
+ */
+typedef struct bmp_patches {
+    bmp_patch *items;
+    int count;
+    int capacity;
+    unsigned char *data;
+    size_t data_capacity;
+} bmp_patches;
+
 // Public function declarations
-void read_bitmap(char * input_file_path, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
-void write_bitmap(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], char * output_file_path);
+bmp_status read_bitmap(const char * input_file_path, image * output_image);
+bmp_status write_bitmap(const image * input_image, const char * output_file_path);
+
+// Zero-copy loader
+bmp_status bmp_open(const char *file_path, bmp_file *bmp);
+bmp_status bmp_open_raw(const char *file_path, int width, int height, bmp_file *bmp);
+void bmp_grey_levels(bmp_file *bmp, int levels);
+const unsigned char *bmp_row(const bmp_file *bmp, int y);
+void bmp_close(bmp_file *bmp);
+void bmp_view(const bmp_file *bmp, int x, int y, int width, int height, bmp_file *view);
+void bmp_release_rows(const bmp_file *bmp, int first, int end);
+void bmp_prefetch(const char *file_path);
+const char *bmp_strerror(bmp_status status);
+void bmp_decode(const bmp_file *bmp, image *output_image);
+bmp_status bmp_save(const image *input_image, const bmp_file *like, const char *output_file_path);
+bmp_status bmp_clone(const bmp_file *bmp, bmp_file *copy);
+void bmp_set_pixel(bmp_file *bmp, int x, int y, const unsigned char *rgb);
+bmp_status bmp_write(const bmp_file *bmp, const char *output_file_path);
+bmp_status bmp_write_image(const image *input_image, const char *output_file_path);
+
+// Patched output
+void bmp_patches_init(bmp_patches *patches);
+void bmp_patches_clear(bmp_patches *patches);
+bmp_status bmp_patch_pixels(bmp_patches *patches, const bmp_file *bmp, int x, int y, int count);
+bmp_status bmp_patches_merge(bmp_patches *patches, const bmp_file *bmp);
+int bmp_patch_set_pixels(bmp_patches *patches, const bmp_file *bmp, int x, int y, const unsigned char *rgb, int count);
+bmp_status bmp_write_patched(const bmp_file *bmp, const bmp_patches *patches, const char *output_file_path);
+void bmp_patches_free(bmp_patches *patches);
 
 #endif // CBMP_CBMP_H
@@ -0,0 +1,154 @@
+#include "celldetect.h"
+#include "cbmp.h"
+#include <string.h>
+
+/**
+ * \brief Fills in the default options: one thread per processor, the erosion loop and one global threshold.
+ */
+void celldetect_options_init(celldetect_options *options) {
+    memset(options, 0, sizeof(*options));
+    options->threads = pool_cpu_count();
+    options->mode = DETECT_EROSION;
+    options->threshold = THRESHOLD_GLOBAL;
+}
+
+/**
+ * \brief Starts the threads of a context, its buffers are only allocated by the first detection.
+ *
+ * \param ctx The context to set up, released with celldetect_free() on success.
+ * \param options How to detect, or NULL for the defaults of celldetect_options_init().
+ * \return CELLDETECT_OK, or the reason the context could not be set up, in which case nothing is left to free.
+ */
+celldetect_status celldetect_init(celldetect_context *ctx, const celldetect_options *options) {
+    celldetect_options defaults;
+    if (options == NULL) {
+        celldetect_options_init(&defaults);
+        options = &defaults;
+    }
+    if (ctx == NULL || options->threads < 1) {
+        return CELLDETECT_ERR_ARGUMENT;
+    }
+    pipeline_init(&ctx->work);
+    ctx->work.mode = options->mode;
+    ctx->work.threshold_mode = options->threshold;
+    if (pool_init(&ctx->pool, options->threads) != 0) {
+        return CELLDETECT_ERR_THREADS;
+    }
+    return CELLDETECT_OK;
+}
+
+static celldetect_status _from_bmp(bmp_status status) {
+    switch (status) {
+        case BMP_OK:
+            return CELLDETECT_OK;
+        case BMP_ERR_OPEN:
+            return CELLDETECT_ERR_OPEN;
+        case BMP_ERR_NOMEM:
+            return CELLDETECT_ERR_NOMEM;
+        default:
+            return CELLDETECT_ERR_FORMAT;
+    }
+}
+
+/**
+ * \brief Hands out the cells of the last detection, or none when it failed.
+ */
+static celldetect_status _result(const celldetect_context *ctx, celldetect_status status, const cell **cells,
+                                 int *count) {
+    int ok = status == CELLDETECT_OK;
+    if (cells != NULL) {
+        *cells = ok ? ctx->work.cells.cells : NULL;
+    }
+    if (count != NULL) {
+        *count = ok ? ctx->work.cells.count : 0;
+    }
+    return status;
+}
+
+/**
+ * \brief Detects the cells of a frame the caller owns, without copying it.
+ *
+ * The frame is wrapped as a top-down BMP file, so its rows stream through
+ * greyscale, blur and histogram straight from the caller's buffer, as the
+ * rows of a mapped file do.
+ *
+ * \param ctx A context set up by celldetect_init().
+ * \param frame The frame, only read during the call.
+ * \param cells Receives the cells in the order they were detected, or NULL. They belong to the
+ *              context and stay valid until its next detection or celldetect_free().
+ * \param count Receives the number of cells, or NULL.
+ * \return CELLDETECT_OK, or the reason no cells were detected.
+ */
+celldetect_status celldetect_detect(celldetect_context *ctx, const celldetect_frame *frame, const cell **cells,
+                                    int *count) {
+    if (ctx == NULL || frame == NULL || frame->pixels == NULL || frame->width < 1 || frame->height < 1 ||
+        (frame->channels != 1 && frame->channels != 3 && frame->channels != 4) ||
+        frame->stride < (size_t) frame->width * (size_t) frame->channels) {
+        return _result(ctx, CELLDETECT_ERR_ARGUMENT, cells, count);
+    }
+    bmp_file view = {0};
+    view.pixels = frame->pixels;
+    view.width = frame->width;
+    view.height = frame->height;
+    view.depth = frame->channels * 8;
+    view.channels = frame->channels;
+    view.row_size = frame->stride;
+    view.top_down = 1;
+    if (frame->channels == 1) {
+        bmp_grey_levels(&view, 256);
+    }
+    return _result(ctx, _from_bmp(pipeline_detect_file(&ctx->work, &view, &ctx->pool)), cells, count);
+}
+
+/**
+ * \brief Detects the cells of a BMP or PGM file.
+ *
+ * Accepted are uncompressed BMP files of 8 bits per pixel with a palette
+ * and of 24 or 32 bits per pixel, 32-bit BMP files whose bit fields are
+ * the BGRA masks, and binary PGM files of up to 256 grey levels.
+ *
+ * \param ctx A context set up by celldetect_init().
+ * \param path Path of the file.
+ * \param cells Receives the cells, as for celldetect_detect().
+ * \param count Receives the number of cells, or NULL.
+ * \return CELLDETECT_OK, or the reason no cells were detected.
+ */
+celldetect_status celldetect_detect_file(celldetect_context *ctx, const char *path, const cell **cells, int *count) {
+    if (ctx == NULL || path == NULL) {
+        return _result(ctx, CELLDETECT_ERR_ARGUMENT, cells, count);
+    }
+    bmp_file file;
+    bmp_status status = bmp_open(path, &file);
+    if (status == BMP_OK) {
+        status = pipeline_detect_file(&ctx->work, &file, &ctx->pool);
+        bmp_close(&file);
+    }
+    return _result(ctx, _from_bmp(status), cells, count);
+}
+
+/**
+ * \brief Stops the threads of a context and frees its buffers, along with the cells handed out.
+ */
+void celldetect_free(celldetect_context *ctx) {
+    pipeline_free(&ctx->work);
+    pool_free(&ctx->pool);
+}
+
+const char *celldetect_strerror(celldetect_status status) {
+    switch (status) {
+        case CELLDETECT_OK:
+            return "No error";
+        case CELLDETECT_ERR_ARGUMENT:
+            return "Invalid argument";
+        case CELLDETECT_ERR_NOMEM:
+            return "Out of memory";
+        case CELLDETECT_ERR_THREADS:
+            return "Failed to start the worker threads";
+        case CELLDETECT_ERR_OPEN:
+            return "Error opening file";
+        case CELLDETECT_ERR_FORMAT:
+            return "Unsupported file format. Must be an uncompressed BMP file of 8, 24 or 32 bits per pixel, or an 8-bit "
+                   "binary PGM.";
+    }
+    return "Unknown error";
+}
@@ -0,0 +1,62 @@
+#ifndef CELLDETECT_CELLDETECT_H
+#define CELLDETECT_CELLDETECT_H
+
+#include <stddef.h>
+#include "cells.h"
+#include "detect.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "threshold.h"
+
+// Status codes returned by the celldetect_* functions, none of which exit the process
+typedef enum celldetect_status {
+    CELLDETECT_OK = 0,
+    CELLDETECT_ERR_ARGUMENT,    // NULL pointer, empty frame, stride or channel count that does not fit
+    CELLDETECT_ERR_NOMEM,
+    CELLDETECT_ERR_THREADS,     // the worker threads of the context could not be started
+    CELLDETECT_ERR_OPEN,        // file could not be opened, sized or mapped
+    CELLDETECT_ERR_FORMAT       // not a BMP file the reader supports
+} celldetect_status;
+
+typedef struct celldetect_options {
+    int threads;                // threads each image is split across, the calling one included
+    detect_mode mode;
+    threshold_mode threshold;   // how the threshold varies over each image
+} celldetect_options;
+
+/**
+ * \brief A frame in memory owned by the caller, read in place and never changed.
+ *
+ * Pixels of 3 or 4 bytes have the mean of the first 3 as their grey level,
+ * so BGR, RGB, BGRA and RGBA all give the same cells. Pixels of 1 byte are
+ * grey levels, copied straight into the pipeline.
+ */
+typedef struct celldetect_frame {
+    const unsigned char *pixels; // first byte of the top row
+    int width;
+    int height;
+    size_t stride;              // bytes from the start of one row to the next, at least width * channels
+    int channels;               // bytes per pixel, 1, 3 or 4
+} celldetect_frame;
+
+/**
+ * \brief Everything one detection needs, so nothing is kept in globals.
+ *
+ * The working buffers and threads are made once and reused for every
+ * frame, and only grow when a larger frame comes. A context serves one
+ * call at a time; threads that detect at the same time each use their own.
+ */
+typedef struct celldetect_context {
+    pipeline work;              // buffers of the last frame, its cells and counters
+    worker_pool pool;
+} celldetect_context;
+
+void celldetect_options_init(celldetect_options *options);
+celldetect_status celldetect_init(celldetect_context *ctx, const celldetect_options *options);
+celldetect_status celldetect_detect(celldetect_context *ctx, const celldetect_frame *frame, const cell **cells,
+                                    int *count);
+celldetect_status celldetect_detect_file(celldetect_context *ctx, const char *path, const cell **cells, int *count);
+void celldetect_free(celldetect_context *ctx);
+const char *celldetect_strerror(celldetect_status status);
+
+#endif // CELLDETECT_CELLDETECT_H
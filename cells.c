@@ -0,0 +1,127 @@
+#include "cells.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int _bucket(const cell_list *list, int x, int y) {
+    int gx = x / CELL_GRID;
+    int gy = y / CELL_GRID;
+    if (x < 0 || y < 0 || gx >= list->grid_width || gy >= list->grid_height) {
+        return -1;
+    }
+    return gy * list->grid_width + gx;
+}
+
+/**
+ * \brief Prepares an empty list for cells inside a width x height image.
+ *
+ * \return 0 on success, -1 if the size is invalid or memory ran out.
+ */
+int cell_list_init(cell_list *list, int width, int height) {
+    memset(list, 0, sizeof(*list));
+    if (width <= 0 || height <= 0) {
+        return -1;
+    }
+    list->grid_width = (width + CELL_GRID - 1) / CELL_GRID;
+    list->grid_height = (height + CELL_GRID - 1) / CELL_GRID;
+    size_t buckets = (size_t) list->grid_width * (size_t) list->grid_height;
+    list->grid = (int *) malloc(buckets * sizeof(int));
+    if (list->grid == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < buckets; i++) {
+        list->grid[i] = -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Appends a cell.
+ *
+ * \return Index of the new cell, or -1 if it lies outside the image or memory ran out.
+ */
+int cell_list_add(cell_list *list, int x, int y) {
+    int bucket = _bucket(list, x, y);
+    if (bucket < 0) {
+        return -1;
+    }
+    if (list->count == list->capacity) {
+        int capacity = list->capacity == 0 ? 256 : 2 * list->capacity;
+        cell *cells = (cell *) realloc(list->cells, (size_t) capacity * sizeof(cell));
+        if (cells == NULL) {
+            return -1;
+        }
+        list->cells = cells;
+        int *bucket_next = (int *) realloc(list->bucket_next, (size_t) capacity * sizeof(int));
+        if (bucket_next == NULL) {
+            return -1;
+        }
+        list->bucket_next = bucket_next;
+        list->capacity = capacity;
+    }
+    int index = list->count++;
+    list->cells[index].x = x;
+    list->cells[index].y = y;
+    list->bucket_next[index] = list->grid[bucket];
+    list->grid[bucket] = index;
+    return index;
+}
+
+/**
+ * \brief Looks a cell up by position.
+ *
+ * \return Index of the cell at (x, y), or -1 if there is none.
+ */
+int cell_list_find(const cell_list *list, int x, int y) {
+    if (list == NULL || list->grid == NULL) {
+        return -1;
+    }
+    int bucket = _bucket(list, x, y);
+    if (bucket < 0) {
+        return -1;
+    }
+    for (int i = list->grid[bucket]; i >= 0; i = list->bucket_next[i]) {
+        if (list->cells[i].x == x && list->cells[i].y == y) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * \brief Counts the cells at most radius pixels away from (x, y) along both axes.
+ */
+int cell_list_near(const cell_list *list, int x, int y, int radius) {
+    if (list == NULL || list->grid == NULL) {
+        return 0;
+    }
+    int gx0 = x - radius < 0 ? 0 : (x - radius) / CELL_GRID;
+    int gy0 = y - radius < 0 ? 0 : (y - radius) / CELL_GRID;
+    int gx1 = (x + radius) / CELL_GRID;
+    int gy1 = (y + radius) / CELL_GRID;
+    if (gx1 >= list->grid_width) {
+        gx1 = list->grid_width - 1;
+    }
+    if (gy1 >= list->grid_height) {
+        gy1 = list->grid_height - 1;
+    }
+    int count = 0;
+    for (int gy = gy0; gy <= gy1; gy++) {
+        for (int gx = gx0; gx <= gx1; gx++) {
+            for (int i = list->grid[gy * list->grid_width + gx]; i >= 0; i = list->bucket_next[i]) {
+                int dx = abs(list->cells[i].x - x);
+                int dy = abs(list->cells[i].y - y);
+                if (dx <= radius && dy <= radius) {
+                    count++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+void cell_list_free(cell_list *list) {
+    free(list->cells);
+    free(list->bucket_next);
+    free(list->grid);
+    memset(list, 0, sizeof(*list));
+}
@@ -0,0 +1,35 @@
+#ifndef CELLS_CELLS_H
+#define CELLS_CELLS_H
+
+// Side of the square buckets of the cell index, in pixels
+#define CELL_GRID 16
+
+typedef struct cell {
+    int x;
+    int y;
+} cell;
+
+/**
+ * \brief Detected cells in one contiguous array, in detection order.
+ *
+ * The array grows by doubling, so cells are never allocated one by one.
+ * A coarse grid of CELL_GRID x CELL_GRID buckets indexes the array, so
+ * duplicate and neighbourhood queries only look at the nearby buckets.
+ */
+typedef struct cell_list {
+    cell *cells;
+    int count;
+    int capacity;
+    int *bucket_next;   // per cell, the previous cell of the same bucket or -1
+    int *grid;          // per bucket, the newest cell in it or -1
+    int grid_width;
+    int grid_height;
+} cell_list;
+
+int cell_list_init(cell_list *list, int width, int height);
+int cell_list_add(cell_list *list, int x, int y);
+int cell_list_find(const cell_list *list, int x, int y);
+int cell_list_near(const cell_list *list, int x, int y, int radius);
+void cell_list_free(cell_list *list);
+
+#endif // CELLS_CELLS_H
@@ -0,0 +1,282 @@
+#include "components.h"
+#include "detect.h"
+#include "function.h"
+#include "minmax.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Components up to this size along both axes are detected on their own
+#define ISOLATED_SIDE 9
+
+// Pixels around a component that must be black for it to be detected on its
+// own: a 9x9 frame reaches 7 pixels past the capture areas touching it
+#define ISOLATED_MARGIN 8
+
+void component_table_init(component_table *table) {
+    memset(table, 0, sizeof(*table));
+}
+
+static int _add_run(component_table *table, int x0, int x1, int y) {
+    if (table->run_count == table->run_capacity) {
+        int capacity = table->run_capacity == 0 ? 1024 : 2 * table->run_capacity;
+        component_run *runs = (component_run *) realloc(table->runs, (size_t) capacity * sizeof(component_run));
+        if (runs == NULL) {
+            return -1;
+        }
+        table->runs = runs;
+        table->run_capacity = capacity;
+    }
+    int index = table->run_count++;
+    table->runs[index].x0 = x0;
+    table->runs[index].x1 = x1;
+    table->runs[index].y = y;
+    table->runs[index].parent = index;
+    return index;
+}
+
+static int _find(component_run *runs, int i) {
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+// The earlier run stays the root, so every link points to an earlier run
+static void _union(component_run *runs, int a, int b) {
+    a = _find(runs, a);
+    b = _find(runs, b);
+    if (a < b) {
+        runs[b].parent = a;
+    } else if (b < a) {
+        runs[a].parent = b;
+    }
+}
+
+/**
+ * \brief Labels the 8-connected components of a mask and measures them.
+ *
+ * The first pass turns every row into runs of white pixels, straight from
+ * the packed words, and joins each run to the runs of the row above that
+ * touch it, diagonals included. The second pass goes over the runs only,
+ * resolving each to its component and adding it to the component's area,
+ * bounding box and coordinate sums. No label image is stored.
+ *
+ * \param mask The mask to label.
+ * \param table Receives the components, any previous content is replaced.
+ * \return 0 on success, -1 if memory ran out.
+ */
+int components_label(const bitimage *mask, component_table *table) {
+    table->count = 0;
+    table->run_count = 0;
+    int words = (mask->width + 63) / 64;
+    int above = 0;              // first run of the row above
+    for (int y = 0; y < mask->height; y++) {
+        const uint64_t *row = BITIMAGE_ROW(mask, y);
+        int first = table->run_count;
+        int open = -1;
+        for (int w = 0; w < words; w++) {
+            uint64_t bits = row[w];
+            int pos = 0;
+            while (pos < 64) {
+                // Look for the next white pixel, or the next black one inside a run
+                uint64_t rest = (open < 0 ? bits : ~bits) >> pos;
+                if (rest == 0) {
+                    break;
+                }
+                pos += bitimage_ctz(rest);
+                if (open < 0) {
+                    open = w * 64 + pos;
+                } else {
+                    if (_add_run(table, open, w * 64 + pos, y) < 0) {
+                        return -1;
+                    }
+                    open = -1;
+                }
+            }
+        }
+        if (open >= 0 && _add_run(table, open, mask->width, y) < 0) {
+            return -1;
+        }
+
+        // Runs of both rows are sorted, so one sweep finds every touching pair
+        int a = above;
+        for (int b = first; b < table->run_count; b++) {
+            component_run *run = &table->runs[b];
+            while (a < first && table->runs[a].x1 < run->x0) {
+                a++;
+            }
+            for (int k = a; k < first && table->runs[k].x0 <= run->x1; k++) {
+                _union(table->runs, k, b);
+            }
+        }
+        above = first;
+    }
+
+    // Links point to earlier runs, which already hold their component by then
+    for (int i = 0; i < table->run_count; i++) {
+        component_run *run = &table->runs[i];
+        component *item;
+        if (run->parent == i) {
+            if (table->count == table->capacity) {
+                int capacity = table->capacity == 0 ? 256 : 2 * table->capacity;
+                component *items = (component *) realloc(table->items, (size_t) capacity * sizeof(component));
+                if (items == NULL) {
+                    return -1;
+                }
+                table->items = items;
+                table->capacity = capacity;
+            }
+            run->parent = table->count++;
+            item = &table->items[run->parent];
+            memset(item, 0, sizeof(*item));
+            item->x0 = run->x0;
+            item->y0 = run->y;
+            item->x1 = run->x1 - 1;
+            item->y1 = run->y;
+        } else {
+            run->parent = table->runs[run->parent].parent;
+            item = &table->items[run->parent];
+        }
+        int length = run->x1 - run->x0;
+        item->area += length;
+        item->x0 = min(item->x0, run->x0);
+        item->x1 = max(item->x1, run->x1 - 1);
+        item->y1 = run->y;
+        item->sum_x += (long long) (run->x0 + run->x1 - 1) * length / 2;
+        item->sum_y += (long long) run->y * length;
+    }
+    return 0;
+}
+
+/**
+ * \brief Centroid of a component, rounded to the nearest pixel.
+ */
+void component_centroid(const component *item, int *x, int *y) {
+    *x = (int) ((2 * item->sum_x + item->area) / (2 * item->area));
+    *y = (int) ((2 * item->sum_y + item->area) / (2 * item->area));
+}
+
+/**
+ * \brief Adds one cell per component, at its centroid, for a fast count.
+ *
+ * Components too small to survive a single erode() step, which needs a
+ * white 3x3 square minus two corners, are left out like the erosion loop
+ * leaves them out. Cells that touch each other form a single component
+ * here, so the count can be lower than that of the erosion loop.
+ *
+ * \param table The components, see components_label().
+ * \param cells The list that receives the cells, in component order.
+ * \return 0 on success, -1 if memory ran out.
+ */
+int components_to_cells(const component_table *table, cell_list *cells) {
+    for (int i = 0; i < table->count; i++) {
+        const component *item = &table->items[i];
+        if (item->area < 7 || item->x1 - item->x0 < 2 || item->y1 - item->y0 < 2) {
+            continue;
+        }
+        int x, y;
+        component_centroid(item, &x, &y);
+        if (cell_list_add(cells, x, y) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Finds the cells of small, isolated components on their own and removes them from the mask.
+ *
+ * A component no larger than ISOLATED_SIDE along both axes with nothing
+ * else white within ISOLATED_MARGIN pixels cannot meet any other pixel in
+ * the erosion loop: erode() only keeps pixels whose neighbourhood is white,
+ * and no 9x9 frame or 7x7 capture area spans it and another component.
+ * Such a component is copied to a small mask of its own, eroded once and
+ * detected there. If nothing of it is left afterwards, those are exactly
+ * the cells the first step of the erosion loop gives for it, and the
+ * component is cleared from the mask so the loop never visits it.
+ * Components with pixels left are kept in the mask, untouched.
+ *
+ * \param mask The thresholded mask, before the first erosion step.
+ * \param table The components of the mask, see components_label().
+ * \param cells Receives the cells of the removed components, by component.
+ * \return 0 on success, -1 if memory ran out.
+ */
+int components_detect_isolated(bitimage *mask, const component_table *table, cell_list *cells) {
+    int side = ISOLATED_SIDE + 2 * ISOLATED_MARGIN;
+    bitimage local;
+    cell_list found;
+    if (bitimage_alloc(&local, side, side) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < table->count; i++) {
+        const component *item = &table->items[i];
+        int width = item->x1 - item->x0 + 1;
+        int height = item->y1 - item->y0 + 1;
+        int x0 = item->x0 - ISOLATED_MARGIN;
+        int y0 = item->y0 - ISOLATED_MARGIN;
+        // detectCell() never visits positions outside the mask, so the margin must fit inside
+        if (width > ISOLATED_SIDE || height > ISOLATED_SIDE || x0 < 0 || y0 < 0 ||
+            item->x1 + ISOLATED_MARGIN >= mask->width || item->y1 + ISOLATED_MARGIN >= mask->height) {
+            continue;
+        }
+        int white = 0;
+        for (int y = y0; y < y0 + height + 2 * ISOLATED_MARGIN && white <= item->area; y++) {
+            const uint64_t *row = BITIMAGE_ROW(mask, y);
+            for (int x = x0; x < x0 + width + 2 * ISOLATED_MARGIN; x += 32) {
+                int n = min(32, x0 + width + 2 * ISOLATED_MARGIN - x);
+                white += bitimage_popcount(bitimage_window(row, x, n));
+            }
+        }
+        if (white != item->area) {
+            continue;
+        }
+
+        bitimage_clear(&local);
+        for (int y = 0; y < height; y++) {
+            BITIMAGE_ROW(&local, y + ISOLATED_MARGIN)[0] =
+                bitimage_window(BITIMAGE_ROW(mask, item->y0 + y), item->x0, width) << ISOLATED_MARGIN;
+        }
+        if (erode(&local, &local)) {
+            // Gone before the first detection, so it never gives a cell
+            for (int y = item->y0; y <= item->y1; y++) {
+                bitimage_clear_span(BITIMAGE_ROW(mask, y), item->x0, width);
+            }
+            continue;
+        }
+        if (cell_list_init(&found, side, side) != 0) {
+            bitimage_free(&local);
+            return -1;
+        }
+        if (detect_cells(&local, &found, NULL) < 0) {
+            cell_list_free(&found);
+            bitimage_free(&local);
+            return -1;
+        }
+        int left = 0;
+        for (int y = 0; y < side && !left; y++) {
+            left = BITIMAGE_ROW(&local, y)[0] != 0;
+        }
+        if (!left) {
+            for (int c = 0; c < found.count; c++) {
+                if (cell_list_add(cells, found.cells[c].x + x0, found.cells[c].y + y0) < 0) {
+                    cell_list_free(&found);
+                    bitimage_free(&local);
+                    return -1;
+                }
+            }
+            for (int y = item->y0; y <= item->y1; y++) {
+                bitimage_clear_span(BITIMAGE_ROW(mask, y), item->x0, width);
+            }
+        }
+        cell_list_free(&found);
+    }
+    bitimage_free(&local);
+    return 0;
+}
+
+void component_table_free(component_table *table) {
+    free(table->items);
+    free(table->runs);
+    component_table_init(table);
+}
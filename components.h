@@ -0,0 +1,50 @@
+#ifndef COMPONENTS_COMPONENTS_H
+#define COMPONENTS_COMPONENTS_H
+
+#include "bitimage.h"
+#include "cells.h"
+
+/**
+ * \brief One 8-connected component of white pixels of a mask.
+ */
+typedef struct component {
+    int area;               // white pixels
+    int x0;                 // bounding box, inclusive
+    int y0;
+    int x1;
+    int y1;
+    long long sum_x;        // of the pixel coordinates, for the centroid
+    long long sum_y;
+} component;
+
+// A horizontal run of white pixels [x0, x1) of row y
+typedef struct component_run {
+    int x0;
+    int x1;
+    int y;
+    int parent;             // union-find link to an earlier run, then its component
+} component_run;
+
+/**
+ * \brief Components of a mask, in the order their top rows are met.
+ *
+ * The runs are scratch space, kept so a table can be refilled for image
+ * after image without allocating again.
+ */
+typedef struct component_table {
+    component *items;
+    int count;
+    int capacity;
+    component_run *runs;
+    int run_count;
+    int run_capacity;
+} component_table;
+
+void component_table_init(component_table *table);
+int components_label(const bitimage *mask, component_table *table);
+void component_centroid(const component *item, int *x, int *y);
+int components_to_cells(const component_table *table, cell_list *cells);
+int components_detect_isolated(bitimage *mask, const component_table *table, cell_list *cells);
+void component_table_free(component_table *table);
+
+#endif // COMPONENTS_COMPONENTS_H
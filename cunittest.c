@@ -1,13 +1,23 @@
-// to compile on my mac gcc -o cunittest.out cunittest.c cbmp.c function.c -I/opt/homebrew/include/CUnit -L/opt/homebrew/lib -lcunit -lm
+// to compile on my mac gcc -o cunittest.out cunittest.c cbmp.c function.c image.c bitimage.c blur.c erosion.c cells.c pool.c detect.c distance.c components.c threshold.c parallel.c pipeline.c output.c perf.c celldetect.c -I/opt/homebrew/include/CUnit -L/opt/homebrew/lib -lcunit -lm -lpthread
  // to run ./cunittest.out
 #include <CUnit.h>
 #include <Basic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include "cbmp.h"
 #include "function.h"
+#include "distance.h"
+#include "components.h"
+#include "threshold.h"
+#include "detect.h"
+#include "erosion.h"
+#include "celldetect.h"
+#include "output.h"
 
+#define TEST_WIDTH 950
+#define TEST_HEIGTH 950
 
 
 
@@ -19,77 +29,101 @@ void test_countCells(void);
 void test_cellExists(void);
 void test_greyscale(void);
 void test_detectCell(void);
+void test_gaussian_filter(void);
+void test_erode(void);
+void test_distance_transform(void);
+void test_components_label(void);
+void test_threshold_local(void);
+void test_erode_detect_cells(void);
+void test_celldetect_detect(void);
+void test_bmp_open_pgm(void);
+void test_bmp_write_patched(void);
+void test_output_cells(void);
 
 // Test case for countCells
 void test_countCells(void) {
-    cell *head = NULL;
+    cell_list cells;
+    CU_ASSERT_EQUAL(cell_list_init(&cells, 10, 10), 0);
+    CU_ASSERT_EQUAL(countCells(&cells), 0);
 
     // we create test cells
-    cell cell1 = {0, 0, NULL};
-    cell cell2 = {1, 1, &cell1};
-    cell cell3 = {2, 2, &cell2};
+    CU_ASSERT_EQUAL(cell_list_add(&cells, 0, 0), 0);
+    CU_ASSERT_EQUAL(cell_list_add(&cells, 1, 1), 1);
+    CU_ASSERT_EQUAL(cell_list_add(&cells, 2, 2), 2);
 
-    head = &cell3;
     // check here 
-    CU_ASSERT_EQUAL(countCells(head), 3);
+    CU_ASSERT_EQUAL(countCells(&cells), 3);
     CU_ASSERT_EQUAL(countCells(NULL), 0);
+    cell_list_free(&cells);
 
 
 }
 
 // Test case for cellExists
 void test_cellExists(void) {
-    cell cell1 = {0, 0, NULL};
-    cell cell2 = {1, 1, &cell1};
-    cell cell3 = {2, 2, &cell2};
-
-    cell *head = &cell3;
-
-    CU_ASSERT_TRUE(cellExists(head, 1, 1));  
-    CU_ASSERT_FALSE(cellExists(head, 3, 3));  // Cell do not exist
-    CU_ASSERT_FALSE(cellExists(NULL, 1, 1)); // test if the function correctly handles the case where the linked list is null
+    cell_list cells;
+    CU_ASSERT_EQUAL(cell_list_init(&cells, 100, 100), 0);
+    cell_list_add(&cells, 0, 0);
+    cell_list_add(&cells, 1, 1);
+    cell_list_add(&cells, 2, 2);
+    cell_list_add(&cells, 40, 40);
+
+    CU_ASSERT_TRUE(cellExists(&cells, 1, 1));  
+    CU_ASSERT_TRUE(cellExists(&cells, 40, 40));  
+    CU_ASSERT_FALSE(cellExists(&cells, 3, 3));  // Cell do not exist
+    CU_ASSERT_FALSE(cellExists(&cells, 200, 1));  // Outside the image
+    CU_ASSERT_FALSE(cellExists(NULL, 1, 1)); // test if the function correctly handles the case where the list is null
+
+    CU_ASSERT_EQUAL(cell_list_near(&cells, 1, 1, 1), 3);
+    CU_ASSERT_EQUAL(cell_list_near(&cells, 36, 36, 4), 1);
+    CU_ASSERT_EQUAL(cell_list_near(&cells, 36, 36, 3), 0);
+    cell_list_free(&cells);
 }
 
 
 // Test case for greyscale
 void test_greyscale(void) {
- unsigned char input_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
-unsigned char temp_image[BMP_WIDTH+2][BMP_HEIGTH+2];
+ image input_image;
+ image temp_image;
+    CU_ASSERT_EQUAL(image_alloc(&input_image, TEST_WIDTH, TEST_HEIGTH, BMP_CHANNELS), 0);
+    CU_ASSERT_EQUAL(image_alloc(&temp_image, TEST_WIDTH + WORK_PAD, TEST_HEIGTH + WORK_PAD, 1), 0);
 
     // Initialize the input image with some values
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            input_image[x][y][0] = 100; 
-            input_image[x][y][1] = 150;
-            input_image[x][y][2] = 200; 
+    for (int x = 0; x < TEST_WIDTH; x++) {
+        for (int y = 0; y < TEST_HEIGTH; y++) {
+            IMAGE_PIXEL(&input_image, x, y)[0] = 100; 
+            IMAGE_PIXEL(&input_image, x, y)[1] = 150;
+            IMAGE_PIXEL(&input_image, x, y)[2] = 200; 
         }
     }
 
-    greyscale(input_image, temp_image);
+    greyscale(&input_image, &temp_image);
 
  
-    CU_ASSERT_EQUAL(temp_image[2][2], (100 + 150 + 200) / 3);  // First pixel
-    CU_ASSERT_EQUAL(temp_image[BMP_WIDTH+1][BMP_WIDTH+1], (100 + 150 + 200) / 3);  // Last pixel
+    CU_ASSERT_EQUAL(IMAGE_AT(&temp_image, 2, 2), (100 + 150 + 200) / 3);  // First pixel
+    CU_ASSERT_EQUAL(IMAGE_AT(&temp_image, TEST_WIDTH+1, TEST_HEIGTH+1), (100 + 150 + 200) / 3);  // Last pixel
 
-    input_image[10][10][0] = 0;  
-    input_image[10][10][1] = 0;   
-    input_image[10][10][2] = 0;   
-    greyscale(input_image, temp_image);
-    CU_ASSERT_EQUAL(temp_image[10+2][10+2], 0); 
+    IMAGE_PIXEL(&input_image, 10, 10)[0] = 0;  
+    IMAGE_PIXEL(&input_image, 10, 10)[1] = 0;   
+    IMAGE_PIXEL(&input_image, 10, 10)[2] = 0;   
+    greyscale(&input_image, &temp_image);
+    CU_ASSERT_EQUAL(IMAGE_AT(&temp_image, 10+2, 10+2), 0); 
 
 
-    input_image[10][10][0] = 255;  
-    input_image[10][10][1] = 255;   
-    input_image[10][10][2] = 255;   
-    greyscale(input_image, temp_image);
-    CU_ASSERT_EQUAL(temp_image[10+2][10+2], 255);  
+    IMAGE_PIXEL(&input_image, 10, 10)[0] = 255;  
+    IMAGE_PIXEL(&input_image, 10, 10)[1] = 255;   
+    IMAGE_PIXEL(&input_image, 10, 10)[2] = 255;   
+    greyscale(&input_image, &temp_image);
+    CU_ASSERT_EQUAL(IMAGE_AT(&temp_image, 10+2, 10+2), 255);  
 
+    image_free(&input_image);
+    image_free(&temp_image);
 }
 
 // Test case for detectCell
 void test_detectCell(void) {
     // Create a test binary image (255 for cell, 0 for background)
-   unsigned char test_image[BMP_WIDTH + 2][BMP_HEIGTH + 2] = {
+   unsigned char test_pixels[10][10] = {
         {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
         {0, 255, 255, 0, 0, 0, 0, 0, 0, 0},
         {0, 255, 255, 0, 255, 255, 0, 0, 0, 0},
@@ -101,23 +135,449 @@ void test_detectCell(void) {
         {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
         {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
     };
-    cell *head = NULL; 
-    detectCell(test_image, &head); 
+    image test_image;
+    CU_ASSERT_EQUAL(image_alloc(&test_image, TEST_WIDTH + WORK_PAD, TEST_HEIGTH + WORK_PAD, 1), 0);
+    for (int x = 0; x < 10; x++) {
+        for (int y = 0; y < 10; y++) {
+            IMAGE_AT(&test_image, x, y) = test_pixels[x][y];
+        }
+    }
+    bitimage test_mask;
+    CU_ASSERT_EQUAL(bitimage_alloc(&test_mask, test_image.width, test_image.height), 0);
+    bitimage_pack(&test_image, &test_mask);
+    cell_list cells;
+    CU_ASSERT_EQUAL(cell_list_init(&cells, test_mask.width, test_mask.height), 0);
+    detectCell(&test_mask, &cells); 
+
+   CU_ASSERT_TRUE(cellExists(&cells, 2, 1)); 
+    CU_ASSERT_TRUE(cellExists(&cells, 2, 2)); 
+    CU_ASSERT_TRUE(cellExists(&cells, 4, 3)); 
+    CU_ASSERT_FALSE(cellExists(&cells, 1, 0)); 
+    CU_ASSERT_FALSE(cellExists(&cells, 0, 0)); 
+    CU_ASSERT_FALSE(cellExists(&cells, 5, 5)); 
+
+    cell_list_free(&cells);
+    image_free(&test_image);
+    bitimage_free(&test_mask);
+}
 
-   CU_ASSERT_TRUE(cellExists(head, 2, 1)); 
-    CU_ASSERT_TRUE(cellExists(head, 2, 2)); 
-    CU_ASSERT_TRUE(cellExists(head, 4, 3)); 
-    CU_ASSERT_FALSE(cellExists(head, 1, 0)); 
-    CU_ASSERT_FALSE(cellExists(head, 0, 0)); 
-    CU_ASSERT_FALSE(cellExists(head, 5, 5)); 
 
-    while (head) {
-        cell *temp = head;
-        head = head->next; 
-        free(temp); 
+// Test case for gaussian_filter
+void test_gaussian_filter(void) {
+    image flat, noisy, blurred;
+    CU_ASSERT_EQUAL(image_alloc(&flat, 37, 21, 1), 0);
+    CU_ASSERT_EQUAL(image_alloc(&noisy, 37, 21, 1), 0);
+    CU_ASSERT_EQUAL(image_alloc(&blurred, 37, 21, 1), 0);
+    for (int x = 0; x < 37; x++) {
+        for (int y = 0; y < 21; y++) {
+            IMAGE_AT(&flat, x, y) = 200;
+            IMAGE_AT(&noisy, x, y) = (x * 37 + y * 91) % 256;
+        }
+    }
+
+    // A flat image stays flat, including the clamped right and bottom edges
+    CU_ASSERT_EQUAL(gaussian_filter(&flat, &flat), 0);
+    CU_ASSERT_EQUAL(IMAGE_AT(&flat, 2, 2), 200);
+    CU_ASSERT_EQUAL(IMAGE_AT(&flat, 36, 20), 200);
+
+    // Filtering in place gives the same result as filtering into another image
+    CU_ASSERT_EQUAL(gaussian_filter(&noisy, &blurred), 0);
+    CU_ASSERT_EQUAL(gaussian_filter(&noisy, &noisy), 0);
+    int same = 1;
+    for (int x = 2; x < 37; x++) {
+        for (int y = 2; y < 21; y++) {
+            same &= IMAGE_AT(&noisy, x, y) == IMAGE_AT(&blurred, x, y);
+        }
     }
+    CU_ASSERT_TRUE(same);
+
+    image_free(&flat);
+    image_free(&noisy);
+    image_free(&blurred);
 }
 
+// Test case for erode
+void test_erode(void) {
+    const int width = 150, height = 40;
+    bitimage mask, eroded;
+    CU_ASSERT_EQUAL(bitimage_alloc(&mask, width, height), 0);
+    CU_ASSERT_EQUAL(bitimage_alloc(&eroded, width, height), 0);
+
+    // Mostly white blobs with a few holes, spanning several words per row
+    unsigned int seed = 12345;
+    for (int y = 2; y < height - WORK_PAD; y++) {
+        for (int x = 2; x < width - WORK_PAD; x++) {
+            seed = seed * 1103515245 + 12345;
+            if ((seed >> 16) % 8 != 0) {
+                BITIMAGE_ROW(&mask, y)[x >> 6] |= UINT64_C(1) << (x & 63);
+            }
+        }
+    }
+
+    CU_ASSERT_EQUAL(erode(&mask, &eroded), 0);
+    int same = 1;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int expected = BITIMAGE_GET(&mask, x, y) && BITIMAGE_GET(&mask, x, y + 1) &&
+                           BITIMAGE_GET(&mask, x + 1, y) && BITIMAGE_GET(&mask, x + 1, y + 1) &&
+                           BITIMAGE_GET(&mask, x + 1, y + 2) && BITIMAGE_GET(&mask, x + 2, y) &&
+                           BITIMAGE_GET(&mask, x + 2, y + 1);
+            same &= (int) BITIMAGE_GET(&eroded, x, y) == expected;
+        }
+    }
+    CU_ASSERT_TRUE(same);
+
+    // Eroding in place gives the same image, and an empty image is fully eroded
+    erode(&mask, &mask);
+    CU_ASSERT_EQUAL(memcmp(mask.buffer, eroded.buffer, sizeof(uint64_t) * mask.words * (height + 2 * BITIMAGE_MARGIN_ROWS)), 0);
+    bitimage_clear(&mask);
+    CU_ASSERT_EQUAL(erode(&mask, &mask), 1);
+
+    bitimage_free(&mask);
+    bitimage_free(&eroded);
+}
+
+// Test case for distance_transform, against repeated erode()
+void test_distance_transform(void) {
+    const int width = 150, height = 40;
+    bitimage mask, eroded;
+    image distance;
+    CU_ASSERT_EQUAL(bitimage_alloc(&mask, width, height), 0);
+    CU_ASSERT_EQUAL(bitimage_alloc(&eroded, width, height), 0);
+    CU_ASSERT_EQUAL(image_alloc(&distance, width, height, 1), 0);
+
+    // Large white blobs with a few holes, so pixels survive several steps
+    unsigned int seed = 54321;
+    for (int y = 2; y < height - WORK_PAD; y++) {
+        for (int x = 2; x < width - WORK_PAD; x++) {
+            seed = seed * 1103515245 + 12345;
+            if ((seed >> 16) % 40 != 0) {
+                BITIMAGE_ROW(&mask, y)[x >> 6] |= UINT64_C(1) << (x & 63);
+            }
+        }
+    }
+    distance_transform(&mask, &distance);
+
+    // After k steps a pixel is white exactly when the distance k pixels down and right exceeds k
+    int same = 1;
+    int steps = 0;
+    erode(&mask, &eroded);
+    for (int k = 1; k < 20; k++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int inside = x + k < width && y + k < height;
+                int expected = inside && IMAGE_AT(&distance, x + k, y + k) > k;
+                same &= (int) BITIMAGE_GET(&eroded, x, y) == expected;
+            }
+        }
+        if (erode(&eroded, &eroded)) {
+            break;
+        }
+        steps = k;
+    }
+    CU_ASSERT_TRUE(same);
+    CU_ASSERT_TRUE(steps > 1);
+
+    image_free(&distance);
+    bitimage_free(&mask);
+    bitimage_free(&eroded);
+}
+
+// Test case for components_label
+void test_components_label(void) {
+    const int width = 130, height = 20;
+    bitimage mask;
+    component_table table;
+    CU_ASSERT_EQUAL(bitimage_alloc(&mask, width, height), 0);
+    component_table_init(&table);
+
+    // A 3x2 block, a diagonal line and a run across two words joined by a pixel below it
+    for (int y = 2; y < 4; y++) {
+        BITIMAGE_ROW(&mask, y)[0] |= UINT64_C(7) << 2;
+    }
+    for (int i = 0; i < 5; i++) {
+        BITIMAGE_ROW(&mask, 8 + i)[0] |= UINT64_C(1) << (10 + i);
+    }
+    for (int x = 60; x < 70; x++) {
+        BITIMAGE_ROW(&mask, 15)[x >> 6] |= UINT64_C(1) << (x & 63);
+    }
+    BITIMAGE_ROW(&mask, 16)[1] |= UINT64_C(1) << (70 - 64);
+
+    CU_ASSERT_EQUAL(components_label(&mask, &table), 0);
+    CU_ASSERT_EQUAL(table.count, 3);
+    if (table.count == 3) {
+        CU_ASSERT_EQUAL(table.items[0].area, 6);
+        CU_ASSERT_EQUAL(table.items[0].x0, 2);
+        CU_ASSERT_EQUAL(table.items[0].y1, 3);
+        CU_ASSERT_EQUAL(table.items[1].area, 5);
+        CU_ASSERT_EQUAL(table.items[1].x1, 14);
+        CU_ASSERT_EQUAL(table.items[1].y1, 12);
+        CU_ASSERT_EQUAL(table.items[2].area, 11);
+        CU_ASSERT_EQUAL(table.items[2].x1, 70);
+        int x, y;
+        component_centroid(&table.items[1], &x, &y);
+        CU_ASSERT_EQUAL(x, 12);
+        CU_ASSERT_EQUAL(y, 10);
+    }
+
+    // Labelling again replaces the table
+    bitimage_clear(&mask);
+    CU_ASSERT_EQUAL(components_label(&mask, &table), 0);
+    CU_ASSERT_EQUAL(table.count, 0);
+
+    component_table_free(&table);
+    bitimage_free(&mask);
+}
+
+// Test case for the local mean thresholding of threshold_rows()
+void test_threshold_local(void) {
+    const int width = 150, height = 90;
+    image blur;
+    bitimage mask;
+    threshold_map map = {0};
+    CU_ASSERT_EQUAL(image_alloc(&blur, width, height, 1), 0);
+    CU_ASSERT_EQUAL(bitimage_alloc(&mask, width, height), 0);
+    unsigned int seed = 11;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1103515245 + 12345;
+            IMAGE_AT(&blur, x, y) = (unsigned char) (x + y + (seed >> 16) % 64);
+        }
+    }
+    threshold_map_build(&map, THRESHOLD_LOCAL, 120, 110.4);
+    CU_ASSERT_EQUAL(map.offset, 10);
+    CU_ASSERT_EQUAL(threshold_rows(&blur, &map, &mask, 0, height), 0);
+
+    // Against the mean of the window, clipped to the counted pixels, summed the slow way
+    int same = 1;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int expected = 0;
+            if (x >= 2 && x < width - WORK_PAD && y >= 2 && y < height - WORK_PAD) {
+                int sum = 0, count = 0;
+                for (int v = y - THRESHOLD_RADIUS; v <= y + THRESHOLD_RADIUS; v++) {
+                    for (int u = x - THRESHOLD_RADIUS; u <= x + THRESHOLD_RADIUS; u++) {
+                        if (u >= 2 && u < width - WORK_PAD && v >= 2 && v < height - WORK_PAD) {
+                            sum += IMAGE_AT(&blur, u, v);
+                            count++;
+                        }
+                    }
+                }
+                expected = (IMAGE_AT(&blur, x, y) - map.offset) * count > sum;
+            }
+            same &= (int) BITIMAGE_GET(&mask, x, y) == expected;
+        }
+    }
+    CU_ASSERT_TRUE(same);
+
+    threshold_map_free(&map);
+    image_free(&blur);
+    bitimage_free(&mask);
+}
+
+// Test case for erode_detect_cells, against erosion_step() followed by detect_cells()
+void test_erode_detect_cells(void) {
+    // A multiple of 64 wide, so the table has a block past the last word
+    const int width = 192, height = 100;
+    bitimage split, fused;
+    erosion_state steps, sweep;
+    cell_list found, joined;
+    worker_pool pool;
+    CU_ASSERT_EQUAL(bitimage_alloc(&split, width, height), 0);
+    CU_ASSERT_EQUAL(bitimage_alloc(&fused, width, height), 0);
+    CU_ASSERT_EQUAL(cell_list_init(&found, width, height), 0);
+    CU_ASSERT_EQUAL(cell_list_init(&joined, width, height), 0);
+    CU_ASSERT_EQUAL(pool_init(&pool, 3), 0);
+
+    // Blobs of different sizes, so cells are found over several steps
+    unsigned int seed = 321;
+    for (int i = 0; i < 40; i++) {
+        seed = seed * 1103515245 + 12345;
+        int cx = 4 + (int) ((seed >> 16) % (width - 8));
+        seed = seed * 1103515245 + 12345;
+        int cy = 4 + (int) ((seed >> 16) % (height - 8));
+        int radius = 1 + (int) ((seed >> 8) % 6);
+        for (int y = cy - radius; y <= cy + radius; y++) {
+            for (int x = cx - radius; x <= cx + radius; x++) {
+                if (x >= 2 && x < width - WORK_PAD && y >= 2 && y < height - WORK_PAD) {
+                    BITIMAGE_ROW(&split, y)[x >> 6] |= UINT64_C(1) << (x & 63);
+                    BITIMAGE_ROW(&fused, y)[x >> 6] |= UINT64_C(1) << (x & 63);
+                }
+            }
+        }
+    }
+    CU_ASSERT_EQUAL(erosion_init(&steps, &split), 0);
+    CU_ASSERT_EQUAL(erosion_init(&sweep, &fused), 0);
+
+    int same = 1;
+    while (same) {
+        int previous = found.count;
+        int done = erosion_step(&steps);
+        long candidates = done ? 0 : detect_cells(&split, &found, NULL);
+        same &= erode_detect_cells(&sweep, &joined, &pool) == candidates;
+        same &= (sweep.white == 0) == done && found.count == joined.count;
+        for (int i = previous; same && i < found.count; i++) {
+            same &= found.cells[i].x == joined.cells[i].x && found.cells[i].y == joined.cells[i].y;
+            erosion_mark(&steps, found.cells[i].x - 3, found.cells[i].y - 3, 7, 7);
+            erosion_mark(&sweep, joined.cells[i].x - 3, joined.cells[i].y - 3, 7, 7);
+        }
+        same &= memcmp(split.buffer, fused.buffer, sizeof(uint64_t) * split.words * (height + 2 * BITIMAGE_MARGIN_ROWS)) == 0;
+        if (done) {
+            break;
+        }
+    }
+    CU_ASSERT_TRUE(same);
+    CU_ASSERT_TRUE(found.count > 0);
+
+    pool_free(&pool);
+    erosion_free(&steps);
+    erosion_free(&sweep);
+    cell_list_free(&found);
+    cell_list_free(&joined);
+    bitimage_free(&split);
+    bitimage_free(&fused);
+}
+
+// Test case for celldetect_detect, on the same frame with 3 packed and 4 padded channels
+void test_celldetect_detect(void) {
+    const int width = 120, height = 90;
+    const size_t stride = (size_t) width * 4 + 12;
+    unsigned char *packed = (unsigned char *) calloc((size_t) width * height * 3, 1);
+    unsigned char *padded = (unsigned char *) calloc(stride * height, 1);
+    CU_ASSERT_PTR_NOT_NULL(packed);
+    CU_ASSERT_PTR_NOT_NULL(padded);
+    // Bright discs on a dark background, and noise in the padding that must not be read
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int dx = x % 30 - 15, dy = y % 30 - 15;
+            unsigned char level = dx * dx + dy * dy < 36 ? 230 : 20;
+            for (int c = 0; c < 3; c++) {
+                packed[((size_t) y * width + x) * 3 + c] = level;
+                padded[y * stride + (size_t) x * 4 + c] = level;
+            }
+            padded[y * stride + (size_t) x * 4 + 3] = 255;
+        }
+        memset(padded + y * stride + (size_t) width * 4, 255, stride - (size_t) width * 4);
+    }
+
+    celldetect_options options;
+    celldetect_options_init(&options);
+    options.threads = 2;
+    celldetect_context one, two;
+    CU_ASSERT_EQUAL(celldetect_init(&one, &options), CELLDETECT_OK);
+    CU_ASSERT_EQUAL(celldetect_init(&two, &options), CELLDETECT_OK);
+    celldetect_frame frame = {packed, width, height, (size_t) width * 3, 3};
+    celldetect_frame framed = {padded, width, height, stride, 4};
+    const cell *cells, *others;
+    int count, others_count;
+    CU_ASSERT_EQUAL(celldetect_detect(&one, &frame, &cells, &count), CELLDETECT_OK);
+    CU_ASSERT_EQUAL(celldetect_detect(&two, &framed, &others, &others_count), CELLDETECT_OK);
+    CU_ASSERT_EQUAL(count, 12);
+    CU_ASSERT_EQUAL(count, others_count);
+    for (int i = 0; i < count && i < others_count; i++) {
+        CU_ASSERT_TRUE(cells[i].x == others[i].x && cells[i].y == others[i].y);
+    }
+
+    frame.stride = (size_t) width * 3 - 1;
+    CU_ASSERT_EQUAL(celldetect_detect(&one, &frame, &cells, &count), CELLDETECT_ERR_ARGUMENT);
+    CU_ASSERT_EQUAL(count, 0);
+
+    celldetect_free(&one);
+    celldetect_free(&two);
+    free(packed);
+    free(padded);
+}
+
+// Test case for bmp_open on a PGM file of 16 grey levels, read by greyscale_work_row()
+void test_bmp_open_pgm(void) {
+    const char *path = "cunittest_grey.pgm";
+    FILE *fp = fopen(path, "wb");
+    CU_ASSERT_PTR_NOT_NULL(fp);
+    if (fp == NULL) {
+        return;
+    }
+    const unsigned char pixels[6] = {0, 15, 5, 10, 1, 14};
+    fputs("P5\n# 3 x 2, 16 levels\n3 2\n15\n", fp);
+    fwrite(pixels, 1, sizeof(pixels), fp);
+    fclose(fp);
+
+    bmp_file file;
+    CU_ASSERT_EQUAL(bmp_open(path, &file), BMP_OK);
+    CU_ASSERT_EQUAL(file.width, 3);
+    CU_ASSERT_EQUAL(file.height, 2);
+    CU_ASSERT_EQUAL(file.channels, 1);
+    CU_ASSERT_FALSE(file.plain_grey);
+    unsigned char row[3 + WORK_PAD];
+    greyscale_work_row(&file, WORK_PAD + 1, row);
+    // Levels are stretched to 0 to 255
+    CU_ASSERT_TRUE(row[0] == 0 && row[1] == 0 && row[2] == 170 && row[3] == 17 && row[4] == 238);
+    bmp_close(&file);
+    remove(path);
+}
+
+// Test case for bmp_write_patched writing over the file it patches
+void test_bmp_write_patched(void) {
+    const char *path = "cunittest_patched.bmp";
+    image source;
+    CU_ASSERT_EQUAL(image_alloc(&source, 5, 3, 3), 0);
+    for (int y = 0; y < 3; y++) {
+        memset(IMAGE_PIXEL(&source, 0, y), 40 * y, 5 * 3);
+    }
+    CU_ASSERT_EQUAL(bmp_write_image(&source, path), BMP_OK);
+    image_free(&source);
+
+    bmp_file file;
+    CU_ASSERT_EQUAL(bmp_open(path, &file), BMP_OK);
+    size_t size = file.size;
+    bmp_patches patches;
+    bmp_patches_init(&patches);
+    const unsigned char red[3] = {255, 0, 0};
+    CU_ASSERT_EQUAL(bmp_patch_pixels(&patches, &file, 2, 1, 1), BMP_OK);
+    CU_ASSERT_EQUAL(bmp_patches_merge(&patches, &file), BMP_OK);
+    CU_ASSERT_TRUE(bmp_patch_set_pixels(&patches, &file, 2, 1, red, 1));
+    CU_ASSERT_EQUAL(bmp_write_patched(&file, &patches, path), BMP_OK);
+    bmp_patches_free(&patches);
+    bmp_close(&file);
+
+    CU_ASSERT_EQUAL(bmp_open(path, &file), BMP_OK);
+    CU_ASSERT_EQUAL(file.size, size);
+    const unsigned char *row = bmp_row(&file, 1);
+    CU_ASSERT_TRUE(row[2 * 3] == 0 && row[2 * 3 + 1] == 0 && row[2 * 3 + 2] == 255);
+    CU_ASSERT_TRUE(row[3 * 3] == 40 && bmp_row(&file, 2)[0] == 80);
+    bmp_close(&file);
+    remove(path);
+}
+
+// Test case for output_cells
+void test_output_cells(void) {
+    const cell cells[2] = {{12, 3}, {0, 940}};
+    output_format format;
+    CU_ASSERT_EQUAL(output_parse_format("json", &format), 0);
+    CU_ASSERT_EQUAL(format, OUTPUT_JSON);
+    CU_ASSERT_EQUAL(output_parse_format("xml", &format), -1);
+
+    FILE *fp = tmpfile();
+    CU_ASSERT_PTR_NOT_NULL(fp);
+    if (fp == NULL) {
+        return;
+    }
+    char text[128] = {0};
+    CU_ASSERT_EQUAL(output_cells(fp, cells, 2, OUTPUT_JSON), 0);
+    rewind(fp);
+    CU_ASSERT_TRUE(fread(text, 1, sizeof(text) - 1, fp) > 0);
+    CU_ASSERT_STRING_EQUAL(text, "{\"count\": 2, \"cells\": [[12, 3], [0, 940]]}\n");
+
+    // "CELL", the count, then the coordinates, all little-endian
+    const unsigned char expected[20] = {'C', 'E', 'L', 'L', 2, 0, 0, 0, 12, 0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0};
+    unsigned char bytes[24];
+    rewind(fp);
+    CU_ASSERT_EQUAL(output_cells(fp, cells, 2, OUTPUT_BINARY), 0);
+    rewind(fp);
+    CU_ASSERT_EQUAL(fread(bytes, 1, sizeof(bytes), fp), sizeof(bytes));
+    CU_ASSERT_EQUAL(memcmp(bytes, expected, sizeof(expected)), 0);
+    CU_ASSERT_TRUE(bytes[20] == (940 & 255) && bytes[21] == (940 >> 8));
+    fclose(fp);
+}
 
 int main() {
     // this code is from a website
@@ -134,7 +594,17 @@ int main() {
     if ((NULL == CU_add_test(pSuite, "test of countCells()", test_countCells)) ||
         (NULL == CU_add_test(pSuite, "test of cellExists()", test_cellExists)) ||
         (NULL == CU_add_test(pSuite, "test of greyscale()", test_greyscale))||
-        (NULL == CU_add_test(pSuite, "test of detectCell()", test_detectCell))) {
+        (NULL == CU_add_test(pSuite, "test of detectCell()", test_detectCell))||
+        (NULL == CU_add_test(pSuite, "test of gaussian_filter()", test_gaussian_filter))||
+        (NULL == CU_add_test(pSuite, "test of erode()", test_erode))||
+        (NULL == CU_add_test(pSuite, "test of distance_transform()", test_distance_transform))||
+        (NULL == CU_add_test(pSuite, "test of components_label()", test_components_label))||
+        (NULL == CU_add_test(pSuite, "test of threshold_rows()", test_threshold_local))||
+        (NULL == CU_add_test(pSuite, "test of erode_detect_cells()", test_erode_detect_cells))||
+        (NULL == CU_add_test(pSuite, "test of celldetect_detect()", test_celldetect_detect))||
+        (NULL == CU_add_test(pSuite, "test of bmp_open() on a PGM file", test_bmp_open_pgm))||
+        (NULL == CU_add_test(pSuite, "test of bmp_write_patched() in place", test_bmp_write_patched))||
+        (NULL == CU_add_test(pSuite, "test of output_cells()", test_output_cells))) {
         CU_cleanup_registry();
         return CU_get_error();
     }
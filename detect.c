@@ -0,0 +1,455 @@
+#include "detect.h"
+#include "function.h"
+#include "minmax.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Positions skipped at once when a run of capture areas is black
+#define CELL_SKIP 16
+
+// Progress values a band publishes while eroding its first two word columns,
+// before it detects anything, see _erode_detect_band()
+#define DETECT_LEAD 2
+
+// Summed-area table of white pixels over rows [first, end) of a mask.
+// Entry (x, y) counts the white pixels of those rows above y and left of x.
+// Entries are stored in blocks of 64 columns, each block row after row, so
+// a block is built in one run and the rows of a column are 256 bytes apart.
+typedef struct cell_sat {
+    unsigned int *sum;
+    unsigned int *runs;     // per row, white pixels left of the last block built
+    int width;
+    int first;
+    int end;
+} cell_sat;
+
+// List of positions, stored as x, y pairs
+typedef struct detect_points {
+    int *xy;
+    int count;
+} detect_points;
+
+typedef struct detect_band {
+    int first;              // rows of the positions the band owns
+    int end;
+    cell_sat sat;           // covers the band and DETECT_HALO rows around it
+    detect_points found;    // cells found, column by column; their capture areas are cleared
+    long candidates;        // positions tested, with a white pixel in the capture area
+    long removed;           // pixels the erosion of erode_detect_cells() turned black in the band
+    const detect_points *lists[3]; // clears that can reach the band: its own and those of both neighbours
+    int recent[3];          // first clear of each list that can still reach the current column
+} detect_band;
+
+typedef struct detect_job {
+    bitimage *mask;
+    detect_band *bands;
+    int count;
+    worker_pool *pool;
+    int lead;               // added to every progress value, DETECT_LEAD when eroding too
+    erosion_state *erosion; // state of erode_detect_cells(), NULL for detect_cells()
+    uint64_t *seams;        // two rows of words per band, for erosion_step_seam()
+} detect_job;
+
+// Blocks of 64 entries across, for entries 0 to width
+static int _sat_blocks(const cell_sat *sat) {
+    return sat->width / 64 + 1;
+}
+
+static size_t _sat_block_size(const cell_sat *sat) {
+    return ((size_t) (sat->end - sat->first) + 1) * 64;
+}
+
+/**
+ * \brief Adds block b, entries [64 b, 64 b + 64), to the table.
+ *
+ * The blocks left of it must be in the table already, so it can be built
+ * a block at a time right behind the erosion.
+ */
+static void _sat_build(cell_sat *sat, const bitimage *mask, int b) {
+    unsigned int *block = sat->sum + (size_t) b * _sat_block_size(sat);
+    int entries = min(64, sat->width + 1 - 64 * b);
+    if (b == 0) {
+        memset(sat->runs, 0, (size_t) (sat->end - sat->first) * sizeof(unsigned int));
+    }
+    memset(block, 0, 64 * sizeof(unsigned int));
+    for (int y = sat->first; y < sat->end; y++) {
+        unsigned int *current = block + (size_t) (y - sat->first + 1) * 64;
+        const unsigned int *above = current - 64;
+        unsigned int run = sat->runs[y - sat->first];
+        uint64_t bits = 64 * b < sat->width ? BITIMAGE_ROW(mask, y)[b] : 0;
+        if (bits == 0 && entries == 64) {
+            // Most of the mask is black, so whole words add nothing to the row
+            for (int i = 0; i < 64; i++) {
+                current[i] = above[i] + run;
+            }
+            continue;
+        }
+        for (int i = 0; i < entries; i++, bits >>= 1) {
+            current[i] = above[i] + run;
+            run += (unsigned int) (bits & 1);
+        }
+        sat->runs[y - sat->first] = run;
+    }
+}
+
+/**
+ * \brief Counts the white pixels in columns [x0, x1) of rows [y0, y1).
+ *
+ * Parts of the rectangle outside the image count as black, like the guard
+ * margin. Rows of the image the table does not cover must not be asked for.
+ */
+static unsigned int _sat_rect(const cell_sat *sat, int x0, int y0, int x1, int y1) {
+    x0 = max(x0, 0);
+    y0 = max(y0, sat->first);
+    x1 = min(x1, sat->width);
+    y1 = min(y1, sat->end);
+    if (x0 >= x1 || y0 >= y1) {
+        return 0;
+    }
+    size_t block = _sat_block_size(sat);
+    const unsigned int *left = sat->sum + (size_t) (x0 >> 6) * block + (x0 & 63);
+    const unsigned int *right = sat->sum + (size_t) (x1 >> 6) * block + (x1 & 63);
+    size_t top = (size_t) (y0 - sat->first) * 64;
+    size_t bottom = (size_t) (y1 - sat->first) * 64;
+    return right[bottom] - left[bottom] - right[top] + left[top];
+}
+
+static unsigned int _sat_square(const cell_sat *sat, int x, int y, int radius) {
+    return _sat_rect(sat, x - radius, y - radius, x + radius + 1, y + radius + 1);
+}
+
+// Only the owner of a list adds to it, within the room reserved before the run
+static void _points_add(detect_points *points, int x, int y) {
+    points->xy[2 * points->count] = x;
+    points->xy[2 * points->count + 1] = y;
+    points->count++;
+}
+
+/**
+ * \brief Checks if a capture area cleared since column x - 7 reaches the 9x9 square of (x, y).
+ *
+ * \param points Cleared centres, in column order.
+ * \param first Index of the first centre with a column >= x - 7.
+ */
+static int _cleared_near(const detect_points *points, int first, int y) {
+    for (int i = first; i < points->count; i++) {
+        if (abs(points->xy[2 * i + 1] - y) <= 7) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void _detect_lists(detect_job *job, int index) {
+    detect_band *band = &job->bands[index];
+    band->lists[0] = &band->found;
+    band->lists[1] = index > 0 ? &job->bands[index - 1].found : NULL;
+    band->lists[2] = index + 1 < job->count ? &job->bands[index + 1].found : NULL;
+    memset(band->recent, 0, sizeof(band->recent));
+}
+
+/**
+ * \brief Runs detection over the positions of columns [from, end) of one band, column by column.
+ *
+ * Positions are visited in the serial order as far as any two of them can
+ * see each other's clears: column x of a band starts once the band above
+ * has finished column x and the band below column x - 1. Bands further
+ * away are more than 7 rows apart and never interact.
+ */
+static void _detect_columns(detect_job *job, int index, int from, int end) {
+    detect_band *band = &job->bands[index];
+    bitimage *mask = job->mask;
+    const cell_sat *sat = &band->sat;
+    const detect_points *const *lists = band->lists;
+    int *recent = band->recent;
+
+    for (int x = from; x < end; x++) {
+        // No capture area in this column of the band had a white pixel to begin with
+        if (_sat_rect(sat, x - 3, band->first - 3, x + 4, band->end + 3) == 0) {
+            pool_publish(job->pool, index, job->lead + x + 1);
+            continue;
+        }
+        if (lists[1] != NULL) {
+            pool_wait(job->pool, index - 1, job->lead + x + 1);
+        }
+        if (lists[2] != NULL) {
+            pool_wait(job->pool, index + 1, job->lead + x);
+        }
+        // Clears more than 7 columns back cannot reach the 9x9 square of column x
+        for (int l = 0; l < 3; l++) {
+            while (lists[l] != NULL && recent[l] < lists[l]->count && lists[l]->xy[2 * recent[l]] < x - 7) {
+                recent[l]++;
+            }
+        }
+
+        for (int y = band->first; y < band->end; y++) {
+            // Skip runs of positions whose capture areas were all black to begin with
+            while (y + CELL_SKIP <= band->end && _sat_rect(sat, x - 3, y - 3, x + 4, y + CELL_SKIP + 3) == 0) {
+                y += CELL_SKIP;
+            }
+            if (y >= band->end) {
+                break;
+            }
+            unsigned int inside = _sat_square(sat, x, y, 3);
+            // Clearing only removes white pixels, so the table never misses one
+            if (inside == 0) {
+                continue;
+            }
+            band->candidates++;
+            int stale = 0;
+            for (int l = 0; l < 3 && !stale; l++) {
+                stale = lists[l] != NULL && _cleared_near(lists[l], recent[l], y);
+            }
+
+            int ExclusionFrameBlack;
+            int WhitePixelfound;
+            if (!stale) {
+                ExclusionFrameBlack = _sat_square(sat, x, y, 4) == inside;
+                WhitePixelfound = 1;
+            } else {
+                // Bits 0 and 8 are the frame's left and right columns, 1..7 the capture area
+                unsigned int frame = (unsigned int) bitimage_window(BITIMAGE_ROW(mask, y - 4), x - 4, 9) |
+                                     (unsigned int) bitimage_window(BITIMAGE_ROW(mask, y + 4), x - 4, 9);
+                unsigned int bits = 0;
+                for (int j = -3; j <= 3; j++) {
+                    bits |= (unsigned int) bitimage_window(BITIMAGE_ROW(mask, y + j), x - 4, 9);
+                }
+                ExclusionFrameBlack = frame == 0 && (bits & 0x101) == 0;
+                WhitePixelfound = (bits & 0xFE) != 0;
+            }
+
+            // If at least one white pixel is found inside and the exclusion frame is black, register a cell
+            if (WhitePixelfound && ExclusionFrameBlack) {
+                _points_add(&band->found, x, y);
+
+                // Set the entire capturing area to black to avoid detecting the same cell again
+                for (int j = -3; j <= 3; j++) {
+                    bitimage_clear_span(BITIMAGE_ROW(mask, y + j), x - 3, 7);
+                }
+            }
+        }
+        pool_publish(job->pool, index, job->lead + x + 1);
+    }
+}
+
+static void _detect_task(void *arg, int index, int count) {
+    detect_job *job = (detect_job *) arg;
+    (void) count;
+    if (index < job->count) {
+        cell_sat *sat = &job->bands[index].sat;
+        for (int b = 0; b < _sat_blocks(sat); b++) {
+            _sat_build(sat, job->mask, b);
+        }
+    }
+    // Every table must see the mask before any band clears a capture area
+    pool_barrier(job->pool);
+    if (index < job->count) {
+        _detect_lists(job, index);
+        _detect_columns(job, index, 0, job->mask->width);
+    }
+}
+
+/**
+ * \brief Erodes the rows of one band and detects its positions in the same sweep, a word column at a time.
+ *
+ * Detection goes column by column, so it can only run behind the erosion
+ * front if the front moves across: once word column w is eroded in every
+ * row, positions up to column 64 (w - 1) + 58 have their 9x9 squares in
+ * eroded words and in table blocks up to w - 1, and capture areas cleared
+ * there never reach words the erosion still reads. The table gets block
+ * w - 1 as soon as the bands around have eroded that word too. Until a band detects anything, its
+ * progress counts the word columns it eroded, hence DETECT_LEAD.
+ */
+static void _erode_detect_band(detect_job *job, int index, int first, int end, const uint64_t *seam) {
+    detect_band *band = &job->bands[index];
+    erosion_state *state = job->erosion;
+    int width = job->mask->width;
+    int words = state->words;
+    int x = 0;
+    _detect_lists(job, index);
+    for (int w = 0; w <= words; w++) {
+        if (w < words) {
+            band->removed += erosion_step_word(state, first, end, seam, w);
+        }
+        // Also when the mask is a single word wide, so detection starts from DETECT_LEAD
+        if (w < DETECT_LEAD) {
+            pool_publish(job->pool, index, w + 1);
+        }
+        if (w == 0) {
+            continue;
+        }
+        // A band has eroded word v once it has finished column 64 (v - 2) + 59
+        int v = w - 1;
+        int eroded = v < DETECT_LEAD ? v + 1 : DETECT_LEAD + 64 * (v - 2) + 60;
+        if (index > 0) {
+            pool_wait(job->pool, index - 1, eroded);
+        }
+        if (index + 1 < job->count) {
+            pool_wait(job->pool, index + 1, eroded);
+        }
+        _sat_build(&band->sat, job->mask, v);
+        // The table has one more block than the mask has words when the width is a multiple of 64
+        for (int b = words; w == words && b < _sat_blocks(&band->sat); b++) {
+            _sat_build(&band->sat, job->mask, b);
+        }
+        int limit = w < words ? min(64 * v + 59, width) : width;
+        _detect_columns(job, index, x, limit);
+        x = limit;
+    }
+}
+
+static void _erode_detect_task(void *arg, int index, int count) {
+    detect_job *job = (detect_job *) arg;
+    erosion_state *state = job->erosion;
+    int height = job->mask->height;
+    int first = 0;
+    int end = 0;
+    uint64_t *seam = job->seams + (size_t) index * 2 * state->words;
+    (void) count;
+    // The erosion bands are the detection bands, without the padding rows
+    if (index < job->count) {
+        first = max(job->bands[index].first, WORK_PAD);
+        end = min(job->bands[index].end, height - WORK_PAD);
+        erosion_step_seam(state, first, end, seam);
+    }
+    // The seam rows of the band above read the first rows of this band
+    pool_barrier(job->pool);
+    if (index < job->count) {
+        _erode_detect_band(job, index, first, end, seam);
+    }
+    // The next dirty words depend on the changes of the band below
+    pool_barrier(job->pool);
+    if (index < job->count) {
+        erosion_step_dirty(state, first, end);
+    }
+}
+
+static void _free_bands(detect_band *bands, int count) {
+    for (int i = 0; i < count; i++) {
+        free(bands[i].sat.sum);
+        free(bands[i].sat.runs);
+        free(bands[i].found.xy);
+    }
+    free(bands);
+}
+
+static long _detect_run(bitimage *mask, cell_list *cells, worker_pool *pool, erosion_state *erosion) {
+    int width = mask->width;
+    int height = mask->height;
+    int count = max(1, min(pool_threads(pool), height / DETECT_MIN_BAND));
+    detect_band *bands = (detect_band *) calloc((size_t) count, sizeof(detect_band));
+    if (bands == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        detect_band *band = &bands[i];
+        pool_band(0, height, i, count, &band->first, &band->end);
+        band->sat.width = width;
+        band->sat.first = max(band->first - DETECT_HALO, 0);
+        band->sat.end = min(band->end + DETECT_HALO, height);
+        band->sat.sum = (unsigned int *) malloc((size_t) _sat_blocks(&band->sat) * _sat_block_size(&band->sat) *
+                                                sizeof(unsigned int));
+        band->sat.runs = (unsigned int *) malloc((size_t) (band->sat.end - band->sat.first) * sizeof(unsigned int));
+        // Neighbours read the list while it grows, so it never moves: a cell clears its capture
+        // area inside a black frame, so no two cells of one call are less than 2 pixels apart
+        size_t room = (size_t) ((width + 1) / 2) * (size_t) ((band->end - band->first + 1) / 2);
+        band->found.xy = (int *) malloc(room * 2 * sizeof(int));
+        if (band->sat.sum == NULL || band->sat.runs == NULL || band->found.xy == NULL) {
+            _free_bands(bands, count);
+            return -1;
+        }
+    }
+
+    detect_job job = {mask, bands, count, pool, 0, erosion, NULL};
+    if (erosion == NULL) {
+        pool_run(pool, _detect_task, &job);
+    } else {
+        job.lead = DETECT_LEAD;
+        job.seams = (uint64_t *) malloc((size_t) pool_threads(pool) * 2 * (size_t) erosion->words * sizeof(uint64_t));
+        if (job.seams == NULL) {
+            _free_bands(bands, count);
+            return -1;
+        }
+        pool_run(pool, _erode_detect_task, &job);
+        free(job.seams);
+        for (int i = 0; i < count; i++) {
+            erosion->white -= bands[i].removed;
+        }
+    }
+
+    // Merge the bands back into the serial order: by column, then by row
+    int *next = (int *) calloc((size_t) count, sizeof(int));
+    if (next == NULL) {
+        _free_bands(bands, count);
+        return -1;
+    }
+    long candidates = 0;
+    for (int i = 0; i < count; i++) {
+        candidates += bands[i].candidates;
+    }
+    for (;;) {
+        int best = -1;
+        for (int i = 0; i < count; i++) {
+            if (next[i] == bands[i].found.count) {
+                continue;
+            }
+            // Bands are ordered top to bottom, so the first of equal columns comes first
+            if (best < 0 || bands[i].found.xy[2 * next[i]] < bands[best].found.xy[2 * next[best]]) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        int x = bands[best].found.xy[2 * next[best]];
+        int y = bands[best].found.xy[2 * next[best] + 1];
+        next[best]++;
+        if (cell_list_find(cells, x, y) < 0 && cell_list_add(cells, x, y) < 0) {
+            candidates = -1;
+            break;
+        }
+    }
+    free(next);
+    _free_bands(bands, count);
+    return candidates;
+}
+
+/**
+ * \brief Detects cells in a mask and appends the new ones to a cell list.
+ *
+ * A cell is registered at (x, y) when the 9x9 frame around it is black and
+ * the 7x7 capture area inside has a white pixel; the capture area is then
+ * cleared. Both tests are answered from a summed-area table built once per
+ * call. Clearing a capture area only makes the table stale for positions
+ * whose 9x9 square overlaps it, so those few positions are tested on the
+ * bits instead.
+ *
+ * With a pool, horizontal bands of positions run as a wavefront. The cells
+ * are appended in the order a serial run finds them, so the result does
+ * not depend on the number of threads.
+ *
+ * \param mask The bit image, capture areas of the cells found are cleared.
+ * \param cells The list that receives the new cells.
+ * \param pool Threads to run on, or NULL to run on the calling thread.
+ * \return Number of positions tested: those whose capture area had a white pixel, or -1 if memory ran out.
+ */
+long detect_cells(bitimage *mask, cell_list *cells, worker_pool *pool) {
+    return _detect_run(mask, cells, pool, NULL);
+}
+
+/**
+ * \brief Runs one erosion step and the detection after it in a single sweep over the mask.
+ *
+ * Gives the same mask, cells and return value as parallel_erosion_step()
+ * followed by detect_cells(), but the words of each column are eroded,
+ * summed and searched while they are still in cache. The caller reports
+ * the cleared capture areas with erosion_mark() as usual.
+ *
+ * \param erosion The erosion state of the mask, white is updated.
+ * \param cells The list that receives the new cells.
+ * \param pool Threads to run on, or NULL to run on the calling thread.
+ * \return Number of positions tested, 0 if the step left the mask black, or -1 if memory ran out.
+ */
+long erode_detect_cells(erosion_state *erosion, cell_list *cells, worker_pool *pool) {
+    return _detect_run(erosion->mask, cells, pool, erosion);
+}
@@ -0,0 +1,27 @@
+#ifndef DETECT_DETECT_H
+#define DETECT_DETECT_H
+
+#include "bitimage.h"
+#include "cells.h"
+#include "erosion.h"
+#include "pool.h"
+
+// Bands of detection are never thinner than this, so that only
+// neighbouring bands can clear pixels the other one looks at
+#define DETECT_MIN_BAND 16
+
+// Pixels the 9x9 frame reads on each side of a position, and so the rows
+// a band reads above and below its own
+#define DETECT_HALO 4
+
+// How the cells of a thresholded mask are found
+typedef enum detect_mode {
+    DETECT_EROSION,     // erode and detect until the mask is empty
+    DETECT_DISTANCE,    // regional maxima of one distance transform, see distance.c
+    DETECT_COMPONENTS   // one cell per connected component, a fast count
+} detect_mode;
+
+long detect_cells(bitimage *mask, cell_list *cells, worker_pool *pool);
+long erode_detect_cells(erosion_state *erosion, cell_list *cells, worker_pool *pool);
+
+#endif // DETECT_DETECT_H
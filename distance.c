@@ -0,0 +1,363 @@
+#include "distance.h"
+#include "minmax.h"
+#include <stdlib.h>
+
+// Half the sides of the 9x9 frame and of the 7x7 capture area inside it
+#define FRAME_RADIUS 4
+#define CAPTURE_RADIUS 3
+
+// What became of a peak
+#define PEAK_PENDING 0      // queued at its level
+#define PEAK_BLOCKED 1      // its frame does not clear before the peak erodes away
+#define PEAK_DONE 2         // registered, or inside a capture area that was cleared
+
+// A peak queued for the erosion step it is isolated at, with the cell it gives
+typedef struct peak_entry {
+    int level;
+    int x;
+    int y;
+    int peak;
+} peak_entry;
+
+// Binary min-heap of entries in the order iterative detection finds them
+typedef struct peak_heap {
+    peak_entry *entries;
+    int count;
+    int size;
+} peak_heap;
+
+typedef struct peak_set {
+    cell_list where;        // peak positions, finds the peak at a position
+    int *level;             // erosion step a pending peak is queued at
+    int *x;                 // and the cell it gives there
+    int *y;
+    unsigned char *state;
+    int size;
+} peak_set;
+
+/**
+ * \brief Computes how many erosion steps every pixel of a mask survives.
+ *
+ * erode() keeps pixel (x, y) when the 7 pixels of
+ *
+ *     (x, y)     (x+1, y)     (x+2, y)
+ *     (x, y+1)   (x+1, y+1)   (x+2, y+1)
+ *                (x+1, y+2)
+ *
+ * are white, so after k steps the mask is white at (x, y) exactly when
+ * distance(x + k, y + k) > k, where distance counts the steps of that
+ * shape (centred on (x+1, y+1)) needed to reach a black pixel. Steps
+ * commute, so every shortest path can be taken as all its upward and left
+ * steps first, which makes one forward and one backward pass exact.
+ *
+ * \param mask The thresholded mask.
+ * \param distance Grey image of the mask's size that receives the steps,
+ *                 0 on black pixels and at most 255.
+ */
+void distance_transform(const bitimage *mask, image *distance) {
+    int width = mask->width;
+    int height = mask->height;
+    // The guard margin of the image reads as black above and beside the edges
+    for (int y = 0; y < height; y++) {
+        const unsigned char *above = &IMAGE_AT(distance, 0, y - 1);
+        unsigned char *row = &IMAGE_AT(distance, 0, y);
+        for (int x = 0; x < width; x++) {
+            if (!BITIMAGE_GET(mask, x, y)) {
+                row[x] = 0;
+                continue;
+            }
+            int shortest = min(min(above[x - 1], above[x]), min(above[x + 1], row[x - 1]));
+            row[x] = (unsigned char) min(shortest + 1, 255);
+        }
+    }
+    for (int y = height - 1; y >= 0; y--) {
+        const unsigned char *below = &IMAGE_AT(distance, 0, y + 1);
+        unsigned char *row = &IMAGE_AT(distance, 0, y);
+        for (int x = width - 1; x >= 0; x--) {
+            if (row[x] != 0) {
+                row[x] = (unsigned char) min(row[x], min(row[x + 1], below[x]) + 1);
+            }
+        }
+    }
+}
+
+/**
+ * \brief Tells if entry a is found before entry b: by erosion step, then column, then row.
+ */
+static int _before(const peak_entry *a, const peak_entry *b) {
+    if (a->level != b->level) {
+        return a->level < b->level;
+    }
+    if (a->x != b->x) {
+        return a->x < b->x;
+    }
+    return a->y < b->y;
+}
+
+static int _heap_push(peak_heap *heap, peak_entry entry) {
+    if (heap->count == heap->size) {
+        int size = heap->size == 0 ? 256 : 2 * heap->size;
+        peak_entry *entries = (peak_entry *) realloc(heap->entries, (size_t) size * sizeof(peak_entry));
+        if (entries == NULL) {
+            return -1;
+        }
+        heap->entries = entries;
+        heap->size = size;
+    }
+    int i = heap->count++;
+    while (i > 0 && _before(&entry, &heap->entries[(i - 1) / 2])) {
+        heap->entries[i] = heap->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->entries[i] = entry;
+    return 0;
+}
+
+static peak_entry _heap_pop(peak_heap *heap) {
+    peak_entry top = heap->entries[0];
+    peak_entry last = heap->entries[--heap->count];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= heap->count) {
+            break;
+        }
+        if (child + 1 < heap->count && _before(&heap->entries[child + 1], &heap->entries[child])) {
+            child++;
+        }
+        if (!_before(&heap->entries[child], &last)) {
+            break;
+        }
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+    heap->entries[i] = last;
+    return top;
+}
+
+/**
+ * \brief Largest distance on the 9x9 frame around (x, y).
+ */
+static int _frame_max(const image *distance, int x, int y) {
+    int highest = 0;
+    for (int i = -FRAME_RADIUS; i <= FRAME_RADIUS; i++) {
+        highest = max(highest, IMAGE_AT(distance, x + i, y - FRAME_RADIUS));
+        highest = max(highest, IMAGE_AT(distance, x + i, y + FRAME_RADIUS));
+        highest = max(highest, IMAGE_AT(distance, x - FRAME_RADIUS, y + i));
+        highest = max(highest, IMAGE_AT(distance, x + FRAME_RADIUS, y + i));
+    }
+    return highest;
+}
+
+/**
+ * \brief Queues a peak at the first erosion step from floor on where a frame around it is black.
+ *
+ * Step k shows the pixel at (x, y) of the distance image at (x - k, y - k)
+ * of the mask, so the frame around the cell at (x - k, y - k) is black
+ * when the distances on the frame around (x, y) are at most k. Any frame
+ * whose capture area holds the peak will do, as long as the peak itself
+ * survives step k; of those, the first one detectCell() would reach is
+ * taken. A frame that clears on step floor but in a column the scan has
+ * already passed waits for the next step, like it would in detectCell().
+ *
+ * \param after The cell registered on step floor that this follows, or NULL.
+ * \return 0, or -1 when the heap could not grow.
+ */
+static int _queue(peak_set *peaks, peak_heap *heap, const image *distance, int peak, int floor,
+                   const cell *after) {
+    int px = peaks->where.cells[peak].x;
+    int py = peaks->where.cells[peak].y;
+    int height = IMAGE_AT(distance, px, py);
+    peak_entry best = {height, 0, 0, peak};
+    for (int dx = -CAPTURE_RADIUS; dx <= CAPTURE_RADIUS; dx++) {
+        for (int dy = -CAPTURE_RADIUS; dy <= CAPTURE_RADIUS; dy++) {
+            peak_entry entry = {max(_frame_max(distance, px + dx, py + dy), floor), 0, 0, peak};
+            if (entry.level > best.level) {
+                continue;
+            }
+            entry.x = px + dx - entry.level;
+            entry.y = py + dy - entry.level;
+            if (after != NULL && entry.level == floor &&
+                (entry.x < after->x || (entry.x == after->x && entry.y < after->y))) {
+                entry.level++;
+                entry.x--;
+                entry.y--;
+            }
+            // detectCell() only visits positions inside the image
+            if (entry.x < 0 || entry.y < 0 || entry.x >= distance->width || entry.y >= distance->height) {
+                continue;
+            }
+            if (entry.level < height && _before(&entry, &best)) {
+                best = entry;
+            }
+        }
+    }
+    if (best.level >= height) {
+        peaks->state[peak] = PEAK_BLOCKED;
+        return 0;
+    }
+    if (peaks->state[peak] == PEAK_PENDING && peaks->level[peak] == best.level &&
+        peaks->x[peak] == best.x && peaks->y[peak] == best.y) {
+        return 0;
+    }
+    peaks->state[peak] = PEAK_PENDING;
+    peaks->level[peak] = best.level;
+    peaks->x[peak] = best.x;
+    peaks->y[peak] = best.y;
+    return _heap_push(heap, best);
+}
+
+/**
+ * \brief Tells if (x, y) survives the first erosion step and none of its 8 neighbours is higher.
+ */
+static int _highest(const image *distance, int x, int y) {
+    int value = IMAGE_AT(distance, x, y);
+    if (value < 2) {
+        return 0;
+    }
+    for (int j = -1; j <= 1; j++) {
+        for (int i = -1; i <= 1; i++) {
+            if (IMAGE_AT(distance, x + i, y + j) > value) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * \brief Grows an array of the peak set to size elements of the given size.
+ */
+static int _peaks_grow(void **array, int size, size_t element) {
+    void *grown = realloc(*array, (size_t) size * element);
+    if (grown == NULL) {
+        return -1;
+    }
+    *array = grown;
+    return 0;
+}
+
+/**
+ * \brief Adds a blocked peak at (x, y).
+ *
+ * \return Index of the peak, or -1 when memory ran out.
+ */
+static int _peaks_add(peak_set *peaks, int x, int y) {
+    int index = cell_list_add(&peaks->where, x, y);
+    if (index < 0) {
+        return -1;
+    }
+    if (index == peaks->size) {
+        // The arrays that did grow keep their new size when a later one fails
+        int size = peaks->size == 0 ? 256 : 2 * peaks->size;
+        if (_peaks_grow((void **) &peaks->level, size, sizeof(int)) != 0 ||
+            _peaks_grow((void **) &peaks->x, size, sizeof(int)) != 0 ||
+            _peaks_grow((void **) &peaks->y, size, sizeof(int)) != 0 ||
+            _peaks_grow((void **) &peaks->state, size, 1) != 0) {
+            return -1;
+        }
+        peaks->size = size;
+    }
+    peaks->level[index] = 0;
+    peaks->state[index] = PEAK_BLOCKED;
+    return index;
+}
+
+/**
+ * \brief Detects cells from one distance transform instead of iterated erosion.
+ *
+ * Every regional maximum of distance_transform() that survives at least
+ * one erosion step is a candidate. A candidate becomes a cell on the first
+ * step at which some 9x9 frame with the candidate in its capture area is
+ * black, at the position that step has shifted the frame to, so the frame
+ * and capture tests of detectCell() hold with the same meaning. Cells are
+ * registered in the order the erosion loop would find them, by step and
+ * then column by column. A registered cell clears its 7x7 capture area in
+ * the distance image, which can free the frames of the candidates around
+ * it or leave new maxima behind.
+ *
+ * The mask is read three times whatever the size of the cells: two passes
+ * for the transform and one for the candidates. On the sample images the
+ * cells are exactly those of the erosion loop, in the same order. That is
+ * not guaranteed in general: a cleared capture area stays 7x7 here, while
+ * the erosion loop keeps eroding the mask around it.
+ *
+ * \param mask The thresholded mask, it is not changed.
+ * \param distance Grey image of the mask's size used for the transform.
+ * \param cells The list that receives the new cells.
+ * \return 0, or -1 when memory ran out; cells may then hold part of the new cells.
+ */
+int distance_detect_cells(const bitimage *mask, image *distance, cell_list *cells) {
+    int width = mask->width;
+    int height = mask->height;
+    distance_transform(mask, distance);
+
+    peak_set peaks = {0};
+    peak_heap heap = {0};
+    if (cell_list_init(&peaks.where, width, height) != 0) {
+        return -1;
+    }
+    int status = 0;
+    // Erosion detects from the first step on, so a peak must survive it
+    for (int y = 0; y < height && status == 0; y++) {
+        for (int x = 0; x < width && status == 0; x++) {
+            if (_highest(distance, x, y)) {
+                int peak = _peaks_add(&peaks, x, y);
+                status = peak < 0 ? -1 : _queue(&peaks, &heap, distance, peak, 1, NULL);
+            }
+        }
+    }
+
+    while (heap.count > 0 && status == 0) {
+        peak_entry entry = _heap_pop(&heap);
+        if (peaks.state[entry.peak] != PEAK_PENDING || peaks.level[entry.peak] != entry.level ||
+            peaks.x[entry.peak] != entry.x || peaks.y[entry.peak] != entry.y) {
+            continue;
+        }
+        peaks.state[entry.peak] = PEAK_DONE;
+        if (cell_list_find(cells, entry.x, entry.y) < 0 && cell_list_add(cells, entry.x, entry.y) < 0) {
+            status = -1;
+            break;
+        }
+
+        // Clear the capture area, then look again at every peak whose frame it touches
+        int px = entry.x + entry.level;
+        int py = entry.y + entry.level;
+        for (int y = max(py - CAPTURE_RADIUS, 0); y <= min(py + CAPTURE_RADIUS, height - 1); y++) {
+            for (int x = max(px - CAPTURE_RADIUS, 0); x <= min(px + CAPTURE_RADIUS, width - 1); x++) {
+                IMAGE_AT(distance, x, y) = 0;
+            }
+        }
+        cell registered = {entry.x, entry.y};
+        // A peak looks at frames up to CAPTURE_RADIUS away from itself
+        int reach = 2 * CAPTURE_RADIUS + FRAME_RADIUS;
+        for (int y = max(py - reach, 0); y <= min(py + reach, height - 1) && status == 0; y++) {
+            for (int x = max(px - reach, 0); x <= min(px + reach, width - 1) && status == 0; x++) {
+                int peak = cell_list_find(&peaks.where, x, y);
+                if (peak < 0 && _highest(distance, x, y)) {
+                    peak = _peaks_add(&peaks, x, y);
+                    if (peak < 0) {
+                        status = -1;
+                        break;
+                    }
+                }
+                if (peak < 0 || peaks.state[peak] == PEAK_DONE) {
+                    continue;
+                }
+                if (IMAGE_AT(distance, x, y) == 0) {
+                    peaks.state[peak] = PEAK_DONE;
+                } else {
+                    status = _queue(&peaks, &heap, distance, peak, entry.level, &registered);
+                }
+            }
+        }
+    }
+
+    cell_list_free(&peaks.where);
+    free(peaks.level);
+    free(peaks.x);
+    free(peaks.y);
+    free(peaks.state);
+    free(heap.entries);
+    return status;
+}
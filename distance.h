@@ -0,0 +1,11 @@
+#ifndef DISTANCE_DISTANCE_H
+#define DISTANCE_DISTANCE_H
+
+#include "image.h"
+#include "bitimage.h"
+#include "cells.h"
+
+void distance_transform(const bitimage *mask, image *distance);
+int distance_detect_cells(const bitimage *mask, image *distance, cell_list *cells);
+
+#endif // DISTANCE_DISTANCE_H
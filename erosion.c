@@ -0,0 +1,264 @@
+#include "erosion.h"
+#include "function.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * \brief Erodes a single word, with the same neighbourhood as erode().
+ */
+static uint64_t _erode_word(const bitimage *mask, int w, int y) {
+    const uint64_t *r0 = BITIMAGE_ROW(mask, y);
+    const uint64_t *r1 = BITIMAGE_ROW(mask, y + 1);
+    const uint64_t *r2 = BITIMAGE_ROW(mask, y + 2);
+    uint64_t a = r0[w];
+    uint64_t b = r1[w];
+    uint64_t a1 = (a >> 1) | (r0[w + 1] << 63);
+    uint64_t a2 = (a >> 2) | (r0[w + 1] << 62);
+    uint64_t b1 = (b >> 1) | (r1[w + 1] << 63);
+    uint64_t b2 = (b >> 2) | (r1[w + 1] << 62);
+    uint64_t c1 = (r2[w] >> 1) | (r2[w + 1] << 63);
+    return a & b & a1 & a2 & b1 & b2 & c1;
+}
+
+static int _count_row(const erosion_state *state, int y) {
+    const uint64_t *row = BITIMAGE_ROW(state->mask, y);
+    int count = 0;
+    for (int w = 0; w < state->words; w++) {
+        count += bitimage_popcount(row[w]);
+    }
+    return count;
+}
+
+/**
+ * \brief Marks word w of row y and every word whose erosion reads it as dirty.
+ *
+ * Eroding word w of row y reads words w and w + 1 of rows y, y + 1 and y + 2.
+ */
+static void _dirty_readers(erosion_state *state, int w, int y) {
+    uint64_t bit = UINT64_C(1) << (w & 63);
+    for (int r = y - 2; r <= y; r++) {
+        if (r < WORK_PAD || r >= state->mask->height - WORK_PAD) {
+            continue;
+        }
+        uint64_t *dirty = state->dirty + (size_t) r * state->lanes;
+        dirty[w >> 6] |= bit;
+        if (w > 0) {
+            dirty[(w - 1) >> 6] |= UINT64_C(1) << ((w - 1) & 63);
+        }
+    }
+}
+
+/**
+ * \brief Prepares incremental erosion of a mask; every white word starts dirty.
+ *
+ * \param state The state to initialise.
+ * \param mask The bit image to erode in place.
+ * \return 0 on success, -1 if memory ran out.
+ */
+int erosion_init(erosion_state *state, bitimage *mask) {
+    memset(state, 0, sizeof(*state));
+    state->mask = mask;
+    state->words = (mask->width + 63) / 64;
+    state->lanes = (state->words + 63) / 64;
+    // The changed bitmap has two spare rows so a step can look two rows down
+    size_t bitmap = (size_t) state->lanes * ((size_t) mask->height + 2);
+    state->row_white = (int *) calloc((size_t) mask->height, sizeof(int));
+    state->dirty = (uint64_t *) calloc(bitmap, sizeof(uint64_t));
+    state->changed = (uint64_t *) calloc(bitmap, sizeof(uint64_t));
+    state->seam = (uint64_t *) calloc(2 * (size_t) state->words, sizeof(uint64_t));
+    if (state->row_white == NULL || state->dirty == NULL || state->changed == NULL || state->seam == NULL) {
+        erosion_free(state);
+        return -1;
+    }
+
+    for (int y = 0; y < mask->height; y++) {
+        state->row_white[y] = _count_row(state, y);
+        state->white += state->row_white[y];
+        if (y < WORK_PAD || y >= mask->height - WORK_PAD) {
+            continue;
+        }
+        const uint64_t *row = BITIMAGE_ROW(mask, y);
+        for (int w = 0; w < state->words; w++) {
+            if (row[w] != 0) {
+                state->dirty[(size_t) y * state->lanes + (w >> 6)] |= UINT64_C(1) << (w & 63);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Runs one erosion step in place.
+ *
+ * Dirty words are visited in the same top-to-bottom, left-to-right order
+ * as erode(), so every word still reads unmodified neighbours.
+ *
+ * \return 1 if the mask is fully eroded, 0 otherwise, like erode().
+ */
+int erosion_step(erosion_state *state) {
+    int first = WORK_PAD;
+    int end = state->mask->height - WORK_PAD;
+    erosion_step_seam(state, first, end, state->seam);
+    state->white -= erosion_step_band(state, first, end, state->seam);
+    erosion_step_dirty(state, first, end);
+    return state->white == 0;
+}
+
+/**
+ * \brief First phase of a step over rows [first, end): erodes the band's last two rows into seam.
+ *
+ * Those rows read the first rows of the band below, so they are computed
+ * before any band writes to the mask. Also resets the band's changed bits.
+ *
+ * \param seam Room for two rows of words, passed on to erosion_step_band().
+ */
+void erosion_step_seam(erosion_state *state, int first, int end, uint64_t *seam) {
+    int lanes = state->lanes;
+    int seam_row = end - 2 > first ? end - 2 : first;
+    if (end > first) {
+        memset(state->changed + (size_t) first * lanes, 0, (size_t) (end - first) * lanes * sizeof(uint64_t));
+    }
+    for (int y = seam_row; y < end; y++) {
+        const uint64_t *dirty = state->dirty + (size_t) y * lanes;
+        uint64_t *eroded = seam + (size_t) (y - seam_row) * state->words;
+        for (int k = 0; k < lanes; k++) {
+            for (uint64_t bits = dirty[k]; bits != 0; bits &= bits - 1) {
+                int w = k * 64 + __builtin_ctzll(bits);
+                eroded[w] = _erode_word(state->mask, w, y);
+            }
+        }
+    }
+}
+
+/**
+ * \brief Second phase of a step: erodes the dirty words of rows [first, end) in place.
+ *
+ * Rows above the seam only read rows of their own band, which are still
+ * unmodified when they are visited; the seam rows come last.
+ *
+ * \return The number of pixels that turned black.
+ */
+long erosion_step_band(erosion_state *state, int first, int end, const uint64_t *seam) {
+    bitimage *mask = state->mask;
+    int lanes = state->lanes;
+    int seam_row = end - 2 > first ? end - 2 : first;
+    long removed = 0;
+
+    for (int y = first; y < end; y++) {
+        uint64_t *dirty = state->dirty + (size_t) y * lanes;
+        uint64_t *changed = state->changed + (size_t) y * lanes;
+        uint64_t *row = BITIMAGE_ROW(mask, y);
+        const uint64_t *eroded = y >= seam_row ? seam + (size_t) (y - seam_row) * state->words : NULL;
+        for (int k = 0; k < lanes; k++) {
+            uint64_t bits = dirty[k];
+            dirty[k] = 0;
+            while (bits != 0) {
+                int w = k * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                uint64_t old = row[w];
+                uint64_t kept = eroded != NULL ? eroded[w] : _erode_word(mask, w, y);
+                if (kept != old) {
+                    int count = bitimage_popcount(old ^ kept);
+                    row[w] = kept;
+                    state->row_white[y] -= count;
+                    removed += count;
+                    changed[k] |= UINT64_C(1) << (w & 63);
+                }
+            }
+        }
+    }
+    return removed;
+}
+
+/**
+ * \brief Second phase of a step for word column w alone: erodes its dirty words of rows [first, end).
+ *
+ * Visiting the word columns left to right, each top to bottom, gives the
+ * same result as erosion_step_band(): a word reads words w and w + 1 of the
+ * rows below, which are still unmodified.
+ *
+ * \return The number of pixels that turned black.
+ */
+long erosion_step_word(erosion_state *state, int first, int end, const uint64_t *seam, int w) {
+    bitimage *mask = state->mask;
+    int lanes = state->lanes;
+    int seam_row = end - 2 > first ? end - 2 : first;
+    int k = w >> 6;
+    uint64_t bit = UINT64_C(1) << (w & 63);
+    long removed = 0;
+
+    for (int y = first; y < end; y++) {
+        uint64_t *dirty = state->dirty + (size_t) y * lanes + k;
+        if ((*dirty & bit) == 0) {
+            continue;
+        }
+        *dirty &= ~bit;
+        uint64_t *row = BITIMAGE_ROW(mask, y);
+        uint64_t old = row[w];
+        uint64_t kept = y >= seam_row ? seam[(size_t) (y - seam_row) * state->words + w] : _erode_word(mask, w, y);
+        if (kept != old) {
+            int count = bitimage_popcount(old ^ kept);
+            row[w] = kept;
+            state->row_white[y] -= count;
+            removed += count;
+            state->changed[(size_t) y * lanes + k] |= bit;
+        }
+    }
+    return removed;
+}
+
+/**
+ * \brief Last phase of a step: marks the words of rows [first, end) to visit next time.
+ *
+ * Reads the changed bits of the two rows below the band, so it must wait
+ * for the band below to finish erosion_step_band().
+ */
+void erosion_step_dirty(erosion_state *state, int first, int end) {
+    int lanes = state->lanes;
+    // Only words reading a pixel that just turned black can change next time
+    for (int y = first; y < end; y++) {
+        const uint64_t *c0 = state->changed + (size_t) y * lanes;
+        const uint64_t *c1 = c0 + lanes;
+        const uint64_t *c2 = c1 + lanes;
+        uint64_t *dirty = state->dirty + (size_t) y * lanes;
+        for (int k = 0; k < lanes; k++) {
+            uint64_t c = c0[k] | c1[k] | c2[k];
+            uint64_t carry = k + 1 < lanes ? (c0[k + 1] | c1[k + 1] | c2[k + 1]) << 63 : 0;
+            dirty[k] |= c | (c >> 1) | carry;
+        }
+    }
+}
+
+/**
+ * \brief Reports pixels that were cleared outside erosion_step().
+ *
+ * \param state The erosion state.
+ * \param x Left column of the changed rectangle.
+ * \param y Top row of the changed rectangle.
+ * \param width Width of the rectangle.
+ * \param height Height of the rectangle.
+ */
+void erosion_mark(erosion_state *state, int x, int y, int width, int height) {
+    bitimage *mask = state->mask;
+    int first_w = x < 0 ? 0 : x >> 6;
+    int last_w = (x + width - 1) >> 6;
+    if (last_w >= state->words) {
+        last_w = state->words - 1;
+    }
+    for (int r = y < 0 ? 0 : y; r < y + height && r < mask->height; r++) {
+        int count = _count_row(state, r);
+        state->white += count - state->row_white[r];
+        state->row_white[r] = count;
+        for (int w = first_w; w <= last_w; w++) {
+            _dirty_readers(state, w, r);
+        }
+    }
+}
+
+void erosion_free(erosion_state *state) {
+    free(state->row_white);
+    free(state->dirty);
+    free(state->changed);
+    free(state->seam);
+    memset(state, 0, sizeof(*state));
+}
@@ -0,0 +1,39 @@
+#ifndef EROSION_EROSION_H
+#define EROSION_EROSION_H
+
+#include "bitimage.h"
+
+/**
+ * \brief Incremental erosion of a bit image.
+ *
+ * Produces the same images as repeated erode() calls, but each step only
+ * revisits the words whose neighbourhood changed in the previous step, so
+ * the total work follows the white area instead of iterations x image size.
+ * Changes made to the mask by anything else (e.g. detectCell clearing a
+ * capture area) must be reported with erosion_mark().
+ */
+typedef struct erosion_state {
+    bitimage *mask;
+    int words;              // words per mask row that hold pixels
+    int lanes;              // words per row of the dirty and changed bitmaps
+    long white;             // white pixels left in the mask
+    int *row_white;         // white pixels left in every row
+    uint64_t *dirty;        // one bit per mask word to evaluate in the next step
+    uint64_t *changed;      // scratch: one bit per mask word changed in this step
+    uint64_t *seam;         // scratch: two rows of words for erosion_step()
+} erosion_state;
+
+int erosion_init(erosion_state *state, bitimage *mask);
+int erosion_step(erosion_state *state);
+void erosion_mark(erosion_state *state, int x, int y, int width, int height);
+void erosion_free(erosion_state *state);
+
+// The phases of erosion_step() for a band of rows, see parallel.c. Bands
+// may run each phase concurrently, but all bands must finish one phase
+// before any starts the next.
+void erosion_step_seam(erosion_state *state, int first, int end, uint64_t *seam);
+long erosion_step_band(erosion_state *state, int first, int end, const uint64_t *seam);
+long erosion_step_word(erosion_state *state, int first, int end, const uint64_t *seam, int w);
+void erosion_step_dirty(erosion_state *state, int first, int end);
+
+#endif // EROSION_EROSION_H
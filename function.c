@@ -1,81 +1,153 @@
 #include "function.h"
-#include "minmax.h"
+#include "blur.h"
+#include "detect.h"
+#include "output.h"
+#include <limits.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 /**
- * \brief Prints the linked list of cells.
+ * \brief Prints the detected cells in the order they were found.
  *
- * \param head Pointer to the head of the linked list.
+ * The lines are formatted into large buffers, see output_cells().
+ *
+ * \param cells The detected cells.
  */
-void printCell(cell *head) {
-    cell *current = head;
-    while (current != NULL) {
-        printf("x: %i, y: %i\n", current->x, current->y);
-        current = current->next;
-    }
+void printCell(const cell_list *cells) {
+    output_cells(stdout, cells->cells, cells->count, OUTPUT_TEXT);
 }
 
-//Function to count the number of cells in the linked list
-int countCells(cell *head) {
-    cell *current = head;
-    int count = 0;
-    while (current != NULL) {
-        count++;
-        current = current->next;
+/**
+ * \brief Prints the area, centroid and bounding box of every component.
+ *
+ * \param components The components of a mask.
+ */
+void printComponents(const component_table *components) {
+    for (int i = 0; i < components->count; i++) {
+        const component *item = &components->items[i];
+        int x, y;
+        component_centroid(item, &x, &y);
+        printf("area: %i, centroid: %i %i, box: %i %i %i %i\n", item->area, x, y,
+               item->x0, item->y0, item->x1, item->y1);
     }
-    return count;
+}
+
+//Function to count the number of detected cells
+int countCells(const cell_list *cells) {
+    return cells == NULL ? 0 : cells->count;
 }
 
 /**
- * \brief Checks if a cell exists in the linked list.
+ * \brief Checks if a cell was already detected at a position.
  *
- * \param head Pointer to the head of the linked list.
+ * \param cells The detected cells, may be NULL.
  * \param x X-coordinate of the cell to check.
  * \param y Y-coordinate of the cell to check.
  * \return 1 if the cell exists, 0 otherwise.
  */
-int cellExists(cell *head, int x, int y) {
-    cell *current = head;
-    while (current != NULL) {
-        if (current->x == x && current->y == y) {
-            return 1;
-        }
-        current = current->next;
-    }
-    return 0;
+int cellExists(const cell_list *cells, int x, int y) {
+    return cell_list_find(cells, x, y) >= 0;
 }
 
 
 /**
  * \brief Converts an image to greyscale.
  *
- * \param input_image The input image array.
- * \param temp_image The temporary image array to store the greyscale image.
+ * \param input_image The input RGB image.
+ * \param temp_image The grey working image, WORK_PAD pixels wider and taller than the input.
+ */
+void greyscale(const image *input_image, image *temp_image) {
+    greyscale_rows(input_image, temp_image, 0, input_image->height);
+}
+
+/**
+ * \brief Converts input rows [first, end) to greyscale, see greyscale().
  */
-void greyscale(unsigned char input_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS],
-               unsigned char temp_image[BMP_WIDTH + 2][BMP_HEIGTH + 2]) {
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            int grey = (input_image[x][y][0] + input_image[x][y][1] + input_image[x][y][2]) / 3;
-            temp_image[x + 2][y + 2] = grey;
+void greyscale_rows(const image *input_image, image *temp_image, int first, int end) {
+    for (int y = first; y < end; y++) {
+        const unsigned char *pixel = IMAGE_PIXEL(input_image, 0, y);
+        unsigned char *grey = &IMAGE_AT(temp_image, WORK_PAD, y + WORK_PAD);
+        for (int x = 0; x < input_image->width; x++, pixel += input_image->channels) {
+            grey[x] = (pixel[0] + pixel[1] + pixel[2]) / 3;
         }
     }
 }
 
+/**
+ * \brief Builds one row of the grey working image straight from a BMP file.
+ *
+ * Gives the same pixels as greyscale() on the decoded file, including the
+ * zero rows and columns of the WORK_PAD border, without an RGB copy.
+ * Rows of grey files are copied as they are, or looked up in bmp->grey.
+ *
+ * \param bmp An opened BMP file.
+ * \param y Row of the working image.
+ * \param row Receives bmp->width + WORK_PAD grey pixels.
+ */
+void greyscale_work_row(const bmp_file *bmp, int y, unsigned char *row) {
+    int width = bmp->width + WORK_PAD;
+    if (y < WORK_PAD || y >= bmp->height + WORK_PAD) {
+        memset(row, 0, (size_t) width);
+        return;
+    }
+    // The sum of the three channels does not depend on their order
+    const unsigned char *pixel = bmp_row(bmp, y - WORK_PAD);
+    row[0] = 0;
+    row[1] = 0;
+    if (bmp->channels == 1) {
+        if (bmp->plain_grey) {
+            memcpy(row + WORK_PAD, pixel, (size_t) bmp->width);
+            return;
+        }
+        for (int x = WORK_PAD; x < width; x++, pixel++) {
+            row[x] = bmp->grey[*pixel];
+        }
+        return;
+    }
+    for (int x = WORK_PAD; x < width; x++, pixel += bmp->channels) {
+        row[x] = (pixel[0] + pixel[1] + pixel[2]) / 3;
+    }
+}
+
 
 /**
  * \brief Converts an image to black and white based on a threshold.
  *
- * \param inputImage The input image array.
+ * Only the pixels that are at least WORK_PAD away from the border can turn
+ * white; everything else in the bit image is black.
+ *
+ * \param inputImage The grey input image.
  * \param threshold The threshold value for conversion.
+ * \param outputImage Bit image of the same size that receives the result.
+ */
+void black_white(const image *inputImage, int threshold, bitimage *outputImage) {
+    bitimage_clear(outputImage);
+    black_white_rows(inputImage, threshold, outputImage, 0, inputImage->height);
+}
+
+/**
+ * \brief Thresholds rows [first, end) only, see black_white().
+ *
+ * Every word of these rows is written, the guard words excepted.
  */
-void black_white(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2], int threshold) {
-    for (int x = 2; x < BMP_WIDTH; x++) {
-        for (int y = 2; y < BMP_HEIGTH; y++) {
-            unsigned char bw = (inputImage[x][y] > threshold) ? 255 : 0;
-            inputImage[x][y] = bw;
+void black_white_rows(const image *inputImage, int threshold, bitimage *outputImage, int first, int end) {
+    int last_x = inputImage->width - WORK_PAD;
+    int words = (outputImage->width + 63) / 64;
+    for (int y = first; y < end; y++) {
+        const unsigned char *grey = &IMAGE_AT(inputImage, 0, y);
+        uint64_t *row = BITIMAGE_ROW(outputImage, y);
+        int inside = y >= 2 && y < inputImage->height - WORK_PAD;
+        for (int w = 0; w < words; w++) {
+            int x0 = w * 64;
+            int x1 = x0 < 2 ? 2 : x0;
+            int x2 = x0 + 64 < last_x ? x0 + 64 : last_x;
+            uint64_t bits = 0;
+            for (int x = x1; inside && x < x2; x++) {
+                bits |= (uint64_t) (grey[x] > threshold) << (x - x0);
+            }
+            row[w] = bits;
         }
     }
 }
@@ -111,35 +183,15 @@ void create_gaussian_kernel(double kernel[][5], int kernel_size, double sigma) {
 /**
  * \brief Applies a Gaussian filter to an image.
  *
+ * Runs the separable fixed-point blur from blur.c with sigma = 1.65. The
+ * result only depends on the input pixels, so filtering in place is safe.
+ *
  * \param inputImage The input image array.
  * \param outputImage The output image array to store the filtered image.
+ * \return 0 on success, -1 if the scratch rows could not be allocated.
  */
-void gaussian_filter(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2],
-                     unsigned char outputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2]) {
-    // Define the size of the Gaussian kernel
-    int kernel_size = 5;
-    // Define the standard deviation for the Gaussian distribution
-    double sigma = 1.65;
-    // Create the Gaussian kernel
-    double kernel[kernel_size][kernel_size];
-    create_gaussian_kernel(kernel, kernel_size, sigma);
-    // For each pixel in the input image:
-    for (int x = 2; x <= BMP_WIDTH + 1; x++) {
-        for (int y = 2; y <= BMP_HEIGTH + 1; y++) {
-            // Multiply the surrounding pixels by the corresponding values in the Gaussian kernel
-            // Sum up these values
-            double sum = 0.0;
-            for (int i = -kernel_size / 2; i <= kernel_size / 2; i++) {
-                for (int j = -kernel_size / 2; j <= kernel_size / 2; j++) {
-                    int x_loc = min(max(x + i, 0), BMP_WIDTH + 1);
-                    int y_loc = min(max(y + j, 0), BMP_HEIGTH + 1);
-                    sum += inputImage[x_loc][y_loc] * kernel[i + kernel_size / 2][j + kernel_size / 2];
-                }
-            }
-            // Assign this sum to the corresponding pixel in the output image
-            outputImage[x][y] = min(max((int) sum, 0), 255);
-        }
-    }
+int gaussian_filter(const image *inputImage, image *outputImage) {
+    return gaussian_blur(inputImage, outputImage, &blur_default_kernel);
 }
 
 
@@ -149,17 +201,75 @@ void gaussian_filter(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2],
  * \param inputImage The input image array.
  * \return The calculated threshold value.
  */
-int otsu_threshold(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2]) {
+int otsu_threshold(const image *inputImage) {
     int histogram[256] = {0};
-    int total_pixels = (BMP_WIDTH) * (BMP_HEIGTH);
+    int total_pixels = (inputImage->width - WORK_PAD) * (inputImage->height - WORK_PAD);
+    otsu_histogram(inputImage, 0, inputImage->height, histogram);
+    return otsu_from_histogram(histogram, total_pixels);
+}
+
+/**
+ * \brief Adds the pixels of rows [first, end) that otsu_threshold() counts to a histogram.
+ */
+void otsu_histogram(const image *inputImage, int first, int end, int histogram[256]) {
+    int banks[OTSU_BANKS][256] = {{0}};
+    for (int y = first; y < end; y++) {
+        otsu_histogram_row(&IMAGE_AT(inputImage, 0, y), y, inputImage->width, inputImage->height, banks);
+    }
+    otsu_merge_banks(banks, histogram);
+}
 
-    // Calculate histogram
-    for (int x = 2; x < BMP_WIDTH; x++) {
-        for (int y = 2; y < BMP_HEIGTH; y++) {
-            histogram[inputImage[x][y]]++;
+/**
+ * \brief Adds the pixels of one row that otsu_threshold() counts to a banked histogram.
+ *
+ * \param row Row y of a grey working image.
+ * \param y Index of the row, rows outside the counted area are skipped.
+ * \param width Width of the working image.
+ * \param height Height of the working image.
+ * \param banks Grey level histogram banks to add to, see otsu_merge_banks().
+ */
+void otsu_histogram_row(const unsigned char *row, int y, int width, int height, int banks[OTSU_BANKS][256]) {
+    if (y < 2 || y >= height - WORK_PAD) {
+        return;
+    }
+    otsu_histogram_span(row, 2, width - WORK_PAD, banks);
+}
+
+/**
+ * \brief Adds pixels [first, end) of a row to a banked histogram.
+ */
+void otsu_histogram_span(const unsigned char *row, int first, int end, int banks[OTSU_BANKS][256]) {
+    int x = first;
+    for (; x + OTSU_BANKS <= end; x += OTSU_BANKS) {
+        banks[0][row[x]]++;
+        banks[1][row[x + 1]]++;
+        banks[2][row[x + 2]]++;
+        banks[3][row[x + 3]]++;
+    }
+    for (; x < end; x++) {
+        banks[0][row[x]]++;
+    }
+}
+
+/**
+ * \brief Adds the banks of a histogram into one histogram.
+ */
+void otsu_merge_banks(int banks[OTSU_BANKS][256], int histogram[256]) {
+    for (int b = 0; b < OTSU_BANKS; b++) {
+        for (int i = 0; i < 256; i++) {
+            histogram[i] += banks[b][i];
         }
     }
+}
 
+/**
+ * \brief Picks the threshold that maximises the between-class variance.
+ *
+ * \param histogram Grey level histogram.
+ * \param total_pixels Number of pixels the threshold is computed for.
+ * \return The threshold value.
+ */
+int otsu_from_histogram(const int histogram[256], int total_pixels) {
     float sum = 0;
     for (int i = 0; i < 256; i++) {
         sum += i * histogram[i];
@@ -196,200 +306,157 @@ int otsu_threshold(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2]) {
     return threshold;
 }
 
+/**
+ * \brief Picks the Otsu threshold of a histogram whose counts may not fit in an int.
+ *
+ * Histograms that do fit go to otsu_from_histogram(), so the threshold is
+ * exactly that of otsu_threshold() on the same pixels. Larger ones, such
+ * as those of whole slides, are searched in double precision instead.
+ *
+ * \param histogram Grey level histogram.
+ * \param total_pixels Number of pixels the threshold is computed for.
+ * \return The threshold value.
+ */
+int otsu_from_wide_histogram(const long long histogram[256], long long total_pixels) {
+    // otsu_from_histogram() also forms i * histogram[i] in an int
+    int fits = total_pixels <= INT_MAX;
+    for (int i = 0; i < 256 && fits; i++) {
+        fits = histogram[i] <= INT_MAX / 255;
+    }
+    if (fits) {
+        int narrow[256];
+        for (int i = 0; i < 256; i++) {
+            narrow[i] = (int) histogram[i];
+        }
+        return otsu_from_histogram(narrow, (int) total_pixels);
+    }
+
+    double sum = 0;
+    for (int i = 0; i < 256; i++) {
+        sum += (double) i * (double) histogram[i];
+    }
+    double sumB = 0;
+    long long wB = 0;
+    double varMax = 0;
+    int threshold = 0;
+    for (int i = 0; i < 256; i++) {
+        wB += histogram[i];
+        if (wB == 0) {
+            continue;
+        }
+        long long wF = total_pixels - wB;
+        if (wF == 0) {
+            break;
+        }
+        sumB += (double) i * (double) histogram[i];
+        double mB = sumB / (double) wB;
+        double mF = (sum - sumB) / (double) wF;
+        double varBetween = (double) wB * (double) wF * (mB - mF) * (mB - mF);
+        if (varBetween > varMax) {
+            varMax = varBetween;
+            threshold = i;
+        }
+    }
+    return threshold;
+}
+
 /**
  * \brief Applies erosion to an image.
  *
- * \param inputImage The input image array.
- * \param outputImage The output image array to store the eroded image.
+ * A white pixel (x, y) stays white only if (x, y+1), (x+1, y), (x+1, y+1),
+ * (x+1, y+2), (x+2, y) and (x+2, y+1) are white too. Rows are processed
+ * top to bottom and words left to right, and only rows and words that are
+ * still to come are read, so eroding in place is safe.
+ *
+ * \param inputImage The input bit image.
+ * \param outputImage The bit image that receives the eroded image, may be inputImage.
  * \return 1 if the image is fully eroded, 0 otherwise.
  */
-int erode(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2],
-          unsigned char outputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2]) {
-    int eroded = 1;
-    // Define the structuring element
-    int kernel[3][3] = {{0, 1, 0},
-                        {1, 1, 1},
-                        {1, 1, 0}};
-    // For each pixel in the image
-    for (int x = 2; x < BMP_WIDTH; x++) {
-        for (int y = 2; y < BMP_HEIGTH; y++) {
-            // If the pixel is not at the border, check the neighborhood defined by the structuring element
-            int isEroded = 0;
-            if (inputImage[x][y] == 255) {
-                for (int i = 0; i < 3; i++) {
-                    for (int j = 0; j < 3; j++) {
-                        // If the pixel in the neighborhood is 0 (black) and the corresponding pixel in the structuring element is 1, set the pixel to 0
-                        if (inputImage[x + i][y + j] == 0 && kernel[i][j] == 1) {
-                            isEroded = 1;
-                        }
-                    }
-                }
-                // If any pixel in the neighborhood is 0 (black), set the pixel to 0
-                if (isEroded) {
-                    outputImage[x][y] = 0;
-                } else {
-                    outputImage[x][y] = 255;
-                    eroded = 0;
-                }
-            }
+int erode(const bitimage *inputImage, bitimage *outputImage) {
+    uint64_t remaining = 0;
+    int words = (inputImage->width + 63) / 64;
+    for (int y = 2; y < inputImage->height - WORK_PAD; y++) {
+        const uint64_t *r0 = BITIMAGE_ROW(inputImage, y);
+        const uint64_t *r1 = BITIMAGE_ROW(inputImage, y + 1);
+        const uint64_t *r2 = BITIMAGE_ROW(inputImage, y + 2);
+        uint64_t *out = BITIMAGE_ROW(outputImage, y);
+        for (int w = 0; w < words; w++) {
+            uint64_t a = r0[w];
+            uint64_t b = r1[w];
+            // Shifting right by k brings pixel x+k into the position of pixel x
+            uint64_t a1 = (a >> 1) | (r0[w + 1] << 63);
+            uint64_t a2 = (a >> 2) | (r0[w + 1] << 62);
+            uint64_t b1 = (b >> 1) | (r1[w + 1] << 63);
+            uint64_t b2 = (b >> 2) | (r1[w + 1] << 62);
+            uint64_t c1 = (r2[w] >> 1) | (r2[w + 1] << 63);
+            uint64_t kept = a & b & a1 & a2 & b1 & b2 & c1;
+            out[w] = kept;
+            remaining |= kept;
         }
     }
-    return eroded;
+    return remaining == 0;
 }
 
 /**
- * \brief Detects cells in an image and adds them to a linked list.
+ * \brief Detects cells in an image and appends them to a cell list.
  *
- * \param inputImage The input image array.
- * \param head Pointer to the head of the linked list.
+ * A cell is registered at (x, y) when the 9x9 frame around it is black and
+ * the 7x7 capture area inside has a white pixel; the capture area is then
+ * cleared. Positions are visited column by column, since clearing a capture
+ * area changes what later positions see. See detect.c.
+ *
+ * \param inputImage The input bit image.
+ * \param cells The list that receives the new cells.
  */
-void detectCell(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2], cell **head) {
-    for (int x = 0; x < BMP_WIDTH + 2; x++) {
-        for (int y = 0; y < BMP_HEIGTH + 2; y++) {
-            int WhitePixelfound = 0;
-            int ExclusionFrameBlack = 1;
-            if (y == 0) {}
-
-            // Check the exclusion frame and see if they all are black.
-            for (int i = -4; i <= 4; i++) {
-                for (int j = -4; j <= 4; j++) {
-                    if (i == -4 || i == 4 || j == -4 || j == 4) {
-                        if (inputImage[x + i][y + j] != 0) {
-                            ExclusionFrameBlack = 0;
-                            break;
-                        }
-                    }
-                }
-                if (!ExclusionFrameBlack) {
-                    break;
-                }
-            }
-
-            // If the exclusion frame is black, check the capturing area
-            if (ExclusionFrameBlack) {
-                for (int i = -3; i < 4; i++) {
-                    for (int j = -3; j < 4; j++) {
-                        if (inputImage[x + i][y + j] == 255) {
-                            WhitePixelfound = 1;
-                        }
-                    }
-                }
-            }
+void detectCell(bitimage *inputImage, cell_list *cells) {
+    detect_cells(inputImage, cells, NULL);
+}
 
-            // If at least one white pixel is found inside and the exclusion frame is black, register a cell
-            if (WhitePixelfound && ExclusionFrameBlack) {
-                if (!cellExists(*head, x, y)) {
-                    cell *new_cell = (cell *) malloc(sizeof(cell));
-                    if (new_cell == NULL) {
-                        fprintf(stderr, "Failed to allocate memory for new cell.\n");
-                        exit(1);
-                    }
-                    new_cell->x = x;
-                    new_cell->y = y;
-                    new_cell->next = *head;
-                    *head = new_cell;
-                }
 
-                // Set the entire capturing area to black to avoid detecting the same cell again
-                for (int i = -3; i < 4; i++) {
-                    for (int j = -3; j < 4; j++) {
-                        inputImage[x + i][y + j] = 0;
-                    }
-                }
-            }
-        }
-    }
+/**
+ * \brief Gives the colour of one pixel of the cell marker, a simple DTU logo.
+ *
+ * \param x Column inside the marker, 0 to CELL_MARKER_WIDTH - 1.
+ * \param y Row inside the marker, 0 to CELL_MARKER_HEIGHT - 1.
+ * \param rgb Receives the red, green and blue value of the pixel.
+ */
+void cellMarker(int x, int y, unsigned char rgb[3]) {
+    int white = (x==1 && y>0 && y<4) ||
+                (y==1&&(x==1||x==2)) ||
+                (y==3&&x==2) ||
+                (y==2&&x==3) ||
+                (x>=4&&x<=6&&y==1) ||
+                (x==5&&y>1&&y<4) ||
+                (x==8&&y>0&&y<4) ||
+                (x==9&&y==3) ||
+                (x==10&&y>0&&y<4) ||
+                (y==7&&(x>0&&x<11)) ||
+                ((y==6||y==8)&&(x==2||x==3||x==8||x==9)) ||
+                (y==11&&(x>0&&x<11)) ||
+                ((y==10||y==12)&&(x==2||x==3||x==8||x==9));
+    rgb[0] = white ? 255 : 189; // Red
+    rgb[1] = white ? 255 : 42;  // Green
+    rgb[2] = white ? 255 : 48;  // Blue
 }
 
-
 /**
  * \brief Draws a dot on the image at the location of each detected cell.
  *
  * \param inputImage The input image array.
- * \param head Pointer to the head of the linked list of cells.
+ * \param cells The detected cells.
  */
-void drawDot(unsigned char inputImage[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], cell *head) {
-    cell *current = head;
-    while (current != NULL) {
-        // Draw a simple representation of the DTU logo
-        for (int x = 0; x < 12; x++) {
-            for (int y = 0; y < 14; y++) {
-                if (current->x + x >= BMP_WIDTH || current->y + y >= BMP_HEIGTH) {
+void drawDot(image *inputImage, const cell_list *cells) {
+    // Newest first, so overlapping dots stack the way they always have
+    for (int i = cells->count - 1; i >= 0; i--) {
+        const cell *current = &cells->cells[i];
+        for (int y = 0; y < CELL_MARKER_HEIGHT; y++) {
+            for (int x = 0; x < CELL_MARKER_WIDTH; x++) {
+                if (current->x + x >= inputImage->width || current->y + y >= inputImage->height) {
                     continue;
                 }
-                // Example pattern for DTU logo
-
-                inputImage[current->x + x][current->y + y][0] = 189; // Red
-                inputImage[current->x + x][current->y + y][1] = 42;  // Green
-                inputImage[current->x + x][current->y + y][2] = 48;  // Blue
-                if (x==1 && y>0 && y<4) {
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(y==1&&(x==1||x==2)){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(y==3&&x==2){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(y==2&&x==3){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(x>=4&&x<=6&&y==1){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(x==5&&y>1&&y<4){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(x==8&&y>0&&y<4){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(x==9&&y==3){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(x==10&&y>0&&y<4) {
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(y==7&&(x>0&&x<11)){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if((y==6||y==8)&&(x==2||x==3||x==8||x==9)){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if(y==11&&(x>0&&x<11)){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
-                if((y==10||y==12)&&(x==2||x==3||x==8||x==9)){
-                    inputImage[current->x + x][current->y + y][0] = 255; // White
-                    inputImage[current->x + x][current->y + y][1] = 255; // White
-                    inputImage[current->x + x][current->y + y][2] = 255; // White
-                }
+                cellMarker(x, y, IMAGE_PIXEL(inputImage, current->x + x, current->y + y));
             }
         }
-        current = current->next;
     }
 }
 
@@ -398,22 +465,25 @@ void drawDot(unsigned char inputImage[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], cell
  *
  * \param inputImage The input image array.
  */
-void blackBorder(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2]) {
-    for (int x = 0; x < BMP_WIDTH + 2; x++) {
-        for (int y = 0; y < BMP_HEIGTH + 2; y++) {
-            if (x == 0 || x >= BMP_WIDTH || y == 0 || y >= BMP_HEIGTH) {
-                inputImage[x][y] = 0;
+void blackBorder(image *inputImage) {
+    int inner_width = inputImage->width - WORK_PAD;
+    int inner_height = inputImage->height - WORK_PAD;
+    for (int y = 0; y < inputImage->height; y++) {
+        for (int x = 0; x < inputImage->width; x++) {
+            if (x == 0 || x >= inner_width || y == 0 || y >= inner_height) {
+                IMAGE_AT(inputImage, x, y) = 0;
             }
         }
     }
 }
 
-void tempImageToPrint(unsigned char temp_image[BMP_WIDTH + 2][BMP_HEIGTH + 2], unsigned char output_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]){
-    for (int x = 2; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            output_image[x][y][0] = temp_image[x + 2][y + 2];
-            output_image[x][y][1] = temp_image[x + 2][y + 2];
-            output_image[x][y][2] = temp_image[x + 2][y + 2];
+void tempImageToPrint(const image *temp_image, image *output_image){
+    for (int y = 0; y < output_image->height; y++) {
+        for (int x = 2; x < output_image->width; x++) {
+            unsigned char grey = IMAGE_AT(temp_image, x + WORK_PAD, y + WORK_PAD);
+            IMAGE_PIXEL(output_image, x, y)[0] = grey;
+            IMAGE_PIXEL(output_image, x, y)[1] = grey;
+            IMAGE_PIXEL(output_image, x, y)[2] = grey;
         }
     }
 }
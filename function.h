@@ -1,38 +1,56 @@
 #ifndef function_function_H
 #define function_function_H
 
-#define BMP_WIDTH 950
-#define BMP_HEIGTH 950
-#define BMP_CHANNELS 3
+#include "image.h"
+#include "bitimage.h"
+#include "cells.h"
+#include "cbmp.h"
+#include "components.h"
 
+// The grey working image is WORK_PAD pixels wider and taller than the input;
+// input pixel (x, y) lands at (x + WORK_PAD, y + WORK_PAD).
+#define WORK_PAD 2
 
+// Histograms are counted in this many banks, pixel x going to bank x % OTSU_BANKS,
+// so runs of one grey level do not wait on their own increments
+#define OTSU_BANKS 4
 
-typedef struct cell {
-    int x;              
-    int y;              
-    struct cell *next;  
-} cell;
+// Size of the marker drawn at each detected cell
+#define CELL_MARKER_WIDTH 12
+#define CELL_MARKER_HEIGHT 14
 
 // Function prototypes
-void greyscale(unsigned char input_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS],
-               unsigned char temp_image[BMP_WIDTH+2][BMP_HEIGTH+2]);
+void greyscale(const image *input_image, image *temp_image);
 
-int countCells(cell *head);
-void printCell(cell *head);
-int cellExists(cell *head, int x, int y);
+int countCells(const cell_list *cells);
+void printCell(const cell_list *cells);
+void printComponents(const component_table *components);
+int cellExists(const cell_list *cells, int x, int y);
 
 
-void black_white(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2], int threshold);
+void black_white(const image *inputImage, int threshold, bitimage *outputImage);
 void create_gaussian_kernel(double kernel[][5], int kernel_size, double sigma);
 
-void gaussian_filter(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2],
-                     unsigned char outputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2]);
-int otsu_threshold(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2]);
-int erode(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2],
-          unsigned char outputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2]);
-void detectCell(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2], cell **head);
-void drawDot(unsigned char inputImage[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], cell *head);
-void blackBorder(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2]);
-void tempImageToPrint(unsigned char inputImage[BMP_WIDTH + 2][BMP_HEIGTH + 2], unsigned char outputImage[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
-
-#endif
\ No newline at end of file
+int gaussian_filter(const image *inputImage, image *outputImage);
+int otsu_threshold(const image *inputImage);
+int erode(const bitimage *inputImage, bitimage *outputImage);
+void detectCell(bitimage *inputImage, cell_list *cells);
+void drawDot(image *inputImage, const cell_list *cells);
+void cellMarker(int x, int y, unsigned char rgb[3]);
+void blackBorder(image *inputImage);
+void tempImageToPrint(const image *inputImage, image *outputImage);
+
+// Row ranges of the stages above, for running bands of an image in parallel
+void greyscale_rows(const image *input_image, image *temp_image, int first, int end);
+void black_white_rows(const image *inputImage, int threshold, bitimage *outputImage, int first, int end);
+void otsu_histogram(const image *inputImage, int first, int end, int histogram[256]);
+int otsu_from_histogram(const int histogram[256], int total_pixels);
+int otsu_from_wide_histogram(const long long histogram[256], long long total_pixels);
+
+// Single rows of the stages above, for streaming an image through them
+void greyscale_work_row(const bmp_file *bmp, int y, unsigned char *row);
+void otsu_histogram_row(const unsigned char *row, int y, int width, int height, int banks[OTSU_BANKS][256]);
+void otsu_histogram_span(const unsigned char *row, int first, int end, int banks[OTSU_BANKS][256]);
+void otsu_merge_banks(int banks[OTSU_BANKS][256], int histogram[256]);
+
+#endif
@@ -0,0 +1,80 @@
+#include "image.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t _round_up(size_t bytes) {
+    return (bytes + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+}
+
+/**
+ * \brief Allocates a zeroed image surrounded by IMAGE_MARGIN guard pixels.
+ *
+ * The guard is widened on the left and right so every row starts on an
+ * IMAGE_ALIGN boundary and the stride is a multiple of IMAGE_ALIGN.
+ *
+ * \param img The descriptor to fill in.
+ * \param width Width in pixels.
+ * \param height Height in pixels.
+ * \param channels Bytes per pixel.
+ * \return 0 on success, -1 if the size is invalid or memory ran out.
+ */
+int image_alloc(image *img, int width, int height, int channels) {
+    memset(img, 0, sizeof(*img));
+    if (width <= 0 || height <= 0 || channels <= 0) {
+        return -1;
+    }
+    size_t left = _round_up((size_t) IMAGE_MARGIN * (size_t) channels);
+    size_t stride = _round_up(left + ((size_t) width + IMAGE_MARGIN) * (size_t) channels);
+    size_t rows = (size_t) height + 2 * IMAGE_MARGIN;
+    // calloc() only promises alignment for basic types, the start is rounded up by hand
+    unsigned char *buffer = (unsigned char *) calloc(rows * stride + IMAGE_ALIGN - 1, 1);
+    if (buffer == NULL) {
+        return -1;
+    }
+    unsigned char *aligned = buffer + (IMAGE_ALIGN - (uintptr_t) buffer % IMAGE_ALIGN) % IMAGE_ALIGN;
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->stride = (int) stride;
+    img->buffer = buffer;
+    img->data = aligned + IMAGE_MARGIN * stride + left;
+    return 0;
+}
+
+/**
+ * \brief Describes caller-owned pixels without copying them.
+ *
+ * The wrapped memory has no guard margin, so kernels that read outside the
+ * image need an allocated (image_alloc) buffer instead.
+ */
+void image_wrap(image *img, unsigned char *data, int width, int height, int channels, int stride) {
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->stride = stride;
+    img->data = data;
+    img->buffer = NULL;
+}
+
+/**
+ * \brief Allocates dst with the geometry of src and copies the pixels.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+int image_copy(image *dst, const image *src) {
+    if (image_alloc(dst, src->width, src->height, src->channels) != 0) {
+        return -1;
+    }
+    size_t row_bytes = (size_t) src->width * (size_t) src->channels;
+    for (int y = 0; y < src->height; y++) {
+        memcpy(IMAGE_PIXEL(dst, 0, y), IMAGE_PIXEL(src, 0, y), row_bytes);
+    }
+    return 0;
+}
+
+void image_free(image *img) {
+    free(img->buffer);
+    img->buffer = NULL;
+    img->data = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef IMAGE_IMAGE_H
+#define IMAGE_IMAGE_H
+
+#include <stddef.h>
+
+// Guard pixels kept (and zeroed) around every allocated image, so kernels
+// may read a few pixels past the edges without bounds checks
+#define IMAGE_MARGIN 8
+
+// Rows of allocated images start on this boundary, a cache line, and the
+// stride is a multiple of it, so row loops and vector loads begin aligned
+#define IMAGE_ALIGN 64
+
+/**
+ * \brief Runtime-sized image descriptor.
+ *
+ * Pixels are stored row by row; pixel (x, y) channel c lives at
+ * data[y * stride + x * channels + c]. Row y = 0 is the top of the image.
+ * Images made by image_alloc() have IMAGE_ALIGN aligned rows.
+ */
+typedef struct image {
+    int width;
+    int height;
+    int channels;
+    int stride;             // bytes between the starts of two consecutive rows
+    unsigned char *data;    // pixel (0, 0)
+    unsigned char *buffer;  // owned allocation, NULL when data is borrowed
+} image;
+
+// Pointer to the first channel of pixel (x, y)
+#define IMAGE_PIXEL(img, x, y) \
+    ((img)->data + (ptrdiff_t) (y) * (img)->stride + (ptrdiff_t) (x) * (img)->channels)
+
+// Single-channel pixel access
+#define IMAGE_AT(img, x, y) ((img)->data[(ptrdiff_t) (y) * (img)->stride + (x)])
+
+int image_alloc(image *img, int width, int height, int channels);
+void image_wrap(image *img, unsigned char *data, int width, int height, int channels, int stride);
+int image_copy(image *dst, const image *src);
+void image_free(image *img);
+
+#endif // IMAGE_IMAGE_H
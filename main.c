@@ -1,19 +1,74 @@
-//To compile (linux/mac): gcc cbmp.c function.c main.c -o main.out -lm
-//To run (linux/mac): ./main.out example.bmp example_inv.bmp
-//To compile (win): gcc cbmp.c main.c -o main.exe -lm
-//To run (win): main.exe example.bmp example_inv.bmp
+//To compile (linux/mac): gcc cbmp.c function.c image.c bitimage.c blur.c erosion.c cells.c pool.c detect.c distance.c components.c threshold.c parallel.c pipeline.c output.c celldetect.c serve.c tiles.c batch.c bench.c perf.c verify.c main.c -o main.out -lm -lpthread
+//To run (linux/mac): ./main.out [-t threads] [--detect erosion|distance|components] [--threshold global|tiles|local] example.bmp example_inv.bmp
+//To run on a headerless 8-bit frame (linux/mac): ./main.out --raw 950x950 frame.raw frame_marked.raw
+//To print only the coordinates (linux/mac): ./main.out --cells csv|json|binary [--cells-out cells.csv] example.bmp [--thumbnail 4 example_small.bmp]
+//To run on a slide larger than memory (linux/mac): ./main.out --tile 2048 [--halo 128] slide.bmp slide_marked.bmp
+//To run a batch (linux/mac): ./main.out --batch [-t threads] [-o output dir] [--format csv|json] samples/*/
+//To print counters as JSON (linux/mac): ./main.out --stats [--counters] example.bmp example_inv.bmp
+//To check the kernels against their reference (linux/mac): ./main.out --verify [-n synthetic cases] [directory or file]...
+//To serve requests on a Unix socket (linux/mac): ./main.out --serve /tmp/celldetect.sock [-t threads] [--warm 950x950]
+//To benchmark (linux/mac): ./main.out --bench [-n runs] [-t threads] [--format csv|json] [directory or file]...
+//To compile (win): gcc cbmp.c function.c image.c bitimage.c blur.c erosion.c cells.c pool.c detect.c distance.c components.c threshold.c parallel.c pipeline.c output.c celldetect.c serve.c tiles.c batch.c bench.c perf.c verify.c main.c -o main.exe -lm -lpthread
+//To run (win): main.exe [-t threads] [--detect erosion|distance|components] example.bmp example_inv.bmp
 
 #include "cbmp.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "time.h"
 #include "function.h"
-cell *head =NULL;
+#include "pipeline.h"
+#include "batch.h"
+#include "bench.h"
+#include "verify.h"
+#include "tiles.h"
+#include "serve.h"
+#include "output.h"
 
-unsigned char input_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
-unsigned char output_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
-unsigned char temp_image[BMP_WIDTH+2][BMP_HEIGTH+2];
-unsigned char temp_image2[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-t threads] [--detect erosion|distance|components] [--stats [--counters]]"
+            " <input file path> <output file path>\n", program);
+    fprintf(stderr, "       %s --cells text|csv|json|binary [--cells-out path] [--thumbnail scale]"
+            " <input file path> [output file path]\n", program);
+    fprintf(stderr, "       every mode but --verify also takes [--threshold global|tiles|local]\n");
+    fprintf(stderr, "       inputs are 8, 24 or 32-bit BMP or 8-bit PGM files, or with --raw widthxheight,"
+            " headerless 8-bit frames\n");
+    fprintf(stderr, "       %s --tile size [--halo pixels] [-t threads] [--detect erosion|distance|components]"
+            " <input file path> <output file path>\n", program);
+    fprintf(stderr, "       %s --batch [-t threads] [--detect erosion|distance|components] [-o output dir] [--format csv|json]"
+            " <file or directory>...\n", program);
+    fprintf(stderr, "       %s --bench [-n runs] [-t threads] [--detect erosion|distance|components] [-o output dir]"
+            " [--format csv|json] [file or directory]...\n", program);
+    fprintf(stderr, "       %s --serve <socket path> [-t threads] [--detect erosion|distance|components]"
+            " [--warm widthxheight]\n", program);
+    fprintf(stderr, "       %s --verify [-n synthetic cases] [-t threads] [file or directory]...\n", program);
+    exit(1);
+}
+
+/**
+ * \brief Writes the coordinates of the cells and nothing else, see output_cells().
+ *
+ * \param path File to write them to, or NULL for the standard output.
+ * \param cells The cells.
+ * \param count Number of cells.
+ * \param format How to write them.
+ * \return 0 on success, 1 on failure.
+ */
+static int write_cells(const char *path, const cell *cells, int count, output_format format) {
+    FILE *fp = path != NULL ? fopen(path, "wb") : stdout;
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s.\n", path);
+        return 1;
+    }
+    int failed = output_cells(fp, cells, count, format) != 0;
+    if (path != NULL && fclose(fp) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        fprintf(stderr, "Failed to write the cells.\n");
+    }
+    return failed;
+}
 
 /**
  * \brief Main function for the image processing program.
@@ -27,57 +82,265 @@ int main(int argc, char **argv) {
     //argv[0] is a string with the name of the program
     //argv[1] is the first command line argument (input image)
     //argv[2] is the second command line argument (output image)
+    //Options come first: "-t threads" defaults to one thread per processor,
+    //"--batch" takes any number of files and directories instead,
+    //"--verify" compares every kernel with its reference on the samples and "-n" synthetic cases,
+    //"--bench" times every stage over "-n runs" runs of the samples, or of the given inputs,
+    //"--detect distance" replaces the erosion loop with one distance transform,
+    //"--detect components" counts connected components and prints their size,
+    //"--stats" prints the counters of every stage as one JSON object instead of the cells,
+    //"--counters" adds hardware events per stage to it, counted on the main thread only
+    //"--tile size" processes the image in tiles of size x size pixels with "--halo" pixels around them
+    //"--serve socket" stays resident and detects the images that clients name on a Unix socket,
+    //with "--warm widthxheight" allocating the buffers for that size before the first request
+    //"--raw widthxheight" reads the input as a headerless frame of 8-bit grey values, in the single image modes
+    //"--threshold tiles" or "--threshold local" adapts the threshold to uneven lighting, in every mode
+    //"--cells format" prints only the coordinates, to "--cells-out path" if given, and writes an image
+    //only when an output path follows the input, shrunk by "--thumbnail scale" if given
     clock_t begin = clock();
 
-    //Checking that 2 arguments are passed
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input file path> <output file path>\n", argv[0]);
-        exit(1);
+    int threads = pool_cpu_count();
+    int batch = 0;
+    int bench = 0;
+    int verify = 0;
+    int runs = -1;
+    int stats = 0;
+    int counters = 0;
+    int tile = 0;
+    int halo = TILE_HALO;
+    const char *serve = NULL;
+    int warm_width = 0;
+    int warm_height = 0;
+    int raw_width = 0;
+    int raw_height = 0;
+    int cells_only = 0;
+    output_format cells_format = OUTPUT_TEXT;
+    const char *cells_path = NULL;
+    int thumbnail = 0;
+    batch_options options = {0, NULL, BATCH_CSV, DETECT_EROSION, THRESHOLD_GLOBAL};
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+            threads = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[arg], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[arg], "--verify") == 0) {
+            verify = 1;
+        } else if (strcmp(argv[arg], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[arg], "--counters") == 0) {
+            counters = 1;
+        } else if (strcmp(argv[arg], "--tile") == 0 && arg + 1 < argc) {
+            tile = atoi(argv[++arg]);
+            if (tile < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[arg], "--halo") == 0 && arg + 1 < argc) {
+            halo = atoi(argv[++arg]);
+            if (halo < 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc) {
+            serve = argv[++arg];
+        } else if (strcmp(argv[arg], "--warm") == 0 && arg + 1 < argc) {
+            if (sscanf(argv[++arg], "%dx%d", &warm_width, &warm_height) != 2 || warm_width < 1 || warm_height < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[arg], "--raw") == 0 && arg + 1 < argc) {
+            if (sscanf(argv[++arg], "%dx%d", &raw_width, &raw_height) != 2 || raw_width < 1 || raw_height < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[arg], "--cells") == 0 && arg + 1 < argc) {
+            if (output_parse_format(argv[++arg], &cells_format) != 0) {
+                usage(argv[0]);
+            }
+            cells_only = 1;
+        } else if (strcmp(argv[arg], "--cells-out") == 0 && arg + 1 < argc) {
+            cells_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--thumbnail") == 0 && arg + 1 < argc) {
+            thumbnail = atoi(argv[++arg]);
+            if (thumbnail < 1 || thumbnail > THUMBNAIL_SCALE_MAX) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) {
+            runs = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) {
+            options.output_dir = argv[++arg];
+        } else if (strcmp(argv[arg], "--format") == 0 && arg + 1 < argc) {
+            arg++;
+            if (strcmp(argv[arg], "json") == 0) {
+                options.format = BATCH_JSON;
+            } else if (strcmp(argv[arg], "csv") != 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[arg], "--threshold") == 0 && arg + 1 < argc) {
+            arg++;
+            if (strcmp(argv[arg], "tiles") == 0) {
+                options.threshold = THRESHOLD_TILES;
+            } else if (strcmp(argv[arg], "local") == 0) {
+                options.threshold = THRESHOLD_LOCAL;
+            } else if (strcmp(argv[arg], "global") != 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[arg], "--detect") == 0 && arg + 1 < argc) {
+            arg++;
+            if (strcmp(argv[arg], "distance") == 0) {
+                options.mode = DETECT_DISTANCE;
+            } else if (strcmp(argv[arg], "components") == 0) {
+                options.mode = DETECT_COMPONENTS;
+            } else if (strcmp(argv[arg], "erosion") != 0) {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    //"-n" is left at -1 unless given, and the hardware counters are only ever printed with the stats
+    if (threads < 1 || runs < -1 || (bench && runs == 0) || (counters && !stats)) {
+        usage(argv[0]);
     }
 
-    printf("Example program - 02132 - A1\n");
-
-    //Load image from file
-    read_bitmap(argv[1], input_image);
-    read_bitmap(argv[1], output_image);
-
-
-
-
-    //Run greyscale filter in case the image is colored
-    greyscale(input_image, temp_image);
-
+    //Verification mode runs the reference and the optimized kernels side by side
+    if (verify) {
+        return verify_run(arg < argc ? argv + arg : NULL, argc - arg, runs < 0 ? 200 : runs, threads);
+    }
 
-    //Run gaussian filter and then making the temp_image black and white
-    gaussian_filter(temp_image, temp_image);
-    black_white(temp_image, otsu_threshold(temp_image));
-    blackBorder(temp_image);
+    //Benchmark mode times every stage, per level of difficulty
+    if (bench) {
+        bench_options timing = {threads, runs < 0 ? 5 : runs, options.output_dir, options.format, options.mode,
+                                options.threshold};
+        return bench_run(arg < argc ? argv + arg : NULL, argc - arg, &timing);
+    }
 
-    /** Variables used for printing the eroded images
-    int i=0;
-    char name[1];
-     **/
+    //Server mode keeps the threads and buffers warm between requests
+    if (serve != NULL) {
+        if (arg != argc) {
+            usage(argv[0]);
+        }
+        serve_options serving = {threads, options.mode, options.threshold, warm_width, warm_height};
+        return serve_run(serve, &serving);
+    }
 
-    //Run erosion to remove noise
-    while (erode(temp_image, temp_image) == 0) {
-        detectCell(temp_image, &head);
+    //Batch mode processes one image per thread
+    if (batch) {
+        if (arg == argc) {
+            usage(argv[0]);
+        }
+        options.threads = threads;
+        return batch_run(argv + arg, argc - arg, &options);
+    }
 
-        /** Printing every eroded image if needed
-        tempImageToPrint(temp_image, temp_image2);
-        sprintf(name, "output%d.bmp", i);
-        write_bitmap(temp_image2, name);
-        i++;
-         **/
+    //Checking that 2 arguments are passed, or only the input when just the coordinates are wanted
+    if (argc - arg != 2 && !(cells_only && argc - arg == 1)) {
+        usage(argv[0]);
+    }
+    if ((cells_path != NULL || thumbnail > 0) && !cells_only) {
+        usage(argv[0]);
+    }
+    if ((cells_only && stats) || (thumbnail > 0 && argc - arg != 2)) {
+        usage(argv[0]);
+    }
+    //A thinner halo would change the cells found near the seams
+    if (tile > 0 && halo < tiles_min_halo(options.threshold)) {
+        fprintf(stderr, "The halo must be at least %d pixels with this threshold mode.\n",
+                tiles_min_halo(options.threshold));
+        exit(1);
+    }
+    const char *output_path = argc - arg == 2 ? argv[arg + 1] : NULL;
+    worker_pool pool;
+    if (pool_init(&pool, threads) != 0) {
+        fprintf(stderr, "Failed to start %d threads.\n", threads);
+        exit(1);
     }
 
-    printCell(head);
-    printf("Number of cells: %i\n", countCells(head));
+    if (!stats && !cells_only) {
+        printf("Example program - 02132 - A1\n");
+    }
 
-    drawDot(output_image, head);
+    //Tiled mode only ever holds one tile and its halo in memory
+    if (tile > 0) {
+        if (stats || thumbnail > 0) {
+            usage(argv[0]);
+        }
+        tile_engine tiles;
+        tiles_init(&tiles, tile, halo);
+        tiles.work.mode = options.mode;
+        tiles.work.threshold_mode = options.threshold;
+        tiles.work.raw_width = raw_width;
+        tiles.work.raw_height = raw_height;
+        bmp_status status = tiles_process(&tiles, argv[arg], output_path, &pool);
+        if (status != BMP_OK) {
+            fprintf(stderr, "%s\n", bmp_strerror(status));
+            exit(1);
+        }
+        if (cells_only) {
+            int written = write_cells(cells_path, tiles.cells, tiles.count, cells_format);
+            tiles_free(&tiles);
+            pool_free(&pool);
+            return written;
+        }
+        //A view of the cells for the usual printing
+        cell_list found = {0};
+        found.cells = tiles.cells;
+        found.count = tiles.count;
+        printCell(&found);
+        printf("Tiles: %d x %d, threshold: %d, duplicates dropped: %d\n", tiles.columns, tiles.rows,
+               tiles.threshold, tiles.duplicates);
+        printf("Number of cells: %i\n", countCells(&found));
+        tiles_free(&tiles);
+        pool_free(&pool);
+        printf("Done!\n");
+        double time_spent = (double) (clock() - begin) / CLOCKS_PER_SEC;
+        printf("Time spent: %f seconds", time_spent);
+        return 0;
+    }
 
+    //Load the image, detect the cells and save the image with the cells marked
+    pipeline work;
+    pipeline_init(&work);
+    work.mode = options.mode;
+    work.threshold_mode = options.threshold;
+    work.raw_width = raw_width;
+    work.raw_height = raw_height;
+    work.thumbnail_scale = thumbnail;
+    perf_counters perf;
+    if (counters) {
+        if (perf_open(&perf) == 0) {
+            work.perf = &perf;
+        } else {
+            fprintf(stderr, "Hardware counters are not available.\n");
+        }
+    }
+    bmp_status status = pipeline_process(&work, argv[arg], output_path, &pool);
+    if (status != BMP_OK) {
+        fprintf(stderr, "%s\n", bmp_strerror(status));
+        exit(1);
+    }
+    if (cells_only) {
+        int written = write_cells(cells_path, work.cells.cells, work.cells.count, cells_format);
+        pipeline_free(&work);
+        pool_free(&pool);
+        return written;
+    }
+    if (stats) {
+        pipeline_print_stats(&work, argv[arg], threads);
+        if (work.perf != NULL) {
+            perf_close(&perf);
+        }
+        pipeline_free(&work);
+        pool_free(&pool);
+        return 0;
+    }
 
-    //Save image to file
-    write_bitmap(output_image, argv[2]);
+    printCell(&work.cells);
+    if (work.mode == DETECT_COMPONENTS) {
+        printComponents(&work.components);
+    }
+    printf("Number of cells: %i\n", countCells(&work.cells));
+    pipeline_free(&work);
+    pool_free(&pool);
 
     printf("Done!\n");
     clock_t end = clock();
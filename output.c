@@ -0,0 +1,136 @@
+#include "output.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes formatted before each fwrite()
+#define OUTPUT_BUFFER 65536
+
+// Room one cell takes at most in any format
+#define OUTPUT_CELL_MAX 48
+
+// Output gathered into large writes instead of one printf() per cell
+typedef struct output_buffer {
+    FILE *fp;
+    size_t length;
+    int failed;
+    char data[OUTPUT_BUFFER];
+} output_buffer;
+
+static void _flush(output_buffer *out) {
+    if (out->length > 0 && !out->failed) {
+        out->failed = fwrite(out->data, 1, out->length, out->fp) != out->length;
+    }
+    out->length = 0;
+}
+
+static void _put(output_buffer *out, const char *s) {
+    size_t length = strlen(s);
+    if (out->length + length > OUTPUT_BUFFER) {
+        _flush(out);
+    }
+    memcpy(out->data + out->length, s, length);
+    out->length += length;
+}
+
+// Decimal digits of a coordinate, which is never negative
+static void _put_int(output_buffer *out, int value) {
+    char digits[12];
+    int count = 0;
+    unsigned int rest = (unsigned int) value;
+    do {
+        digits[count++] = (char) ('0' + rest % 10);
+        rest /= 10;
+    } while (rest != 0);
+    while (count > 0) {
+        out->data[out->length++] = digits[--count];
+    }
+}
+
+static void _put_le32(output_buffer *out, unsigned int value) {
+    for (int i = 0; i < 4; i++) {
+        out->data[out->length++] = (char) (value >> (8 * i));
+    }
+}
+
+/**
+ * \brief Reads the name of a format: text, csv, json or binary.
+ *
+ * \return 0, or -1 if the name is none of them.
+ */
+int output_parse_format(const char *name, output_format *format) {
+    static const char *const names[] = {"text", "csv", "json", "binary"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *format = (output_format) i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * \brief Writes the coordinates of the cells, formatted into large buffers instead of one call per cell.
+ *
+ * \param fp Where to write, opened in binary mode for OUTPUT_BINARY.
+ * \param cells The cells, in the order they were detected.
+ * \param count Number of cells.
+ * \param format How to write them.
+ * \return 0, or -1 if writing failed.
+ */
+int output_cells(FILE *fp, const cell *cells, int count, output_format format) {
+    output_buffer *out = (output_buffer *) malloc(sizeof(output_buffer));
+    if (out == NULL) {
+        return -1;
+    }
+    out->fp = fp;
+    out->length = 0;
+    out->failed = 0;
+    if (format == OUTPUT_CSV) {
+        _put(out, "x,y\n");
+    } else if (format == OUTPUT_JSON) {
+        _put(out, "{\"count\": ");
+        _put_int(out, count);
+        _put(out, ", \"cells\": [");
+    } else if (format == OUTPUT_BINARY) {
+        _put(out, "CELL");
+        _put_le32(out, (unsigned int) count);
+    }
+    for (int i = 0; i < count; i++) {
+        if (out->length + OUTPUT_CELL_MAX > OUTPUT_BUFFER) {
+            _flush(out);
+        }
+        switch (format) {
+            case OUTPUT_TEXT:
+                _put(out, "x: ");
+                _put_int(out, cells[i].x);
+                _put(out, ", y: ");
+                _put_int(out, cells[i].y);
+                _put(out, "\n");
+                break;
+            case OUTPUT_CSV:
+                _put_int(out, cells[i].x);
+                _put(out, ",");
+                _put_int(out, cells[i].y);
+                _put(out, "\n");
+                break;
+            case OUTPUT_JSON:
+                _put(out, i == 0 ? "[" : ", [");
+                _put_int(out, cells[i].x);
+                _put(out, ", ");
+                _put_int(out, cells[i].y);
+                _put(out, "]");
+                break;
+            case OUTPUT_BINARY:
+                _put_le32(out, (unsigned int) cells[i].x);
+                _put_le32(out, (unsigned int) cells[i].y);
+                break;
+        }
+    }
+    if (format == OUTPUT_JSON) {
+        _put(out, "]}\n");
+    }
+    _flush(out);
+    int failed = out->failed || fflush(fp) != 0;
+    free(out);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,18 @@
+#ifndef OUTPUT_OUTPUT_H
+#define OUTPUT_OUTPUT_H
+
+#include <stdio.h>
+#include "cells.h"
+
+// How the coordinates of the cells are written
+typedef enum output_format {
+    OUTPUT_TEXT,        // "x: 1, y: 2" lines, as printCell() has always printed them
+    OUTPUT_CSV,         // an "x,y" header line, then one line per cell
+    OUTPUT_JSON,        // {"count": n, "cells": [[x, y], ...]}
+    OUTPUT_BINARY       // "CELL", the count, then x and y of every cell, all 32-bit little-endian
+} output_format;
+
+int output_parse_format(const char *name, output_format *format);
+int output_cells(FILE *fp, const cell *cells, int count, output_format format);
+
+#endif // OUTPUT_OUTPUT_H
@@ -0,0 +1,425 @@
+#include "parallel.h"
+#include "blur.h"
+#include "function.h"
+#include "threshold.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Arguments shared by the threads of one stage
+typedef struct stage_job {
+    worker_pool *pool;
+    const image *input;
+    const bmp_file *file;
+    image *output;
+    bitimage *mask;
+    int threshold;
+    const threshold_map *thresholds;
+    threshold_map *tiles;       // whose tile histograms the front end counts, or NULL
+    int (*histograms)[256];     // one per thread
+    long long (*wide)[256];     // one per thread, for images of more than INT_MAX pixels
+    erosion_state *erosion;
+    uint64_t *seams;            // two rows of words per thread
+    long *removed;              // one per thread
+    int failed;
+} stage_job;
+
+static void _greyscale_task(void *arg, int index, int count) {
+    stage_job *job = (stage_job *) arg;
+    int first, end;
+    pool_band(0, job->input->height, index, count, &first, &end);
+    greyscale_rows(job->input, job->output, first, end);
+}
+
+static void _blur_task(void *arg, int index, int count) {
+    stage_job *job = (stage_job *) arg;
+    int first, end;
+    pool_band(0, job->input->height, index, count, &first, &end);
+    if (gaussian_blur_rows(job->input, job->output, &blur_default_kernel, first, end) != 0) {
+        job->failed = 1;
+    }
+}
+
+// What the front-end source and sink of one band work on
+typedef struct front_band {
+    const bmp_file *file;
+    int width;                  // of the working image
+    int height;
+    int (*banks)[256];          // OTSU_BANKS of them
+    threshold_map *tiles;       // or else, whose tile histograms are counted
+    threshold_banks *tile_banks; // of each tile of the current row of tiles
+    int tile_row;               // -1 before the first counted row
+    int *histogram;             // of the band, the tiles are added to it when done
+} front_band;
+
+static void _front_source(void *context, int y, unsigned char *row) {
+    greyscale_work_row(((const front_band *) context)->file, y, row);
+}
+
+static void _front_sink(void *context, int y, const unsigned char *row) {
+    front_band *band = (front_band *) context;
+    if (band->tiles == NULL) {
+        otsu_histogram_row(row, y, band->width, band->height, band->banks);
+        return;
+    }
+    if (y < 2 || y >= band->height - WORK_PAD) {
+        return;
+    }
+    int tile_row = (y - 2) >> THRESHOLD_TILE_SHIFT;
+    if (tile_row != band->tile_row && band->tile_row >= 0) {
+        threshold_flush_row(band->tiles, band->tile_row, band->tile_banks, band->histogram);
+    }
+    band->tile_row = tile_row;
+    threshold_count_row(band->tiles, row, band->width, band->tile_banks);
+}
+
+static void _front_task(void *arg, int index, int count) {
+    stage_job *job = (stage_job *) arg;
+    int banks[OTSU_BANKS][256] = {{0}};
+    front_band band = {job->file, job->output->width, job->output->height, banks, job->tiles, NULL, -1,
+                       job->histograms[index]};
+    int first, end;
+    if (job->tiles != NULL) {
+        // Every tile is counted by one thread, and the band's histogram is the sum of its tiles
+        threshold_band(job->tiles, job->output->height, index, count, &first, &end);
+        band.tile_banks = (threshold_banks *) calloc((size_t) job->tiles->columns, sizeof(*band.tile_banks));
+        if (band.tile_banks == NULL) {
+            job->failed = 1;
+            return;
+        }
+    } else {
+        pool_band(0, job->output->height, index, count, &first, &end);
+    }
+    if (gaussian_blur_stream(_front_source, _front_sink, &band, job->output, &blur_default_kernel,
+                             first, end) != 0) {
+        job->failed = 1;
+    }
+    if (band.tile_row >= 0) {
+        threshold_flush_row(job->tiles, band.tile_row, band.tile_banks, band.histogram);
+    }
+    free(band.tile_banks);
+    // Each thread reduces its own banks, only the per-thread totals are summed serially
+    otsu_merge_banks(banks, job->histograms[index]);
+}
+
+// What the counting sink of one band of parallel_file_threshold() works on
+typedef struct count_band {
+    front_band front;
+    long long *wide;
+} count_band;
+
+// Moves the histogram of the rows of tiles flushed so far into the band's totals
+static void _widen(count_band *band) {
+    for (int i = 0; i < 256; i++) {
+        band->wide[i] += band->front.histogram[i];
+        band->front.histogram[i] = 0;
+    }
+}
+
+// Counts one row at a time in int banks, or one row of tiles, so the band's totals may exceed INT_MAX
+static void _count_sink(void *context, int y, const unsigned char *row) {
+    count_band *band = (count_band *) context;
+    if (band->front.tiles != NULL) {
+        int tile_row = band->front.tile_row;
+        _front_sink(&band->front, y, row);
+        if (band->front.tile_row != tile_row && tile_row >= 0) {
+            _widen(band);
+        }
+        return;
+    }
+    int banks[OTSU_BANKS][256] = {{0}};
+    otsu_histogram_row(row, y, band->front.width, band->front.height, banks);
+    for (int b = 0; b < OTSU_BANKS; b++) {
+        for (int i = 0; i < 256; i++) {
+            band->wide[i] += banks[b][i];
+        }
+    }
+}
+
+static void _count_task(void *arg, int index, int count) {
+    stage_job *job = (stage_job *) arg;
+    int width = job->file->width + WORK_PAD;
+    int height = job->file->height + WORK_PAD;
+    int histogram[256] = {0};
+    count_band band = {{job->file, width, height, NULL, job->tiles, NULL, -1, histogram}, job->wide[index]};
+    // A zero stride makes every blurred row land in the same scratch row
+    unsigned char *scratch = (unsigned char *) malloc((size_t) width);
+    if (job->tiles != NULL) {
+        band.front.tile_banks = (threshold_banks *) calloc((size_t) job->tiles->columns, sizeof(threshold_banks));
+    }
+    if (scratch == NULL || (job->tiles != NULL && band.front.tile_banks == NULL)) {
+        free(scratch);
+        free(band.front.tile_banks);
+        job->failed = 1;
+        return;
+    }
+    image row;
+    image_wrap(&row, scratch, width, height, 1, 0);
+    int first, end;
+    if (job->tiles != NULL) {
+        threshold_band(job->tiles, height, index, count, &first, &end);
+    } else {
+        pool_band(0, height, index, count, &first, &end);
+    }
+    if (gaussian_blur_stream(_front_source, _count_sink, &band, &row, &blur_default_kernel, first, end) != 0) {
+        job->failed = 1;
+    }
+    if (band.front.tile_row >= 0) {
+        threshold_flush_row(job->tiles, band.front.tile_row, band.front.tile_banks, histogram);
+        _widen(&band);
+    }
+    free(band.front.tile_banks);
+    free(scratch);
+}
+
+static void _histogram_task(void *arg, int index, int count) {
+    stage_job *job = (stage_job *) arg;
+    int first, end;
+    pool_band(0, job->input->height, index, count, &first, &end);
+    otsu_histogram(job->input, first, end, job->histograms[index]);
+}
+
+static void _black_white_task(void *arg, int index, int count) {
+    stage_job *job = (stage_job *) arg;
+    int first, end;
+    pool_band(0, job->input->height, index, count, &first, &end);
+    black_white_rows(job->input, job->threshold, job->mask, first, end);
+}
+
+static void _threshold_task(void *arg, int index, int count) {
+    stage_job *job = (stage_job *) arg;
+    int first, end;
+    pool_band(0, job->input->height, index, count, &first, &end);
+    if (threshold_rows(job->input, job->thresholds, job->mask, first, end) != 0) {
+        job->failed = 1;
+    }
+}
+
+static void _erosion_task(void *arg, int index, int count) {
+    stage_job *job = (stage_job *) arg;
+    erosion_state *state = job->erosion;
+    uint64_t *seam = job->seams + (size_t) index * 2 * state->words;
+    int first, end;
+    pool_band(WORK_PAD, state->mask->height - WORK_PAD, index, count, &first, &end);
+    erosion_step_seam(state, first, end, seam);
+    // The seam rows of the band above read the first rows of this band
+    pool_barrier(job->pool);
+    job->removed[index] = erosion_step_band(state, first, end, seam);
+    // The next dirty words depend on the changes of the band below
+    pool_barrier(job->pool);
+    erosion_step_dirty(state, first, end);
+}
+
+/**
+ * \brief Converts an image to greyscale, one band of rows per thread.
+ */
+void parallel_greyscale(worker_pool *pool, const image *input_image, image *temp_image) {
+    stage_job job = {0};
+    job.input = input_image;
+    job.output = temp_image;
+    pool_run(pool, _greyscale_task, &job);
+}
+
+/**
+ * \brief Applies the Gaussian filter, one band of rows per thread.
+ *
+ * Every band reads BLUR_RADIUS rows of its neighbours, so unlike
+ * gaussian_filter() the output must be a different image than the input.
+ *
+ * \return 0 on success, -1 if memory ran out.
+ */
+int parallel_gaussian_filter(worker_pool *pool, const image *inputImage, image *outputImage) {
+    stage_job job = {0};
+    job.input = inputImage;
+    job.output = outputImage;
+    pool_run(pool, _blur_task, &job);
+    return job.failed ? -1 : 0;
+}
+
+// Mean grey level of the pixels of a histogram, 0 if it is empty
+static double _mean(const long long histogram[256]) {
+    long long count = 0;
+    double sum = 0;
+    for (int i = 0; i < 256; i++) {
+        count += histogram[i];
+        sum += (double) i * (double) histogram[i];
+    }
+    return count > 0 ? sum / (double) count : 0;
+}
+
+/**
+ * \brief Sums per-thread histograms and picks the Otsu threshold of the total.
+ *
+ * \param mean Receives the mean grey level of the counted pixels, unless NULL.
+ */
+static int _threshold(int (*histograms)[256], int threads, const image *work, double *mean) {
+    int histogram[256] = {0};
+    for (int t = 0; t < threads; t++) {
+        for (int i = 0; i < 256; i++) {
+            histogram[i] += histograms[t][i];
+        }
+    }
+    if (mean != NULL) {
+        long long wide[256];
+        for (int i = 0; i < 256; i++) {
+            wide[i] = histogram[i];
+        }
+        *mean = _mean(wide);
+    }
+    int total_pixels = (work->width - WORK_PAD) * (work->height - WORK_PAD);
+    return otsu_from_histogram(histogram, total_pixels);
+}
+
+/**
+ * \brief Greyscale, Gaussian filter and Otsu histogram in one pass over a BMP file.
+ *
+ * Each thread streams its band of file rows through greyscale_work_row()
+ * into the blur's row ring and counts every blurred row as it comes out,
+ * so neither the RGB image nor the grey image is ever stored. The blurred
+ * image and the threshold are exactly those of parallel_greyscale(),
+ * parallel_gaussian_filter() and parallel_otsu_threshold() on the decoded
+ * file.
+ *
+ * \param pool Threads to split the rows across, or NULL to run serially.
+ * \param file The opened BMP file.
+ * \param outputImage Grey image WORK_PAD larger than the file that receives
+ *                    the blur, its WORK_PAD border must be zero.
+ * \param tiles Map laid over outputImage by threshold_map_fit() whose tile
+ *              histograms are counted instead of one histogram per thread,
+ *              or NULL. The threshold is the same either way.
+ * \param mean Receives the mean grey level of the blurred pixels the threshold counts, unless NULL.
+ * \return The Otsu threshold of the blurred image, or -1 if memory ran out.
+ */
+int parallel_front_end(worker_pool *pool, const bmp_file *file, image *outputImage, threshold_map *tiles,
+                       double *mean) {
+    int threads = pool_threads(pool);
+    stage_job job = {0};
+    job.file = file;
+    job.output = outputImage;
+    job.tiles = tiles;
+    job.histograms = (int (*)[256]) calloc((size_t) threads, sizeof(*job.histograms));
+    if (job.histograms == NULL) {
+        return -1;
+    }
+    pool_run(pool, _front_task, &job);
+    int threshold = job.failed ? -1 : _threshold(job.histograms, threads, outputImage, mean);
+    free(job.histograms);
+    return threshold;
+}
+
+/**
+ * \brief Otsu threshold of a whole BMP file, keeping one blurred row per thread.
+ *
+ * The rows go through greyscale and blur as in parallel_front_end(), but
+ * are only counted, so memory does not grow with the height of the file
+ * and counts are kept in 64 bits. The threshold is that of
+ * parallel_front_end() on the same file, see otsu_from_wide_histogram().
+ *
+ * \param pool Threads to split the rows across, or NULL to run serially.
+ * \param file The opened BMP file.
+ * \param tiles Map laid over the whole file by threshold_map_fit() whose
+ *              tile histograms are counted too, as in parallel_front_end(), or NULL.
+ * \param mean Receives the mean grey level of the blurred pixels the threshold counts, unless NULL.
+ * \return The Otsu threshold of the blurred file, or -1 if memory ran out.
+ */
+int parallel_file_threshold(worker_pool *pool, const bmp_file *file, threshold_map *tiles, double *mean) {
+    int threads = pool_threads(pool);
+    stage_job job = {0};
+    job.file = file;
+    job.tiles = tiles;
+    job.wide = (long long (*)[256]) calloc((size_t) threads, sizeof(*job.wide));
+    if (job.wide == NULL) {
+        return -1;
+    }
+    pool_run(pool, _count_task, &job);
+    if (job.failed) {
+        free(job.wide);
+        return -1;
+    }
+    long long histogram[256] = {0};
+    for (int t = 0; t < threads; t++) {
+        for (int i = 0; i < 256; i++) {
+            histogram[i] += job.wide[t][i];
+        }
+    }
+    free(job.wide);
+    if (mean != NULL) {
+        *mean = _mean(histogram);
+    }
+    return otsu_from_wide_histogram(histogram, (long long) file->width * file->height);
+}
+
+/**
+ * \brief Calculates the Otsu threshold from per-thread histograms.
+ *
+ * The histograms are summed before the threshold is searched, so the
+ * result is exactly that of otsu_threshold().
+ *
+ * \param mean Receives the mean grey level of the counted pixels, unless NULL.
+ * \return The Otsu threshold, or -1 if memory ran out.
+ */
+int parallel_otsu_threshold(worker_pool *pool, const image *inputImage, double *mean) {
+    int threads = pool_threads(pool);
+    stage_job job = {0};
+    job.input = inputImage;
+    job.histograms = (int (*)[256]) calloc((size_t) threads, sizeof(*job.histograms));
+    if (job.histograms == NULL) {
+        return -1;
+    }
+    pool_run(pool, _histogram_task, &job);
+    int threshold = _threshold(job.histograms, threads, inputImage, mean);
+    free(job.histograms);
+    return threshold;
+}
+
+/**
+ * \brief Thresholds an image into a bit image, one band of rows per thread.
+ */
+void parallel_black_white(worker_pool *pool, const image *inputImage, int threshold, bitimage *outputImage) {
+    stage_job job = {0};
+    job.input = inputImage;
+    job.mask = outputImage;
+    job.threshold = threshold;
+    pool_run(pool, _black_white_task, &job);
+}
+
+/**
+ * \brief Thresholds an image against a threshold map, one band of rows per thread.
+ *
+ * \return 0 on success, -1 if memory ran out.
+ */
+int parallel_threshold_map(worker_pool *pool, const image *inputImage, const threshold_map *map,
+                           bitimage *outputImage) {
+    stage_job job = {0};
+    job.input = inputImage;
+    job.mask = outputImage;
+    job.thresholds = map;
+    pool_run(pool, _threshold_task, &job);
+    return job.failed ? -1 : 0;
+}
+
+/**
+ * \brief Runs one erosion step, one band of rows per thread.
+ *
+ * \return 1 if the mask is fully eroded, 0 otherwise, like erosion_step(), or -1 if memory ran out.
+ */
+int parallel_erosion_step(worker_pool *pool, erosion_state *state) {
+    int threads = pool_threads(pool);
+    stage_job job = {0};
+    job.pool = pool;
+    job.erosion = state;
+    job.seams = (uint64_t *) malloc((size_t) threads * 2 * (size_t) state->words * sizeof(uint64_t));
+    job.removed = (long *) calloc((size_t) threads, sizeof(long));
+    if (job.seams == NULL || job.removed == NULL) {
+        free(job.seams);
+        free(job.removed);
+        return -1;
+    }
+    pool_run(pool, _erosion_task, &job);
+    for (int t = 0; t < threads; t++) {
+        state->white -= job.removed[t];
+    }
+    free(job.seams);
+    free(job.removed);
+    return state->white == 0;
+}
@@ -0,0 +1,24 @@
+#ifndef PARALLEL_PARALLEL_H
+#define PARALLEL_PARALLEL_H
+
+#include "cbmp.h"
+#include "image.h"
+#include "bitimage.h"
+#include "erosion.h"
+#include "pool.h"
+#include "threshold.h"
+
+// Band-parallel versions of the pipeline stages. Each gives exactly the
+// result of its serial counterpart, for any number of threads.
+void parallel_greyscale(worker_pool *pool, const image *input_image, image *temp_image);
+int parallel_gaussian_filter(worker_pool *pool, const image *inputImage, image *outputImage);
+int parallel_otsu_threshold(worker_pool *pool, const image *inputImage, double *mean);
+int parallel_front_end(worker_pool *pool, const bmp_file *file, image *outputImage, threshold_map *tiles,
+                       double *mean);
+int parallel_file_threshold(worker_pool *pool, const bmp_file *file, threshold_map *tiles, double *mean);
+void parallel_black_white(worker_pool *pool, const image *inputImage, int threshold, bitimage *outputImage);
+int parallel_threshold_map(worker_pool *pool, const image *inputImage, const threshold_map *map,
+                           bitimage *outputImage);
+int parallel_erosion_step(worker_pool *pool, erosion_state *state);
+
+#endif // PARALLEL_PARALLEL_H
@@ -0,0 +1,81 @@
+#include "perf.h"
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char *const event_names[PERF_EVENTS] = {"cycles", "instructions", "cache_misses"};
+
+/**
+ * \brief Starts counting hardware events on the calling thread, in user space only.
+ *
+ * Uses perf_event_open() on Linux. Counting may be refused by the kernel
+ * (see /proc/sys/kernel/perf_event_paranoid) or unsupported, for example
+ * in virtual machines; events that cannot be counted are left out.
+ *
+ * \param counters Receives one file per event.
+ * \return 0 if at least one event is counted, -1 otherwise.
+ */
+int perf_open(perf_counters *counters) {
+    int opened = 0;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        counters->fds[e] = -1;
+    }
+#ifdef __linux__
+    static const uint64_t configs[PERF_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[e];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Calling thread, any CPU, no group
+        long fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd >= 0) {
+            counters->fds[e] = (int) fd;
+            opened++;
+        }
+    }
+#endif
+    return opened > 0 ? 0 : -1;
+}
+
+int perf_available(const perf_counters *counters, perf_event event) {
+    return counters->fds[event] >= 0;
+}
+
+/**
+ * \brief Reads the running count of every event, for the difference between two reads.
+ */
+void perf_read(const perf_counters *counters, uint64_t values[PERF_EVENTS]) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        values[e] = 0;
+#ifdef __linux__
+        if (counters->fds[e] >= 0 && read(counters->fds[e], &values[e], sizeof(values[e])) != sizeof(values[e])) {
+            values[e] = 0;
+        }
+#endif
+    }
+}
+
+const char *perf_event_name(perf_event event) {
+    return event_names[event];
+}
+
+void perf_close(perf_counters *counters) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+#ifdef __linux__
+        if (counters->fds[e] >= 0) {
+            close(counters->fds[e]);
+        }
+#endif
+        counters->fds[e] = -1;
+    }
+}
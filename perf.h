@@ -0,0 +1,29 @@
+#ifndef PERF_PERF_H
+#define PERF_PERF_H
+
+#include <stdint.h>
+
+// Hardware events counted per stage
+typedef enum perf_event {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_EVENTS
+} perf_event;
+
+/**
+ * \brief Hardware counters of the calling thread, see perf_open().
+ *
+ * Events the system cannot count have no file and always read as 0.
+ */
+typedef struct perf_counters {
+    int fds[PERF_EVENTS];       // -1 for events that are not counted
+} perf_counters;
+
+int perf_open(perf_counters *counters);
+int perf_available(const perf_counters *counters, perf_event event);
+void perf_read(const perf_counters *counters, uint64_t values[PERF_EVENTS]);
+const char *perf_event_name(perf_event event);
+void perf_close(perf_counters *counters);
+
+#endif // PERF_PERF_H
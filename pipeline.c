@@ -0,0 +1,668 @@
+#include "pipeline.h"
+#include "detect.h"
+#include "distance.h"
+#include "components.h"
+#include "function.h"
+#include "minmax.h"
+#include "parallel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "read_bitmap", "front_end", "threshold_mask", "components", "detect_cells", "draw", "write_bitmap"
+};
+
+/**
+ * \brief Makes img a zeroed image of the given size, keeping its buffer if the size matches.
+ *
+ * A kept buffer is not cleared again: every stage writes all the pixels it
+ * later reads, and the borders it never writes are still zero.
+ */
+static int _fit_image(image *img, int width, int height, int channels) {
+    if (img->data != NULL && img->width == width && img->height == height && img->channels == channels) {
+        return 0;
+    }
+    image_free(img);
+    return image_alloc(img, width, height, channels);
+}
+
+static int _fit_bitimage(bitimage *img, int width, int height) {
+    if (img->data != NULL && img->width == width && img->height == height) {
+        return 0;
+    }
+    bitimage_free(img);
+    return bitimage_alloc(img, width, height);
+}
+
+/**
+ * \brief Seconds on a monotonic clock, for measuring the time between two calls.
+ */
+double pipeline_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/**
+ * \brief Starts timing a stage, and counting its hardware events if p->perf is set.
+ *
+ * Stages never overlap, so one start is kept in the pipeline.
+ */
+static void _stage_begin(pipeline *p) {
+    p->stage_begin = pipeline_clock();
+    if (p->perf != NULL) {
+        perf_read(p->perf, p->perf_begin);
+    }
+}
+
+/**
+ * \brief Adds the time, and the events, since _stage_begin() to a stage.
+ */
+static void _stage_end(pipeline *p, pipeline_stage stage) {
+    p->seconds[stage] += pipeline_clock() - p->stage_begin;
+    if (p->perf != NULL) {
+        uint64_t now[PERF_EVENTS];
+        perf_read(p->perf, now);
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            p->counts[stage][e] += now[e] - p->perf_begin[e];
+        }
+    }
+}
+
+// Zeroes the times and counts of stages [first, last]
+static void _reset_stages(pipeline *p, int first, int last) {
+    for (int stage = first; stage <= last; stage++) {
+        p->seconds[stage] = 0;
+        memset(p->counts[stage], 0, sizeof(p->counts[stage]));
+    }
+}
+
+/**
+ * \brief Short name of a stage, as used in benchmark reports.
+ */
+const char *pipeline_stage_name(pipeline_stage stage) {
+    return stage_names[stage];
+}
+
+void pipeline_init(pipeline *p) {
+    memset(p, 0, sizeof(*p));
+    p->fixed_threshold = -1;
+}
+
+/**
+ * \brief Opens an input file: a BMP or PGM file, or a headerless frame if p->raw_width is set.
+ *
+ * \param p The pipeline whose settings are used.
+ * \param input_path Path of the file.
+ * \param file Descriptor filled in on success, release it with bmp_close().
+ * \return BMP_OK, or the reason the file was rejected.
+ */
+bmp_status pipeline_open(const pipeline *p, const char *input_path, bmp_file *file) {
+    if (p->raw_width > 0) {
+        return bmp_open_raw(input_path, p->raw_width, p->raw_height, file);
+    }
+    return bmp_open(input_path, file);
+}
+
+/**
+ * \brief Detects the cells of an input file, leaving them in p->cells.
+ *
+ * \param p The pipeline whose buffers are used.
+ * \param input_path Path of the file to read, see pipeline_open().
+ * \param output_path Where to write the input with the cells marked, in its own format, or NULL. With
+ *                    p->thumbnail_scale above 1 a 24-bit BMP thumbnail is written there instead.
+ * \param pool Threads each stage is split across, or NULL to run serially.
+ * \return BMP_OK, or the reason the image could not be read or written.
+ */
+bmp_status pipeline_process(pipeline *p, const char *input_path, const char *output_path, worker_pool *pool) {
+    _reset_stages(p, STAGE_READ, STAGE_WRITE);
+    bmp_file file;
+    _stage_begin(p);
+    bmp_status status = pipeline_open(p, input_path, &file);
+    _stage_end(p, STAGE_READ);
+    if (status != BMP_OK) {
+        return status;
+    }
+    status = pipeline_detect_file(p, &file, pool);
+    if (status == BMP_OK && output_path != NULL && p->thumbnail_scale > 1) {
+        //Save a shrunk copy with the markers drawn full size
+        _stage_begin(p);
+        status = pipeline_thumbnail(&file, p->cells.cells, p->cells.count, p->thumbnail_scale, &p->thumbnail);
+        _stage_end(p, STAGE_DRAW);
+        if (status == BMP_OK) {
+            _stage_begin(p);
+            status = bmp_write_image(&p->thumbnail, output_path);
+            _stage_end(p, STAGE_WRITE);
+        }
+    } else if (status == BMP_OK && output_path != NULL) {
+        //Save image to file
+        _stage_begin(p);
+        status = pipeline_mark(&file, p->cells.cells, p->cells.count, &p->marks);
+        _stage_end(p, STAGE_DRAW);
+        if (status == BMP_OK) {
+            _stage_begin(p);
+            status = bmp_write_patched(&file, &p->marks, output_path);
+            _stage_end(p, STAGE_WRITE);
+        }
+    }
+    bmp_close(&file);
+    return status;
+}
+
+/**
+ * \brief Makes the working buffers fit an input image of the given size.
+ *
+ * Also zeroes the times and counters of the detection stages, which are
+ * about to be measured again.
+ */
+static bmp_status _fit(pipeline *p, int input_width, int input_height) {
+    _reset_stages(p, STAGE_FRONT_END, STAGE_DETECT);
+    p->stats.threshold = -1;
+    p->stats.white = -1;
+    p->stats.components = -1;
+    p->stats.early = -1;
+    p->stats.count = 0;
+    int width = input_width + WORK_PAD;
+    int height = input_height + WORK_PAD;
+    cell_list_free(&p->cells);
+    if (_fit_image(&p->blur, width, height, 1) != 0 ||
+        _fit_bitimage(&p->mask, width, height) != 0 ||
+        cell_list_init(&p->cells, width, height) != 0) {
+        return BMP_ERR_NOMEM;
+    }
+    return BMP_OK;
+}
+
+static bmp_status _add_iteration(pipeline *p, long eroded, long candidates, int cells) {
+    pipeline_stats *stats = &p->stats;
+    if (stats->count == stats->capacity) {
+        int capacity = stats->capacity == 0 ? 32 : 2 * stats->capacity;
+        pipeline_iteration *iterations = (pipeline_iteration *) realloc(stats->iterations,
+                                                                        (size_t) capacity * sizeof(pipeline_iteration));
+        if (iterations == NULL) {
+            return BMP_ERR_NOMEM;
+        }
+        stats->iterations = iterations;
+        stats->capacity = capacity;
+    }
+    pipeline_iteration *iteration = &stats->iterations[stats->count++];
+    iteration->eroded = eroded;
+    iteration->candidates = candidates;
+    iteration->cells = cells;
+    iteration->white = p->erosion.white;
+    return BMP_OK;
+}
+
+static int _compare_cells(const void *a, const void *b) {
+    const cell *first = (const cell *) a;
+    const cell *second = (const cell *) b;
+    if (first->x != second->x) {
+        return first->x < second->x ? -1 : 1;
+    }
+    return first->y < second->y ? -1 : first->y > second->y;
+}
+
+/**
+ * \brief Puts the cells of isolated components among those the first erosion step found.
+ *
+ * Both are cells of the first step, which detectCell() registers column by
+ * column, so sorting them together gives the order of a run without the
+ * components taken out.
+ */
+static bmp_status _merge_early(pipeline *p, const cell_list *early) {
+    if (early->count == 0) {
+        return BMP_OK;
+    }
+    int count = p->cells.count + early->count;
+    cell *merged = (cell *) malloc((size_t) count * sizeof(cell));
+    if (merged == NULL) {
+        return BMP_ERR_NOMEM;
+    }
+    //A list has no storage before its first cell, as in a tile with no cell left to erode
+    if (p->cells.count > 0) {
+        memcpy(merged, p->cells.cells, (size_t) p->cells.count * sizeof(cell));
+    }
+    memcpy(merged + p->cells.count, early->cells, (size_t) early->count * sizeof(cell));
+    qsort(merged, (size_t) count, sizeof(cell), _compare_cells);
+    cell_list_free(&p->cells);
+    bmp_status status = BMP_OK;
+    if (cell_list_init(&p->cells, p->mask.width, p->mask.height) != 0) {
+        status = BMP_ERR_NOMEM;
+    }
+    for (int i = 0; i < count && status == BMP_OK; i++) {
+        if (cell_list_add(&p->cells, merged[i].x, merged[i].y) < 0) {
+            status = BMP_ERR_NOMEM;
+        }
+    }
+    free(merged);
+    return status;
+}
+
+/**
+ * \brief Thresholds p->blur, then finds the cells the way p->mode asks for.
+ *
+ * The threshold and mean grey level of the image are replaced by
+ * p->fixed_threshold and p->fixed_mean when that is set. Unless
+ * p->threshold_mode is THRESHOLD_GLOBAL, the threshold is adapted over the
+ * image from them (see threshold_map_build()), with the tile histograms of
+ * THRESHOLD_TILES already counted in p->thresholds, or the tile thresholds
+ * taken from p->fixed_map if it is set.
+ */
+static bmp_status _detect_blurred(pipeline *p, int threshold, double mean, worker_pool *pool) {
+    if (p->fixed_threshold >= 0) {
+        threshold = p->fixed_threshold;
+        mean = p->fixed_mean;
+    }
+    //Making the blurred image black and white, packed into the mask
+    _stage_begin(p);
+    if (p->threshold_mode == THRESHOLD_GLOBAL) {
+        parallel_black_white(pool, &p->blur, threshold, &p->mask);
+    } else if (p->threshold_mode == THRESHOLD_TILES && p->fixed_map != NULL) {
+        if (parallel_threshold_map(pool, &p->blur, p->fixed_map, &p->mask) != 0) {
+            return BMP_ERR_NOMEM;
+        }
+    } else {
+        threshold_map_build(&p->thresholds, p->threshold_mode, threshold, mean);
+        if (parallel_threshold_map(pool, &p->blur, &p->thresholds, &p->mask) != 0) {
+            return BMP_ERR_NOMEM;
+        }
+    }
+    _stage_end(p, STAGE_THRESHOLD);
+    p->stats.threshold = threshold;
+
+    //The distance transform finds every cell in a fixed number of passes
+    if (p->mode == DETECT_DISTANCE) {
+        if (_fit_image(&p->distance, p->mask.width, p->mask.height, 1) != 0) {
+            return BMP_ERR_NOMEM;
+        }
+        _stage_begin(p);
+        bmp_status status = distance_detect_cells(&p->mask, &p->distance, &p->cells) == 0 ? BMP_OK : BMP_ERR_NOMEM;
+        _stage_end(p, STAGE_DETECT);
+        return status;
+    }
+
+    //One labelling pass gives the components, which are the cells in the fast-count mode
+    _stage_begin(p);
+    if (components_label(&p->mask, &p->components) != 0) {
+        return BMP_ERR_NOMEM;
+    }
+    p->stats.white = 0;
+    for (int i = 0; i < p->components.count; i++) {
+        p->stats.white += p->components.items[i].area;
+    }
+    if (p->mode == DETECT_COMPONENTS) {
+        p->stats.components = p->components.count;
+        bmp_status status = components_to_cells(&p->components, &p->cells) == 0 ? BMP_OK : BMP_ERR_NOMEM;
+        _stage_end(p, STAGE_COMPONENTS);
+        return status;
+    }
+
+    //Small components far from everything else are detected on their own, outside the loop
+    cell_list early;
+    if (cell_list_init(&early, p->mask.width, p->mask.height) != 0) {
+        return BMP_ERR_NOMEM;
+    }
+    if (components_detect_isolated(&p->mask, &p->components, &early) != 0) {
+        cell_list_free(&early);
+        return BMP_ERR_NOMEM;
+    }
+    _stage_end(p, STAGE_COMPONENTS);
+    p->stats.components = p->components.count;
+    p->stats.early = early.count;
+
+    /** Variables used for printing the eroded images
+    int i=0;
+    char name[32];
+    image print;
+     **/
+
+    //Run erosion to remove noise, only revisiting the parts of the mask that changed,
+    //with detectCell following each step in the same sweep
+    if (erosion_init(&p->erosion, &p->mask) != 0) {
+        cell_list_free(&early);
+        return BMP_ERR_NOMEM;
+    }
+    bmp_status status = BMP_OK;
+    int step = 0;
+    while (status == BMP_OK) {
+        long white = p->erosion.white;
+        int previous = p->cells.count;
+        _stage_begin(p);
+        long candidates = erode_detect_cells(&p->erosion, &p->cells, pool);
+        _stage_end(p, STAGE_DETECT);
+        if (candidates < 0) {
+            status = BMP_ERR_NOMEM;
+            break;
+        }
+        if (p->erosion.white == 0) {
+            break;
+        }
+        if (++step == 1) {
+            status = _merge_early(p, &early);
+        }
+        long eroded = white - p->erosion.white;
+        //detectCell appends the cells it finds and clears only their capture areas
+        for (int i = previous; i < p->cells.count; i++) {
+            erosion_mark(&p->erosion, p->cells.cells[i].x - 3, p->cells.cells[i].y - 3, 7, 7);
+        }
+        if (status == BMP_OK) {
+            status = _add_iteration(p, eroded, candidates, p->cells.count - previous);
+        }
+
+        /** Printing every eroded image if needed
+        bitimage_unpack(&p->mask, &p->temp);
+        tempImageToPrint(&p->temp, &print);
+        sprintf(name, "output%d.bmp", i);
+        write_bitmap(&print, name);
+        i++;
+         **/
+    }
+    //The cells of the isolated components still count if the rest was gone after one step
+    if (status == BMP_OK && step == 0) {
+        status = _merge_early(p, &early);
+    }
+    erosion_free(&p->erosion);
+    cell_list_free(&early);
+    return status;
+}
+
+/**
+ * \brief Detects the cells of an opened BMP file, streaming it through the first stages.
+ *
+ * The file rows go through greyscale, blur and histogram in one pass (see
+ * parallel_front_end()), so only the blurred image is ever stored.
+ *
+ * \param p The pipeline whose working buffers are used, the cells are left in p->cells.
+ * \param file The opened BMP file.
+ * \param pool Threads each stage is split across, or NULL to run serially.
+ * \return BMP_OK, or BMP_ERR_NOMEM if memory ran out.
+ */
+bmp_status pipeline_detect_file(pipeline *p, const bmp_file *file, worker_pool *pool) {
+    bmp_status status = _fit(p, file->width, file->height);
+    if (status != BMP_OK) {
+        return status;
+    }
+    //The tile histograms are counted along with the blur
+    threshold_map *tiles = NULL;
+    if (p->threshold_mode == THRESHOLD_TILES && p->fixed_map == NULL) {
+        if (threshold_map_fit(&p->thresholds, p->blur.width, p->blur.height) != 0) {
+            return BMP_ERR_NOMEM;
+        }
+        tiles = &p->thresholds;
+    }
+    _stage_begin(p);
+    double mean;
+    int threshold = parallel_front_end(pool, file, &p->blur, tiles, &mean);
+    _stage_end(p, STAGE_FRONT_END);
+    if (threshold < 0) {
+        return BMP_ERR_NOMEM;
+    }
+    return _detect_blurred(p, threshold, mean, pool);
+}
+
+/**
+ * \brief Detects the cells of an RGB image that is already in memory.
+ *
+ * \param p The pipeline whose working buffers are used, the cells are left in p->cells.
+ * \param input The RGB image.
+ * \param pool Threads each stage is split across, or NULL to run serially.
+ * \return BMP_OK, or BMP_ERR_NOMEM if memory ran out.
+ */
+bmp_status pipeline_detect(pipeline *p, const image *input, worker_pool *pool) {
+    //The working buffers follow the size of the image
+    bmp_status status = _fit(p, input->width, input->height);
+    if (status != BMP_OK) {
+        return status;
+    }
+    if (_fit_image(&p->temp, p->blur.width, p->blur.height, 1) != 0) {
+        return BMP_ERR_NOMEM;
+    }
+
+    //Every stage runs on horizontal bands of the image, one per thread
+    //Run greyscale filter in case the image is colored
+    _stage_begin(p);
+    parallel_greyscale(pool, input, &p->temp);
+
+    //Run gaussian filter
+    double mean;
+    int threshold = -1;
+    if (parallel_gaussian_filter(pool, &p->temp, &p->blur) == 0) {
+        threshold = parallel_otsu_threshold(pool, &p->blur, &mean);
+    }
+    if (threshold < 0) {
+        return BMP_ERR_NOMEM;
+    }
+    if (p->threshold_mode == THRESHOLD_TILES && p->fixed_map == NULL) {
+        if (threshold_map_fit(&p->thresholds, p->blur.width, p->blur.height) != 0 ||
+            threshold_map_count(&p->thresholds, &p->blur, pool) != 0) {
+            return BMP_ERR_NOMEM;
+        }
+    }
+    _stage_end(p, STAGE_FRONT_END);
+    return _detect_blurred(p, threshold, mean, pool);
+}
+
+/**
+ * \brief Paints a marker at each cell into patches of a BMP file, leaving the file as it is.
+ *
+ * Only the rows of the markers are copied out of the file, so the cost
+ * follows the number of cells, not the size of the image. Written with
+ * bmp_write_patched(), the patches give the same file as drawDot() on the
+ * decoded image and bmp_save().
+ *
+ * \param file The opened input file.
+ * \param cells The cells to mark, in the order they were detected.
+ * \param count Number of cells.
+ * \param marks Cleared, then filled with the merged and painted patches.
+ * \return BMP_OK, or BMP_ERR_NOMEM if the patches could not be made.
+ */
+bmp_status pipeline_mark(const bmp_file *file, const cell *cells, int count, bmp_patches *marks) {
+    bmp_patches_clear(marks);
+    for (int i = 0; i < count; i++) {
+        if (cells[i].x >= file->width) {
+            continue;
+        }
+        int width = min(CELL_MARKER_WIDTH, file->width - cells[i].x);
+        for (int y = cells[i].y; y < cells[i].y + CELL_MARKER_HEIGHT && y < file->height; y++) {
+            if (bmp_patch_pixels(marks, file, cells[i].x, y, width) != BMP_OK) {
+                return BMP_ERR_NOMEM;
+            }
+        }
+    }
+    bmp_status status = bmp_patches_merge(marks, file);
+    if (status != BMP_OK) {
+        return status;
+    }
+    unsigned char marker[CELL_MARKER_HEIGHT][CELL_MARKER_WIDTH][3];
+    for (int y = 0; y < CELL_MARKER_HEIGHT; y++) {
+        for (int x = 0; x < CELL_MARKER_WIDTH; x++) {
+            cellMarker(x, y, marker[y][x]);
+        }
+    }
+    // Newest first, the order drawDot() stacks overlapping markers in
+    for (int i = count - 1; i >= 0; i--) {
+        if (cells[i].x >= file->width) {
+            continue;
+        }
+        int width = min(CELL_MARKER_WIDTH, file->width - cells[i].x);
+        for (int y = 0; y < CELL_MARKER_HEIGHT && cells[i].y + y < file->height; y++) {
+            bmp_patch_set_pixels(marks, file, cells[i].x, cells[i].y + y, marker[y][0], width);
+        }
+    }
+    return BMP_OK;
+}
+
+// Colour of pixel x of a stored row, whatever the kind of file
+static void _file_rgb(const bmp_file *file, const unsigned char *row, int x, unsigned int rgb[3]) {
+    if (file->channels >= 3) {
+        const unsigned char *pixel = row + (size_t) x * file->channels;
+        rgb[0] = pixel[2];
+        rgb[1] = pixel[1];
+        rgb[2] = pixel[0];
+    } else if (file->palette != NULL && row[x] < file->colours) {
+        const unsigned char *colour = file->palette + 4 * (size_t) row[x];
+        rgb[0] = colour[2];
+        rgb[1] = colour[1];
+        rgb[2] = colour[0];
+    } else {
+        rgb[0] = rgb[1] = rgb[2] = file->grey[row[x]];
+    }
+}
+
+/**
+ * \brief Makes a copy of a file shrunk by a whole factor, with a marker at each cell.
+ *
+ * Each pixel is the mean colour of a block of scale x scale pixels of the
+ * file, smaller along the right and bottom edges, read row by row
+ * straight from the file. The markers are drawn full size at the cells'
+ * positions divided by scale, so they stay readable however small the
+ * thumbnail gets.
+ *
+ * \param file The opened input file.
+ * \param cells The cells to mark, in the order they were detected.
+ * \param count Number of cells.
+ * \param scale Factor the file is shrunk by, at least 1.
+ * \param thumbnail RGB image resized to fit, its buffer is kept when the size matches.
+ * \return BMP_OK, or BMP_ERR_NOMEM.
+ */
+bmp_status pipeline_thumbnail(const bmp_file *file, const cell *cells, int count, int scale, image *thumbnail) {
+    int width = (file->width + scale - 1) / scale;
+    int height = (file->height + scale - 1) / scale;
+    unsigned int *sums = (unsigned int *) malloc((size_t) width * 3 * sizeof(unsigned int));
+    if (sums == NULL || _fit_image(thumbnail, width, height, BMP_CHANNELS) != 0) {
+        free(sums);
+        return BMP_ERR_NOMEM;
+    }
+    for (int ty = 0; ty < height; ty++) {
+        memset(sums, 0, (size_t) width * 3 * sizeof(unsigned int));
+        int end = min((ty + 1) * scale, file->height);
+        for (int y = ty * scale; y < end; y++) {
+            const unsigned char *row = bmp_row(file, y);
+            for (int x = 0; x < file->width; x++) {
+                unsigned int rgb[3];
+                _file_rgb(file, row, x, rgb);
+                unsigned int *sum = &sums[(x / scale) * 3];
+                sum[0] += rgb[0];
+                sum[1] += rgb[1];
+                sum[2] += rgb[2];
+            }
+        }
+        unsigned char *pixel = IMAGE_PIXEL(thumbnail, 0, ty);
+        for (int tx = 0; tx < width; tx++, pixel += BMP_CHANNELS) {
+            unsigned int block = (unsigned int) ((end - ty * scale) * (min((tx + 1) * scale, file->width) - tx * scale));
+            for (int c = 0; c < 3; c++) {
+                pixel[c] = (unsigned char) ((sums[tx * 3 + c] + block / 2) / block);
+            }
+        }
+    }
+    free(sums);
+
+    // Newest first, the order drawDot() stacks overlapping markers in
+    for (int i = count - 1; i >= 0; i--) {
+        int left = cells[i].x / scale;
+        int top = cells[i].y / scale;
+        for (int y = 0; y < CELL_MARKER_HEIGHT && top + y < height; y++) {
+            for (int x = 0; x < CELL_MARKER_WIDTH && left + x < width; x++) {
+                cellMarker(x, y, IMAGE_PIXEL(thumbnail, left + x, top + y));
+            }
+        }
+    }
+    return BMP_OK;
+}
+
+/**
+ * \brief Writes a BMP file with a marker drawn at each cell, see pipeline_mark().
+ *
+ * \param file The opened input file.
+ * \param cells The cells to mark, in the order they were detected.
+ * \param count Number of cells.
+ * \param output_path Path of the file to write.
+ * \return BMP_OK, or the reason the file could not be written.
+ */
+bmp_status pipeline_save(const bmp_file *file, const cell *cells, int count, const char *output_path) {
+    bmp_patches marks;
+    bmp_patches_init(&marks);
+    bmp_status status = pipeline_mark(file, cells, count, &marks);
+    if (status == BMP_OK) {
+        status = bmp_write_patched(file, &marks, output_path);
+    }
+    bmp_patches_free(&marks);
+    return status;
+}
+
+// Prints -1, the value of counters that were not measured, as null
+static void _print_count(const char *name, long value) {
+    if (value < 0) {
+        printf("\"%s\": null, ", name);
+    } else {
+        printf("\"%s\": %ld, ", name, value);
+    }
+}
+
+/**
+ * \brief Prints the counters and stage times of the last image as one JSON object.
+ *
+ * Hardware events are printed per stage when p->perf was set, and null
+ * for events the system could not count.
+ *
+ * \param p The pipeline that processed the image.
+ * \param input_path Path of the image, printed as given.
+ * \param threads Number of threads the stages ran on.
+ */
+void pipeline_print_stats(const pipeline *p, const char *input_path, int threads) {
+    static const char *const modes[] = {"erosion", "distance", "components"};
+    const pipeline_stats *stats = &p->stats;
+    printf("{\"input\": \"");
+    for (const char *c = input_path; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if ((unsigned char) *c < 0x20) {
+            printf("\\u%04x", (unsigned char) *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    printf("\", \"mode\": \"%s\", \"threads\": %d, ", modes[p->mode], threads);
+    printf("\"width\": %d, \"height\": %d, ", p->mask.width - WORK_PAD, p->mask.height - WORK_PAD);
+    _print_count("threshold", stats->threshold);
+    _print_count("white", stats->white);
+    _print_count("components", stats->components);
+    _print_count("early_cells", stats->early);
+    printf("\"cells\": %d, \"iterations\": %d, \"steps\": [", p->cells.count, stats->count);
+    for (int i = 0; i < stats->count; i++) {
+        const pipeline_iteration *iteration = &stats->iterations[i];
+        printf("%s{\"eroded\": %ld, \"candidates\": %ld, \"cells\": %d, \"white\": %ld}", i == 0 ? "" : ", ",
+               iteration->eroded, iteration->candidates, iteration->cells, iteration->white);
+    }
+    printf("], \"stages\": {");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        printf("%s\"%s\": {\"ms\": %.4f", stage == 0 ? "" : ", ", stage_names[stage], p->seconds[stage] * 1e3);
+        for (int e = 0; p->perf != NULL && e < PERF_EVENTS; e++) {
+            if (perf_available(p->perf, (perf_event) e)) {
+                printf(", \"%s\": %llu", perf_event_name((perf_event) e), (unsigned long long) p->counts[stage][e]);
+            } else {
+                printf(", \"%s\": null", perf_event_name((perf_event) e));
+            }
+        }
+        printf("}");
+    }
+    printf("}}\n");
+}
+
+void pipeline_free(pipeline *p) {
+    image_free(&p->temp);
+    image_free(&p->blur);
+    image_free(&p->distance);
+    component_table_free(&p->components);
+    bitimage_free(&p->mask);
+    erosion_free(&p->erosion);
+    cell_list_free(&p->cells);
+    bmp_patches_free(&p->marks);
+    image_free(&p->thumbnail);
+    threshold_map_free(&p->thresholds);
+    free(p->stats.iterations);
+    p->stats.iterations = NULL;
+    p->stats.capacity = 0;
+}
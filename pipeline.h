@@ -0,0 +1,95 @@
+#ifndef PIPELINE_PIPELINE_H
+#define PIPELINE_PIPELINE_H
+
+#include "cbmp.h"
+#include "image.h"
+#include "bitimage.h"
+#include "cells.h"
+#include "erosion.h"
+#include "pool.h"
+#include "detect.h"
+#include "components.h"
+#include "perf.h"
+#include "threshold.h"
+
+// Largest factor pipeline_thumbnail() shrinks by, so the sum of a block fits 32 bits
+#define THUMBNAIL_SCALE_MAX 256
+
+// Stages of one image, timed on a monotonic clock into pipeline.seconds
+typedef enum pipeline_stage {
+    STAGE_READ,             // opening the BMP file
+    STAGE_FRONT_END,        // greyscale, gaussian filter and histogram, fused
+    STAGE_THRESHOLD,        // the global or adapted threshold applied, packing the mask
+    STAGE_COMPONENTS,       // labelling, and the isolated components of the erosion mode
+    STAGE_DETECT,           // every erosion step with the detectCell pass fused into it, or the distance mode
+    STAGE_DRAW,             // painting the markers into patches of the file
+    STAGE_WRITE,            // writing the file with its patches
+    STAGE_COUNT
+} pipeline_stage;
+
+// What one erosion step and the detection after it did
+typedef struct pipeline_iteration {
+    long eroded;            // white pixels the erosion step turned black
+    long candidates;        // positions detectCell tested, with a white pixel in the capture area
+    int cells;              // cells registered
+    long white;             // white pixels left once their capture areas were cleared
+} pipeline_iteration;
+
+// Counters of the last image, -1 where the detection mode does not measure them
+typedef struct pipeline_stats {
+    int threshold;          // Otsu threshold
+    long white;             // white pixels of the mask
+    int components;
+    int early;              // cells of isolated components, found before the erosion loop
+    pipeline_iteration *iterations; // one per erosion step that left white pixels
+    int count;
+    int capacity;
+} pipeline_stats;
+
+/**
+ * \brief Working buffers for detecting the cells of one image at a time.
+ *
+ * Buffers are kept between images and only reallocated when the size
+ * changes, so a worker can run many images through the same pipeline.
+ */
+typedef struct pipeline {
+    image temp;             // grey working image of pipeline_detect(), WORK_PAD larger than the input
+    image blur;             // blurred grey image
+    image distance;         // distance transform of the mask, DETECT_DISTANCE only
+    bitimage mask;
+    erosion_state erosion;
+    cell_list cells;        // cells of the last image processed
+    component_table components; // components of its mask, before any erosion
+    bmp_patches marks;      // markers of the last image written
+    image thumbnail;        // RGB thumbnail of the last image written, if thumbnail_scale is above 1
+    int thumbnail_scale;    // factor the marked image is shrunk by, 0 or 1 to mark a full-size copy of the input
+    detect_mode mode;       // DETECT_EROSION unless set after pipeline_init()
+    threshold_mode threshold_mode; // THRESHOLD_GLOBAL unless set after pipeline_init()
+    threshold_map thresholds;
+    int fixed_threshold;    // used instead of the Otsu threshold of each image, or -1 as after pipeline_init()
+    double fixed_mean;      // used instead of the mean grey level of each image along with fixed_threshold
+    const threshold_map *fixed_map; // THRESHOLD_TILES map built for the image each one is a view of, or NULL
+    int raw_width;          // size of the headerless 8-bit frames pipeline_open() reads, or 0 for BMP and PGM files
+    int raw_height;
+    double seconds[STAGE_COUNT]; // time per stage of the last image, 0 for stages not run
+    pipeline_stats stats;
+    perf_counters *perf;    // hardware counters to read around every stage, or NULL
+    uint64_t counts[STAGE_COUNT][PERF_EVENTS]; // events per stage of the last image, if perf is set
+    double stage_begin;     // start of the stage being timed
+    uint64_t perf_begin[PERF_EVENTS];
+} pipeline;
+
+double pipeline_clock(void);
+const char *pipeline_stage_name(pipeline_stage stage);
+void pipeline_init(pipeline *p);
+bmp_status pipeline_open(const pipeline *p, const char *input_path, bmp_file *file);
+bmp_status pipeline_process(pipeline *p, const char *input_path, const char *output_path, worker_pool *pool);
+bmp_status pipeline_detect_file(pipeline *p, const bmp_file *file, worker_pool *pool);
+bmp_status pipeline_detect(pipeline *p, const image *input, worker_pool *pool);
+bmp_status pipeline_mark(const bmp_file *file, const cell *cells, int count, bmp_patches *marks);
+bmp_status pipeline_thumbnail(const bmp_file *file, const cell *cells, int count, int scale, image *thumbnail);
+bmp_status pipeline_save(const bmp_file *file, const cell *cells, int count, const char *output_path);
+void pipeline_print_stats(const pipeline *p, const char *input_path, int threads);
+void pipeline_free(pipeline *p);
+
+#endif // PIPELINE_PIPELINE_H
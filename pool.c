@@ -0,0 +1,222 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+static void *_worker(void *data) {
+    worker_pool *pool = (worker_pool *) data;
+    unsigned long seen = 0;
+    int index;
+
+    pthread_mutex_lock(&pool->lock);
+    // Workers are numbered in the order they start, after the caller's 0
+    index = pool->running++ + 1;
+    pthread_cond_signal(&pool->done);
+    for (;;) {
+        while (pool->generation == seen && !pool->stopping) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        seen = pool->generation;
+        pool_task task = pool->task;
+        void *arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        task(arg, index, pool->threads);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * \brief Starts threads - 1 worker threads.
+ *
+ * \param pool The pool to initialise.
+ * \param threads Number of threads running every task, the caller included.
+ * \return 0 on success, -1 if the threads could not be started.
+ */
+int pool_init(worker_pool *pool, int threads) {
+    memset(pool, 0, sizeof(*pool));
+    pool->threads = threads < 1 ? 1 : threads;
+    pool->progress = (int *) calloc((size_t) pool->threads, sizeof(int));
+    pool->workers = (pthread_t *) calloc((size_t) pool->threads, sizeof(pthread_t));
+    if (pool->progress == NULL || pool->workers == NULL) {
+        free(pool->progress);
+        free(pool->workers);
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+
+    int started = 0;
+    for (; started < pool->threads - 1; started++) {
+        if (pthread_create(&pool->workers[started], NULL, _worker, pool) != 0) {
+            break;
+        }
+    }
+    // Wait until every worker has taken its index
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running < started) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pool->running = 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (started < pool->threads - 1) {
+        pool->threads = started + 1;
+        pool_free(pool);
+        return -1;
+    }
+    return 0;
+}
+
+void pool_free(worker_pool *pool) {
+    if (pool->progress == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threads - 1; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->changed);
+    free(pool->workers);
+    free(pool->progress);
+    memset(pool, 0, sizeof(*pool));
+}
+
+int pool_threads(const worker_pool *pool) {
+    return pool == NULL ? 1 : pool->threads;
+}
+
+/**
+ * \brief Number of processors online, at least 1.
+ */
+int pool_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+#endif
+}
+
+/**
+ * \brief Runs task on every thread of the pool and waits for all of them.
+ *
+ * Progress counters start at 0 for every task.
+ */
+void pool_run(worker_pool *pool, pool_task task, void *arg) {
+    if (pool == NULL || pool->threads == 1) {
+        if (pool != NULL) {
+            pool->progress[0] = 0;
+        }
+        task(arg, 0, 1);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    memset(pool->progress, 0, (size_t) pool->threads * sizeof(int));
+    pool->task = task;
+    pool->arg = arg;
+    pool->running = pool->threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    task(arg, 0, pool->threads);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * \brief Waits until every thread of the pool has reached the barrier.
+ *
+ * Must be called by all threads of a task the same number of times.
+ */
+void pool_barrier(worker_pool *pool) {
+    if (pool == NULL || pool->threads == 1) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    unsigned long generation = pool->barrier_generation;
+    if (++pool->barrier_waiting == pool->threads) {
+        pool->barrier_waiting = 0;
+        pool->barrier_generation++;
+        pthread_cond_broadcast(&pool->changed);
+    } else {
+        while (generation == pool->barrier_generation) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * \brief Sets the progress counter of a thread and wakes up its waiters.
+ */
+void pool_publish(worker_pool *pool, int index, int value) {
+    if (pool == NULL || pool->threads == 1) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->progress[index] = value;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * \brief Waits until the progress counter of a thread is at least value.
+ *
+ * Everything the thread wrote before publishing that value is visible
+ * afterwards.
+ */
+void pool_wait(worker_pool *pool, int index, int value) {
+    if (pool == NULL || pool->threads == 1) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (pool->progress[index] < value) {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * \brief Splits rows [first, end) into count bands of near-equal height.
+ *
+ * \param first First row to split.
+ * \param end Row past the last one to split.
+ * \param index The band to compute.
+ * \param count Number of bands.
+ * \param band_first Receives the first row of the band.
+ * \param band_end Receives the row past the end of the band.
+ */
+void pool_band(int first, int end, int index, int count, int *band_first, int *band_end) {
+    long rows = end > first ? end - first : 0;
+    *band_first = first + (int) (rows * index / count);
+    *band_end = first + (int) (rows * (index + 1) / count);
+}
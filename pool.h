@@ -0,0 +1,52 @@
+#ifndef POOL_POOL_H
+#define POOL_POOL_H
+
+#include <pthread.h>
+
+/**
+ * \brief Task run by every thread of a pool.
+ *
+ * \param arg The argument given to pool_run().
+ * \param index Index of the calling thread, 0 <= index < count.
+ * \param count Number of threads running the task.
+ */
+typedef void (*pool_task)(void *arg, int index, int count);
+
+/**
+ * \brief Fixed set of worker threads that run one task at a time.
+ *
+ * The thread calling pool_run() takes part as index 0. Besides a barrier,
+ * every thread has a progress counter, so bands can run as a wavefront
+ * where each waits for its neighbours to get far enough.
+ *
+ * All pool functions accept NULL, which means running serially on the
+ * calling thread.
+ */
+typedef struct worker_pool {
+    int threads;
+    pthread_t *workers;         // threads - 1 workers, the caller is index 0
+    pthread_mutex_t lock;
+    pthread_cond_t start;       // a new task was posted, or the pool stops
+    pthread_cond_t done;        // the last worker finished the task
+    pthread_cond_t changed;     // the barrier opened or a progress counter moved
+    pool_task task;
+    void *arg;
+    unsigned long generation;   // number of tasks posted so far
+    int running;                // workers still inside the current task
+    int stopping;
+    int barrier_waiting;
+    unsigned long barrier_generation;
+    int *progress;
+} worker_pool;
+
+int pool_init(worker_pool *pool, int threads);
+void pool_free(worker_pool *pool);
+int pool_threads(const worker_pool *pool);
+int pool_cpu_count(void);
+void pool_run(worker_pool *pool, pool_task task, void *arg);
+void pool_barrier(worker_pool *pool);
+void pool_publish(worker_pool *pool, int index, int value);
+void pool_wait(worker_pool *pool, int index, int value);
+void pool_band(int first, int end, int index, int count, int *band_first, int *band_end);
+
+#endif // POOL_POOL_H
@@ -0,0 +1,419 @@
+#include "serve.h"
+#include "celldetect.h"
+#include "pipeline.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+int serve_run(const char *socket_path, const serve_options *options) {
+    (void) socket_path;
+    (void) options;
+    fprintf(stderr, "Server mode needs Unix domain sockets.\n");
+    return 1;
+}
+
+#else
+
+// Set by SIGINT and SIGTERM, which interrupt accept() and recv() instead of restarting them
+static volatile sig_atomic_t serve_stop = 0;
+
+// Growable reply, left failed instead of exiting when memory runs out
+typedef struct serve_text {
+    char *data;
+    size_t length;
+    size_t size;
+    int failed;
+} serve_text;
+
+// What one request line asks for
+typedef struct serve_request {
+    detect_mode mode;
+    threshold_mode threshold;
+    int json;               // reply as one JSON object instead of "ok count ms x:y ..."
+    const char *path;       // BMP file, or NULL for a shared memory frame
+    celldetect_frame frame; // its pixels are mapped once the request is parsed
+    char name[256];         // shared memory object of the frame
+} serve_request;
+
+static void _on_signal(int signal) {
+    (void) signal;
+    serve_stop = 1;
+}
+
+static void _append(serve_text *text, const char *format, ...) {
+    while (!text->failed) {
+        va_list args;
+        va_start(args, format);
+        int needed = vsnprintf(text->data + text->length, text->size - text->length, format, args);
+        va_end(args);
+        if (needed < 0) {
+            text->failed = 1;
+            return;
+        }
+        if (text->length + (size_t) needed < text->size) {
+            text->length += (size_t) needed;
+            return;
+        }
+        size_t size = text->size == 0 ? 4096 : text->size;
+        while (size <= text->length + (size_t) needed) {
+            size *= 2;
+        }
+        char *data = (char *) realloc(text->data, size);
+        if (data == NULL) {
+            text->failed = 1;
+            return;
+        }
+        text->data = data;
+        text->size = size;
+    }
+}
+
+// Sends all of a reply, a client that went away only ends its own connection
+static int _send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR && !serve_stop) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        length -= (size_t) sent;
+    }
+    return 0;
+}
+
+static int _parse_int(const char *word, int *value) {
+    char *end;
+    long parsed = strtol(word, &end, 10);
+    if (end == word || *end != '\0' || parsed < 0 || parsed > 1L << 30) {
+        return -1;
+    }
+    *value = (int) parsed;
+    return 0;
+}
+
+/**
+ * \brief Parses one request line, in place.
+ *
+ *     detect [--detect erosion|distance|components] [--threshold global|tiles|local] [--format csv|json] <path>
+ *     frame [options] <shared memory name> <width> <height> <stride> <channels>
+ *
+ * The path is the rest of the line after the options, so it may hold spaces.
+ *
+ * \return 0, or -1 if the line is not a request.
+ */
+static int _parse(char *line, serve_request *request) {
+    char *save;
+    char *word = strtok_r(line, " ", &save);
+    int frame = word != NULL && strcmp(word, "frame") == 0;
+    if (word == NULL || (!frame && strcmp(word, "detect") != 0)) {
+        return -1;
+    }
+    char *rest = strtok_r(NULL, "", &save);
+    while (rest != NULL && strncmp(rest, "--", 2) == 0) {
+        char *option = strtok_r(rest, " ", &save);
+        char *value = strtok_r(NULL, " ", &save);
+        rest = strtok_r(NULL, "", &save);
+        if (value == NULL) {
+            return -1;
+        }
+        if (strcmp(option, "--detect") == 0 && strcmp(value, "erosion") == 0) {
+            request->mode = DETECT_EROSION;
+        } else if (strcmp(option, "--detect") == 0 && strcmp(value, "distance") == 0) {
+            request->mode = DETECT_DISTANCE;
+        } else if (strcmp(option, "--detect") == 0 && strcmp(value, "components") == 0) {
+            request->mode = DETECT_COMPONENTS;
+        } else if (strcmp(option, "--threshold") == 0 && strcmp(value, "global") == 0) {
+            request->threshold = THRESHOLD_GLOBAL;
+        } else if (strcmp(option, "--threshold") == 0 && strcmp(value, "tiles") == 0) {
+            request->threshold = THRESHOLD_TILES;
+        } else if (strcmp(option, "--threshold") == 0 && strcmp(value, "local") == 0) {
+            request->threshold = THRESHOLD_LOCAL;
+        } else if (strcmp(option, "--format") == 0 && (strcmp(value, "csv") == 0 || strcmp(value, "json") == 0)) {
+            request->json = strcmp(value, "json") == 0;
+        } else {
+            return -1;
+        }
+    }
+    if (rest == NULL || *rest == '\0') {
+        return -1;
+    }
+    if (!frame) {
+        request->path = rest;
+        return 0;
+    }
+    char *name = strtok_r(rest, " ", &save);
+    char *numbers[4];
+    for (int i = 0; i < 4; i++) {
+        numbers[i] = strtok_r(NULL, " ", &save);
+    }
+    int stride;
+    if (numbers[3] == NULL || strtok_r(NULL, " ", &save) != NULL || strlen(name) >= sizeof(request->name) ||
+        _parse_int(numbers[0], &request->frame.width) != 0 || _parse_int(numbers[1], &request->frame.height) != 0 ||
+        _parse_int(numbers[2], &stride) != 0 || _parse_int(numbers[3], &request->frame.channels) != 0) {
+        return -1;
+    }
+    request->frame.stride = (size_t) stride;
+    strcpy(request->name, name);
+    return 0;
+}
+
+/**
+ * \brief Maps a frame of shared memory read-only, after checking that the whole frame is inside it.
+ *
+ * \return CELLDETECT_OK with the frame and its mapping set, or the reason it could not be mapped.
+ */
+static celldetect_status _map_frame(serve_request *request, void **map, size_t *size) {
+    celldetect_frame *frame = &request->frame;
+    if (frame->width < 1 || frame->height < 1 || (frame->channels != 1 && frame->channels != 3 && frame->channels != 4) ||
+        frame->stride < (size_t) frame->width * (size_t) frame->channels) {
+        return CELLDETECT_ERR_ARGUMENT;
+    }
+    int fd = shm_open(request->name, O_RDONLY, 0);
+    if (fd < 0) {
+        return CELLDETECT_ERR_OPEN;
+    }
+    struct stat st;
+    size_t needed = frame->stride * (size_t) (frame->height - 1) + (size_t) frame->width * (size_t) frame->channels;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < needed) {
+        close(fd);
+        return CELLDETECT_ERR_ARGUMENT;
+    }
+    *map = mmap(NULL, needed, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (*map == MAP_FAILED) {
+        return CELLDETECT_ERR_OPEN;
+    }
+    *size = needed;
+    frame->pixels = (const unsigned char *) *map;
+    return CELLDETECT_OK;
+}
+
+/**
+ * \brief Runs one request line on the warm context and writes the reply line.
+ *
+ *     ok <count> <milliseconds> x:y x:y ...
+ *     error <message>
+ *
+ * or {"count": ..., "ms": ..., "cells": [[x, y], ...]} and {"error": ...} with --format json.
+ */
+static void _handle(celldetect_context *ctx, const serve_options *options, char *line, serve_text *reply) {
+    serve_request request;
+    memset(&request, 0, sizeof(request));
+    request.mode = options->mode;
+    request.threshold = options->threshold;
+    const cell *cells = NULL;
+    int count = 0;
+    double begin = pipeline_clock();
+    celldetect_status status = CELLDETECT_ERR_ARGUMENT;
+    if (_parse(line, &request) == 0) {
+        ctx->work.mode = request.mode;
+        ctx->work.threshold_mode = request.threshold;
+        if (request.path != NULL) {
+            status = celldetect_detect_file(ctx, request.path, &cells, &count);
+        } else {
+            void *map;
+            size_t size;
+            status = _map_frame(&request, &map, &size);
+            if (status == CELLDETECT_OK) {
+                status = celldetect_detect(ctx, &request.frame, &cells, &count);
+                munmap(map, size);
+            }
+        }
+    }
+    double ms = (pipeline_clock() - begin) * 1000.0;
+
+    if (status != CELLDETECT_OK) {
+        _append(reply, request.json ? "{\"error\": \"%s\"}\n" : "error %s\n", celldetect_strerror(status));
+    } else if (request.json) {
+        _append(reply, "{\"count\": %d, \"ms\": %.3f, \"cells\": [", count, ms);
+        for (int i = 0; i < count; i++) {
+            _append(reply, "%s[%d, %d]", i == 0 ? "" : ", ", cells[i].x, cells[i].y);
+        }
+        _append(reply, "]}\n");
+    } else {
+        _append(reply, "ok %d %.3f", count, ms);
+        for (int i = 0; i < count; i++) {
+            _append(reply, " %d:%d", cells[i].x, cells[i].y);
+        }
+        _append(reply, "\n");
+    }
+}
+
+/**
+ * \brief Answers the request lines of one client until it hangs up.
+ *
+ * \return 1 if the client asked the server to shut down, 0 otherwise.
+ */
+static int _serve_client(int fd, celldetect_context *ctx, const serve_options *options) {
+    char line[SERVE_LINE_MAX + 1];
+    size_t length = 0;
+    serve_text reply = {NULL, 0, 0, 0};
+    int finished = 0;
+    while (!serve_stop && !finished) {
+        ssize_t got = recv(fd, line + length, SERVE_LINE_MAX - length, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        length += (size_t) got;
+        // Every complete line is a request, the rest waits for more bytes
+        char *start = line;
+        char *end;
+        while (!finished && (end = memchr(start, '\n', length - (size_t) (start - line))) != NULL) {
+            *end = '\0';
+            if (end > start && end[-1] == '\r') {
+                end[-1] = '\0';
+            }
+            reply.length = 0;
+            reply.failed = 0;
+            if (strcmp(start, "ping") == 0) {
+                _append(&reply, "ok\n");
+            } else if (strcmp(start, "shutdown") == 0) {
+                _append(&reply, "ok\n");
+                finished = 1;
+            } else {
+                _handle(ctx, options, start, &reply);
+            }
+            if (reply.failed) {
+                reply.length = 0;
+                reply.failed = 0;
+                _append(&reply, "error %s\n", celldetect_strerror(CELLDETECT_ERR_NOMEM));
+            }
+            if (reply.failed || _send_all(fd, reply.data, reply.length) != 0) {
+                free(reply.data);
+                return finished;
+            }
+            start = end + 1;
+        }
+        length -= (size_t) (start - line);
+        memmove(line, start, length);
+        if (length == SERVE_LINE_MAX) {
+            const char *error = "error Request line too long\n";
+            _send_all(fd, error, strlen(error));
+            break;
+        }
+    }
+    free(reply.data);
+    return finished;
+}
+
+/**
+ * \brief Detects the cells of one blank frame, so every buffer is allocated and touched before the first request.
+ */
+static celldetect_status _warm(celldetect_context *ctx, int width, int height) {
+    celldetect_frame frame = {NULL, width, height, (size_t) width * 3, 3};
+    unsigned char *pixels = (unsigned char *) calloc(frame.stride * (size_t) height, 1);
+    if (pixels == NULL) {
+        return CELLDETECT_ERR_NOMEM;
+    }
+    frame.pixels = pixels;
+    celldetect_status status = celldetect_detect(ctx, &frame, NULL, NULL);
+    free(pixels);
+    return status;
+}
+
+/**
+ * \brief Serves detection requests on a Unix domain socket until asked to shut down.
+ *
+ * One context is kept for the life of the server, so its threads are
+ * started once and its buffers are only reallocated when a larger image
+ * comes: a request costs the detection itself, not the start of a
+ * process. Clients are served one at a time, each for as many request
+ * lines as it sends (see _parse() and _handle()); "ping" answers "ok" and
+ * "shutdown" stops the server, as do SIGINT and SIGTERM.
+ *
+ * \param socket_path Where to bind the socket, a socket left there by an earlier server is replaced.
+ * \param options Threads, default modes and the size to warm the buffers up for.
+ * \return 0 once shut down, 1 if the server could not start.
+ */
+int serve_run(const char *socket_path, const serve_options *options) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    celldetect_options detect;
+    celldetect_options_init(&detect);
+    detect.threads = options->threads;
+    detect.mode = options->mode;
+    detect.threshold = options->threshold;
+    celldetect_context ctx;
+    celldetect_status status = celldetect_init(&ctx, &detect);
+    if (status != CELLDETECT_OK) {
+        fprintf(stderr, "%s\n", celldetect_strerror(status));
+        return 1;
+    }
+    if (options->warm_width > 0 && options->warm_height > 0) {
+        status = _warm(&ctx, options->warm_width, options->warm_height);
+        if (status != CELLDETECT_OK) {
+            fprintf(stderr, "%s\n", celldetect_strerror(status));
+            celldetect_free(&ctx);
+            return 1;
+        }
+    }
+
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || bind(server, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(server, 8) != 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        if (server >= 0) {
+            close(server);
+        }
+        celldetect_free(&ctx);
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    fprintf(stderr, "Serving on %s with %d threads\n", socket_path, pool_threads(&ctx.pool));
+
+    int finished = 0;
+    while (!serve_stop && !finished) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            break;
+        }
+        finished = _serve_client(client, &ctx, options);
+        close(client);
+    }
+
+    close(server);
+    unlink(socket_path);
+    celldetect_free(&ctx);
+    return 0;
+}
+
+#endif
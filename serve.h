@@ -0,0 +1,20 @@
+#ifndef SERVE_SERVE_H
+#define SERVE_SERVE_H
+
+#include "detect.h"
+#include "threshold.h"
+
+// Longest request line, a path or a shared memory name with its options
+#define SERVE_LINE_MAX 4096
+
+typedef struct serve_options {
+    int threads;                // threads each image is split across
+    detect_mode mode;           // unless a request asks for another
+    threshold_mode threshold;   // unless a request asks for another
+    int warm_width;             // size the buffers are allocated and touched for before serving, or 0
+    int warm_height;
+} serve_options;
+
+int serve_run(const char *socket_path, const serve_options *options);
+
+#endif // SERVE_SERVE_H
@@ -0,0 +1,568 @@
+#include "threshold.h"
+#include "minmax.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Build with -DTHRESHOLD_SCALAR to force the portable row kernels
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(THRESHOLD_SCALAR)
+#define THRESHOLD_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Arguments shared by the threads of threshold_map_count()
+typedef struct count_job {
+    threshold_map *map;
+    const image *blur;
+    int failed;
+} count_job;
+
+const char *threshold_mode_name(threshold_mode mode) {
+    switch (mode) {
+        case THRESHOLD_TILES:
+            return "tiles";
+        case THRESHOLD_LOCAL:
+            return "local";
+        default:
+            return "global";
+    }
+}
+
+/**
+ * \brief Lays the tiles over the counted area of a working image.
+ *
+ * \param map The map, zeroed before its first use.
+ * \param width Width of the working image.
+ * \param height Height of the working image.
+ * \return 0 on success, -1 if memory ran out.
+ */
+int threshold_map_fit(threshold_map *map, int width, int height) {
+    map->columns = (max(width - 2 * WORK_PAD, 1) + THRESHOLD_TILE - 1) / THRESHOLD_TILE;
+    map->rows = (max(height - 2 * WORK_PAD, 1) + THRESHOLD_TILE - 1) / THRESHOLD_TILE;
+    map->left = 0;
+    map->top = 0;
+    int tiles = map->columns * map->rows;
+    if (tiles > map->capacity) {
+        free(map->summaries);
+        free(map->tiles);
+        map->summaries = (threshold_tile *) malloc((size_t) tiles * sizeof(threshold_tile));
+        map->tiles = (unsigned char *) malloc((size_t) tiles);
+        if (map->summaries == NULL || map->tiles == NULL) {
+            threshold_map_free(map);
+            return -1;
+        }
+        map->capacity = tiles;
+    }
+    return 0;
+}
+
+/**
+ * \brief Band of rows of a working image for one thread, made of whole rows of tiles.
+ *
+ * A thread that counts the rows of its band owns the histograms of their
+ * tiles, so no two threads ever add to the same tile. The first band also
+ * takes the rows above the counted area and the last one those below it.
+ */
+void threshold_band(const threshold_map *map, int height, int index, int count, int *first, int *end) {
+    int top, bottom;
+    pool_band(0, map->rows, index, count, &top, &bottom);
+    *first = top == 0 ? 0 : 2 + top * THRESHOLD_TILE;
+    *end = bottom == map->rows ? height : 2 + bottom * THRESHOLD_TILE;
+}
+
+/**
+ * \brief Adds the counted pixels of a row to the banks of the tiles it crosses.
+ *
+ * \param map The map, laid over the image by threshold_map_fit().
+ * \param row A row of the counted area of the working image.
+ * \param width Width of the working image.
+ * \param banks Banks of each tile of the current row of tiles, as in otsu_histogram_span().
+ */
+void threshold_count_row(const threshold_map *map, const unsigned char *row, int width, threshold_banks *banks) {
+    int end = width - WORK_PAD;
+    for (int c = 0; c < map->columns; c++) {
+        unsigned short (*tile)[256] = banks[c];
+        int x = 2 + c * THRESHOLD_TILE;
+        int last = min(x + THRESHOLD_TILE, end);
+        for (; x + OTSU_BANKS <= last; x += OTSU_BANKS) {
+            tile[0][row[x]]++;
+            tile[1][row[x + 1]]++;
+            tile[2][row[x + 2]]++;
+            tile[3][row[x + 3]]++;
+        }
+        for (; x < last; x++) {
+            tile[0][row[x]]++;
+        }
+    }
+}
+
+// Sums up the histogram of a tile, see _tile_threshold()
+static void _summarize(const int histogram[256], threshold_tile *tile) {
+    int count = 0;
+    long long sum = 0;
+    for (int i = 0; i < 256; i++) {
+        count += histogram[i];
+        sum += (long long) i * histogram[i];
+    }
+    memset(tile, 0, sizeof(*tile));
+    if (count == 0) {
+        tile->otsu = -1;
+        return;
+    }
+    tile->otsu = otsu_from_histogram(histogram, count);
+    tile->mean = (double) sum / count;
+    int below = 0;
+    long long below_sum = 0;
+    for (int i = 0; i <= tile->otsu; i++) {
+        below += histogram[i];
+        below_sum += (long long) i * histogram[i];
+    }
+    tile->split = below > 0 && below < count;
+    if (tile->split) {
+        tile->separation = (double) (sum - below_sum) / (count - below) - (double) below_sum / below;
+    }
+}
+
+/**
+ * \brief Sums up a row of tiles once all its rows are counted, and adds their histograms to one of the image.
+ *
+ * Every row of tiles is counted by one thread and flushed once. The banks
+ * are left zeroed for the next row of tiles.
+ */
+void threshold_flush_row(threshold_map *map, int tile_row, threshold_banks *banks, int histogram[256]) {
+    for (int c = 0; c < map->columns; c++) {
+        int tile[256];
+        for (int i = 0; i < 256; i++) {
+            tile[i] = banks[c][0][i] + banks[c][1][i] + banks[c][2][i] + banks[c][3][i];
+            histogram[i] += tile[i];
+        }
+        _summarize(tile, &map->summaries[tile_row * map->columns + c]);
+    }
+    memset(banks, 0, (size_t) map->columns * sizeof(*banks));
+}
+
+static void _count_task(void *arg, int index, int count) {
+    count_job *job = (count_job *) arg;
+    threshold_map *map = job->map;
+    const image *blur = job->blur;
+    threshold_banks *banks = (threshold_banks *) calloc((size_t) map->columns, sizeof(*banks));
+    if (banks == NULL) {
+        job->failed = 1;
+        return;
+    }
+    int histogram[256] = {0};
+    int top, bottom;
+    pool_band(0, map->rows, index, count, &top, &bottom);
+    for (int r = top; r < bottom; r++) {
+        int y0 = 2 + r * THRESHOLD_TILE;
+        int y1 = min(y0 + THRESHOLD_TILE, blur->height - WORK_PAD);
+        for (int y = y0; y < y1; y++) {
+            threshold_count_row(map, &IMAGE_AT(blur, 0, y), blur->width, banks);
+        }
+        threshold_flush_row(map, r, banks, histogram);
+    }
+    free(banks);
+}
+
+/**
+ * \brief Counts the tile histograms of a blurred image that is already in memory.
+ *
+ * Images read from a file have theirs counted by parallel_front_end()
+ * instead, while they are blurred.
+ *
+ * \param map The map, laid over the image by threshold_map_fit().
+ * \param blur The blurred working image.
+ * \param pool Threads to split the rows of tiles across, or NULL to run serially.
+ * \return 0 on success, -1 if memory ran out.
+ */
+int threshold_map_count(threshold_map *map, const image *blur, worker_pool *pool) {
+    count_job job = {map, blur, 0};
+    pool_run(pool, _count_task, &job);
+    return job.failed ? -1 : 0;
+}
+
+static unsigned char _clamp_grey(double value) {
+    return (unsigned char) (value < 0 ? 0 : value > 255 ? 255 : floor(value + 0.5));
+}
+
+/**
+ * \brief Threshold of one tile from the summary of its histogram.
+ *
+ * The tile's own Otsu threshold is used when its two classes lie further
+ * apart than the global threshold lies above the global mean, that is
+ * when the tile holds cells as well as background. A tile of background
+ * alone would split its noise in two, so it gets its mean shifted the
+ * way the global threshold is instead.
+ */
+static unsigned char _tile_threshold(const threshold_map *map, const threshold_tile *tile) {
+    if (tile->otsu < 0) {
+        return (unsigned char) map->global;
+    }
+    if (tile->split && tile->separation > map->offset) {
+        return (unsigned char) tile->otsu;
+    }
+    return _clamp_grey(tile->mean + map->offset);
+}
+
+/**
+ * \brief Prepares the thresholds of a blurred image.
+ *
+ * THRESHOLD_TILES takes the threshold of every tile from its histogram,
+ * counted and summed up beforehand. THRESHOLD_LOCAL needs nothing beyond the offset,
+ * its window sums are taken while thresholding.
+ *
+ * \param map The map, with its tile histograms counted for THRESHOLD_TILES.
+ * \param mode How the thresholds vary over the image.
+ * \param global The Otsu threshold of the whole image.
+ * \param mean The mean grey level of the counted pixels of the whole image.
+ */
+void threshold_map_build(threshold_map *map, threshold_mode mode, int global, double mean) {
+    map->mode = mode;
+    map->global = global;
+    map->offset = (int) floor(global - mean + 0.5);
+    if (mode == THRESHOLD_TILES) {
+        for (int t = 0; t < map->columns * map->rows; t++) {
+            map->tiles[t] = _tile_threshold(map, &map->summaries[t]);
+        }
+    }
+}
+
+/*
+ * The row kernels below work 64 pixels, one mask word, at a time on
+ * scratch rows padded to whole words, so no loop needs a scalar tail.
+ * The scalar primitives define the result, the SSE2 ones reproduce it.
+ */
+
+// Copies the counted pixels of row y into a scratch row zeroed elsewhere
+static void _copy_row(const image *blur, int y, unsigned char *scratch) {
+    if (blur->width <= 2 * WORK_PAD) {
+        return;
+    }
+    memcpy(scratch + 2, &IMAGE_AT(blur, 2, y), (size_t) (blur->width - 2 * WORK_PAD));
+}
+
+// Adds a scratch row to the column sums of a whole word
+static void _add_word(unsigned int *restrict columns, const unsigned char *restrict grey) {
+    for (int i = 0; i < 64; i++) {
+        columns[i] += grey[i];
+    }
+}
+
+// Takes a scratch row off the column sums of a whole word
+static void _subtract_word(unsigned int *restrict columns, const unsigned char *restrict grey) {
+    for (int i = 0; i < 64; i++) {
+        columns[i] -= grey[i];
+    }
+}
+
+// Adds one scratch row to the column sums of a whole word and takes another off
+static void _slide_word(unsigned int *restrict columns, const unsigned char *restrict entering,
+                        const unsigned char *restrict leaving) {
+    for (int i = 0; i < 64; i++) {
+        columns[i] += entering[i] - leaving[i];
+    }
+}
+
+#ifndef THRESHOLD_SIMD
+// Gathers the low bit of each of 8 bytes into one byte, the first byte into bit 0
+#define GATHER_BITS 0x0102040810204080ULL
+
+// Mask word of 64 flags, each 0 or 1
+static uint64_t _pack_flags(const unsigned char flags[64]) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++) {
+        uint64_t eight;
+        memcpy(&eight, flags + 8 * i, sizeof(eight));
+        bits |= (eight * GATHER_BITS >> 56) << (8 * i);
+    }
+    return bits;
+}
+
+// Mask word with bit i set where grey[i] > limit[i]
+static uint64_t _greater_word(const unsigned char *grey, const unsigned char *limit) {
+    unsigned char flags[64];
+    for (int i = 0; i < 64; i++) {
+        flags[i] = grey[i] > limit[i];
+    }
+    return _pack_flags(flags);
+}
+
+// sums[x + 1] = columns[0] + ... + columns[x], for x in [0, span)
+static void _prefix_row(const unsigned int *columns, unsigned int *sums, int span) {
+    unsigned int total = 0;
+    for (int x = 0; x < span; x++) {
+        total += columns[x];
+        sums[x + 1] = total;
+    }
+}
+
+// Mask word with bit i set where (grey[i] - offset) * across[i] * rows > after[i] - before[i]
+static uint64_t _window_word(const unsigned char *grey, const short *across, const unsigned int *after,
+                             const unsigned int *before, int offset, int rows) {
+    unsigned char flags[64];
+    for (int i = 0; i < 64; i++) {
+        flags[i] = (grey[i] - offset) * across[i] * rows > (int) (after[i] - before[i]);
+    }
+    return _pack_flags(flags);
+}
+#else
+static uint64_t _greater_word(const unsigned char *grey, const unsigned char *limit) {
+    //SSE2 compares signed bytes, so both sides are shifted by 128
+    __m128i bias = _mm_set1_epi8((char) 0x80);
+    uint64_t bits = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i g = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (grey + 16 * i)), bias);
+        __m128i t = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (limit + 16 * i)), bias);
+        bits |= (uint64_t) (unsigned int) _mm_movemask_epi8(_mm_cmpgt_epi8(g, t)) << (16 * i);
+    }
+    return bits;
+}
+
+static void _prefix_row(const unsigned int *columns, unsigned int *sums, int span) {
+    __m128i carry = _mm_setzero_si128();
+    for (int x = 0; x < span; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (columns + x));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, carry);
+        _mm_storeu_si128((__m128i *) (sums + x + 1), v);
+        carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+}
+
+static uint64_t _window_word(const unsigned char *grey, const short *across, const unsigned int *after,
+                             const unsigned int *before, int offset, int rows) {
+    //grey - offset and across * rows both fit 16 bits, their product is put together from its two halves
+    __m128i zero = _mm_setzero_si128();
+    __m128i shift = _mm_set1_epi16((short) offset);
+    __m128i height = _mm_set1_epi16((short) rows);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 16) {
+        __m128i g = _mm_loadu_si128((const __m128i *) (grey + i));
+        __m128i greater[2];
+        for (int half = 0; half < 2; half++) {
+            int x = i + 8 * half;
+            __m128i value = _mm_sub_epi16(half ? _mm_unpackhi_epi8(g, zero) : _mm_unpacklo_epi8(g, zero), shift);
+            __m128i count = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (across + x)), height);
+            __m128i low = _mm_mullo_epi16(value, count);
+            __m128i high = _mm_mulhi_epi16(value, count);
+            __m128i sum0 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *) (after + x)),
+                                         _mm_loadu_si128((const __m128i *) (before + x)));
+            __m128i sum1 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *) (after + x + 4)),
+                                         _mm_loadu_si128((const __m128i *) (before + x + 4)));
+            greater[half] = _mm_packs_epi32(_mm_cmpgt_epi32(_mm_unpacklo_epi16(low, high), sum0),
+                                            _mm_cmpgt_epi32(_mm_unpackhi_epi16(low, high), sum1));
+        }
+        bits |= (uint64_t) (unsigned int) _mm_movemask_epi8(_mm_packs_epi16(greater[0], greater[1])) << i;
+    }
+    return bits;
+}
+#endif
+
+/**
+ * \brief Thresholds rows [first, end) against the tile thresholds, interpolated bilinearly.
+ *
+ * Between two tile centres the threshold changes by a constant step per
+ * pixel, so the row of thresholds is filled one span of THRESHOLD_TILE
+ * pixels at a time, and before the first centre or after the last one
+ * the nearest tile is used alone. Positions are those in the image the
+ * tiles were laid over, map->left and map->top away from the blurred one.
+ */
+static int _tile_rows(const image *blur, const threshold_map *map, bitimage *mask, int first, int end) {
+    int words = (mask->width + 63) / 64;
+    int span = words * 64;
+    int *blend = (int *) malloc((size_t) map->columns * sizeof(int));
+    unsigned char *grey = (unsigned char *) calloc((size_t) span, 1);
+    unsigned char *limit = (unsigned char *) malloc((size_t) span);
+    if (blend == NULL || grey == NULL || limit == NULL) {
+        free(blend);
+        free(grey);
+        free(limit);
+        return -1;
+    }
+    int centre = 2 + THRESHOLD_TILE / 2;
+    //Index in limit of the first tile centre and of the last one, either may lie outside it
+    int start = centre - map->left;
+    int last = start + (map->columns - 1) * THRESHOLD_TILE;
+    //Tile columns whose spans reach into the row
+    int lowest = min(max(map->left - centre, 0) >> THRESHOLD_TILE_SHIFT, map->columns - 1);
+    int highest = min((map->left + span - centre) / THRESHOLD_TILE + 1, map->columns - 1);
+    for (int y = first; y < end; y++) {
+        uint64_t *row = BITIMAGE_ROW(mask, y);
+        if (y < 2 || y >= blur->height - WORK_PAD) {
+            memset(row, 0, (size_t) words * sizeof(uint64_t));
+            continue;
+        }
+        //Blend the two tile rows around y, in 1/THRESHOLD_TILE steps
+        int offset = y + map->top - centre;
+        int r = offset < 0 ? 0 : offset >> THRESHOLD_TILE_SHIFT;
+        int fy = offset < 0 ? 0 : offset & (THRESHOLD_TILE - 1);
+        if (r >= map->rows - 1) {
+            r = map->rows - 1;
+            fy = 0;
+        }
+        const unsigned char *above = map->tiles + (size_t) r * map->columns;
+        const unsigned char *below = fy > 0 ? above + map->columns : above;
+        for (int c = lowest; c <= highest; c++) {
+            blend[c] = above[c] * (THRESHOLD_TILE - fy) + below[c] * fy;
+        }
+
+        //Then the two tile columns around x, rounding back to a grey level
+        int round = THRESHOLD_TILE * THRESHOLD_TILE / 2;
+        int before = (blend[lowest] * THRESHOLD_TILE + round) >> (2 * THRESHOLD_TILE_SHIFT);
+        memset(limit, before, (size_t) min(max(start, 0), span));
+        for (int c = lowest; c < highest; c++) {
+            int base = blend[c] * THRESHOLD_TILE + round;
+            int step = blend[c + 1] - blend[c];
+            int from = start + c * THRESHOLD_TILE;
+            for (int fx = max(-from, 0); fx < THRESHOLD_TILE && from + fx < span; fx++) {
+                limit[from + fx] = (unsigned char) ((base + step * fx) >> (2 * THRESHOLD_TILE_SHIFT));
+            }
+        }
+        int after = (blend[highest] * THRESHOLD_TILE + round) >> (2 * THRESHOLD_TILE_SHIFT);
+        int tail = min(max(last, 0), span);
+        memset(limit + tail, after, (size_t) (span - tail));
+
+        //Outside the counted pixels grey stays 0, never above a threshold
+        _copy_row(blur, y, grey);
+        for (int w = 0; w < words; w++) {
+            row[w] = _greater_word(grey + w * 64, limit + w * 64);
+        }
+    }
+    free(blend);
+    free(grey);
+    free(limit);
+    return 0;
+}
+
+/**
+ * \brief Thresholds rows [first, end) against the mean of the window around each pixel, plus the offset.
+ *
+ * The window is clipped to the counted area. Its sums come from a sliding
+ * integral image: per column, the sum of the window's rows, updated by one
+ * row in and one row out as y advances, then prefix-summed along the row,
+ * so each pixel costs the same whatever THRESHOLD_RADIUS is. A pixel is
+ * white when value - offset > sum / count, compared as a product.
+ */
+static int _local_rows(const image *blur, const threshold_map *map, bitimage *mask, int first, int end) {
+    int top = 2;
+    int bottom = blur->height - WORK_PAD;
+    int left = 2;
+    int right = blur->width - WORK_PAD;
+    int words = (mask->width + 63) / 64;
+    int span = words * 64;
+    unsigned char *grey = (unsigned char *) calloc((size_t) span, 1);
+    unsigned char *leaving = (unsigned char *) calloc((size_t) span, 1);
+    unsigned int *columns = (unsigned int *) calloc((size_t) span, sizeof(unsigned int));
+    // Prefix sums of the columns, from THRESHOLD_RADIUS before the row to THRESHOLD_RADIUS + 1 after it
+    unsigned int *prefix = (unsigned int *) malloc(((size_t) span + 2 * THRESHOLD_RADIUS + 2) * sizeof(unsigned int));
+    // Columns of the window around each pixel, 0 outside the counted pixels
+    short *across = (short *) malloc((size_t) span * sizeof(short));
+    if (grey == NULL || leaving == NULL || columns == NULL || prefix == NULL || across == NULL) {
+        free(grey);
+        free(leaving);
+        free(columns);
+        free(prefix);
+        free(across);
+        return -1;
+    }
+    unsigned int *sums = prefix + THRESHOLD_RADIUS;
+    for (int x = 0; x < span; x++) {
+        int lo = max(x - THRESHOLD_RADIUS, left);
+        int hi = min(x + THRESHOLD_RADIUS + 1, right);
+        across[x] = (short) (x >= left && x < right ? hi - lo : 0);
+    }
+    for (int k = -THRESHOLD_RADIUS; k <= 0; k++) {
+        sums[k] = 0;
+    }
+
+    //Window rows [window_top, window_bottom) are summed in columns
+    int window_top = 0;
+    int window_bottom = 0;
+    for (int y = first; y < end; y++) {
+        uint64_t *row = BITIMAGE_ROW(mask, y);
+        if (y < top || y >= bottom) {
+            memset(row, 0, (size_t) words * sizeof(uint64_t));
+            continue;
+        }
+        int want_top = max(y - THRESHOLD_RADIUS, top);
+        int want_bottom = min(y + THRESHOLD_RADIUS + 1, bottom);
+        if (window_bottom <= window_top || want_top >= window_bottom) {
+            memset(columns, 0, (size_t) span * sizeof(unsigned int));
+            window_top = want_top;
+            window_bottom = want_top;
+        }
+        //Moving down a row, the row leaving the window and the one entering it take one pass
+        for (; window_top < want_top && window_bottom < want_bottom; window_top++, window_bottom++) {
+            _copy_row(blur, window_top, leaving);
+            _copy_row(blur, window_bottom, grey);
+            for (int w = 0; w < words; w++) {
+                _slide_word(columns + w * 64, grey + w * 64, leaving + w * 64);
+            }
+        }
+        for (; window_top < want_top; window_top++) {
+            _copy_row(blur, window_top, grey);
+            for (int w = 0; w < words; w++) {
+                _subtract_word(columns + w * 64, grey + w * 64);
+            }
+        }
+        for (; window_bottom < want_bottom; window_bottom++) {
+            _copy_row(blur, window_bottom, grey);
+            for (int w = 0; w < words; w++) {
+                _add_word(columns + w * 64, grey + w * 64);
+            }
+        }
+        int rows = window_bottom - window_top;
+
+        _prefix_row(columns, sums, span);
+        for (int k = span + 1; k <= span + THRESHOLD_RADIUS + 1; k++) {
+            sums[k] = sums[span];
+        }
+
+        _copy_row(blur, y, grey);
+        for (int w = 0; w < words; w++) {
+            int x = w * 64;
+            row[w] = _window_word(grey + x, across + x, sums + x + THRESHOLD_RADIUS + 1, sums + x - THRESHOLD_RADIUS,
+                                  map->offset, rows);
+        }
+    }
+    free(grey);
+    free(leaving);
+    free(columns);
+    free(prefix);
+    free(across);
+    return 0;
+}
+
+/**
+ * \brief Thresholds rows [first, end) of a blurred image into a bit image, see black_white_rows().
+ *
+ * Every word of these rows is written, the guard words excepted, so bands
+ * of one image can be thresholded concurrently.
+ *
+ * \param blur The blurred working image.
+ * \param map Thresholds made by threshold_map_build() for this image.
+ * \param mask Bit image of the same size that receives the result.
+ * \param first First row.
+ * \param end One past the last row.
+ * \return 0 on success, -1 if the scratch rows could not be allocated.
+ */
+int threshold_rows(const image *blur, const threshold_map *map, bitimage *mask, int first, int end) {
+    switch (map->mode) {
+        case THRESHOLD_TILES:
+            return _tile_rows(blur, map, mask, first, end);
+        case THRESHOLD_LOCAL:
+            return _local_rows(blur, map, mask, first, end);
+        default:
+            black_white_rows(blur, map->global, mask, first, end);
+            return 0;
+    }
+}
+
+void threshold_map_free(threshold_map *map) {
+    free(map->summaries);
+    free(map->tiles);
+    map->summaries = NULL;
+    map->tiles = NULL;
+    map->capacity = 0;
+}
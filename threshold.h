@@ -0,0 +1,70 @@
+#ifndef THRESHOLD_THRESHOLD_H
+#define THRESHOLD_THRESHOLD_H
+
+#include "image.h"
+#include "bitimage.h"
+#include "pool.h"
+#include "function.h"
+
+// Side of the tiles of THRESHOLD_TILES, in pixels, a power of two
+#define THRESHOLD_TILE 64
+#define THRESHOLD_TILE_SHIFT 6
+// Pixels on each side of the window of THRESHOLD_LOCAL, at most 90 so a window's pixel count fits 16 bits
+#define THRESHOLD_RADIUS 32
+
+// How the blurred image is split into black and white
+typedef enum threshold_mode {
+    THRESHOLD_GLOBAL,   // one Otsu threshold for the whole image
+    THRESHOLD_TILES,    // Otsu threshold per tile, interpolated between the tile centres
+    THRESHOLD_LOCAL     // mean of the window around each pixel, shifted like the global threshold
+} threshold_mode;
+
+// What the threshold of a tile is chosen from, taken from its histogram as soon as it is counted
+typedef struct threshold_tile {
+    int otsu;               // Otsu threshold of the tile alone, or -1 if it has no counted pixel
+    int split;              // whether pixels lie on both sides of otsu
+    double separation;      // mean grey level above otsu minus the one at or below it, if split
+    double mean;            // mean grey level of the tile
+} threshold_tile;
+
+/**
+ * \brief The thresholds of one image, in a form that is expanded a row at a time.
+ *
+ * Both adaptive modes start from the global Otsu threshold and the mean
+ * grey level, so on an evenly lit image they stay close to the global
+ * threshold. The tile histograms are counted first, by the front end or
+ * by threshold_map_count(), and the buffers are kept between images like
+ * the other buffers of a pipeline.
+ *
+ * A map laid over a whole file can also threshold views of it, such as
+ * the tiles of tiles_detect_file(): left and top place the view in the
+ * file, so every pixel gets the threshold of its position in the file.
+ */
+typedef struct threshold_map {
+    threshold_mode mode;
+    int global;             // Otsu threshold of the whole image
+    int offset;             // global minus the mean grey level of the whole image
+    int columns;            // tiles across and down the counted area
+    int rows;
+    int left;               // position of the thresholded image in the one the tiles were laid over, or 0
+    int top;
+    threshold_tile *summaries; // what the threshold of each tile is chosen from, row by row
+    unsigned char *tiles;   // threshold of each tile, row by row
+    int capacity;
+} threshold_map;
+
+// Histogram banks of one tile while its row of tiles is counted: a tile
+// holds at most 4096 pixels, so 16 bits per bin keep a row of them in L1
+typedef unsigned short threshold_banks[OTSU_BANKS][256];
+
+const char *threshold_mode_name(threshold_mode mode);
+int threshold_map_fit(threshold_map *map, int width, int height);
+void threshold_band(const threshold_map *map, int height, int index, int count, int *first, int *end);
+void threshold_count_row(const threshold_map *map, const unsigned char *row, int width, threshold_banks *banks);
+void threshold_flush_row(threshold_map *map, int tile_row, threshold_banks *banks, int histogram[256]);
+int threshold_map_count(threshold_map *map, const image *blur, worker_pool *pool);
+void threshold_map_build(threshold_map *map, threshold_mode mode, int global, double mean);
+int threshold_rows(const image *blur, const threshold_map *map, bitimage *mask, int first, int end);
+void threshold_map_free(threshold_map *map);
+
+#endif // THRESHOLD_THRESHOLD_H
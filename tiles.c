@@ -0,0 +1,233 @@
+#include "tiles.h"
+#include "function.h"
+#include "minmax.h"
+#include "parallel.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * \brief Prepares an engine for tiles of size x size pixels with halo pixels around them.
+ *
+ * The detection mode can be set in engine->work.mode afterwards.
+ */
+void tiles_init(tile_engine *engine, int size, int halo) {
+    memset(engine, 0, sizeof(*engine));
+    engine->size = size;
+    engine->halo = halo;
+    pipeline_init(&engine->work);
+}
+
+/**
+ * \brief Smallest halo that gives the cells of an untiled run, see TILE_HALO_MIN.
+ *
+ * \param mode How the tiles will be thresholded.
+ * \return The halo in pixels.
+ */
+int tiles_min_halo(threshold_mode mode) {
+    return mode == THRESHOLD_LOCAL ? TILE_HALO_MIN + THRESHOLD_RADIUS : TILE_HALO_MIN;
+}
+
+/**
+ * \brief Whether a cell coordinate lies in the core of a column or row of tiles, or just outside it.
+ *
+ * Cores reach TILE_DUPLICATE pixels into their neighbours, so a cell the
+ * two tiles of a seam find a pixel apart on either side of it is still
+ * kept by one of them, and dropped as a duplicate by the other.
+ */
+static int _in_core(int position, int index, int size, int tiles) {
+    int first = index * size + WORK_PAD - TILE_DUPLICATE;
+    int end = (index + 1) * size + WORK_PAD + TILE_DUPLICATE;
+    return (index == 0 || position >= first) && (index == tiles - 1 || position < end);
+}
+
+static bmp_status _append(tile_engine *engine, cell found) {
+    if (engine->count == engine->capacity) {
+        int capacity = engine->capacity == 0 ? 1024 : 2 * engine->capacity;
+        cell *cells = (cell *) realloc(engine->cells, (size_t) capacity * sizeof(cell));
+        if (cells == NULL) {
+            return BMP_ERR_NOMEM;
+        }
+        engine->cells = cells;
+        engine->capacity = capacity;
+    }
+    engine->cells[engine->count++] = found;
+    return BMP_OK;
+}
+
+/**
+ * \brief Indexes the cells of the tiles before this one that lie inside its view.
+ *
+ * Tiles are done row by row, so those are the three tiles above and the
+ * one to the left. Positions in the index are relative to the view.
+ */
+static bmp_status _index_earlier(tile_engine *engine, int column, int row, int left, int top,
+                                 int width, int height) {
+    cell_list_free(&engine->seam);
+    if (cell_list_init(&engine->seam, width, height) != 0) {
+        return BMP_ERR_NOMEM;
+    }
+    int neighbours[4][2] = {{column - 1, row - 1}, {column, row - 1}, {column + 1, row - 1}, {column - 1, row}};
+    for (int n = 0; n < 4; n++) {
+        int c = neighbours[n][0];
+        int r = neighbours[n][1];
+        if (c < 0 || c >= engine->columns || r < 0) {
+            continue;
+        }
+        int tile = r * engine->columns + c;
+        for (int i = engine->tile_first[tile]; i < engine->tile_first[tile + 1]; i++) {
+            int x = engine->cells[i].x - left;
+            int y = engine->cells[i].y - top;
+            if (x < 0 || y < 0 || x >= width || y >= height) {
+                continue;
+            }
+            if (cell_list_add(&engine->seam, x, y) < 0) {
+                return BMP_ERR_NOMEM;
+            }
+        }
+    }
+    return BMP_OK;
+}
+
+/**
+ * \brief Keeps the cells of one tile that fall inside its core and were not found by an earlier tile.
+ */
+static bmp_status _keep(tile_engine *engine, int column, int row, int left, int top) {
+    const cell_list *found = &engine->work.cells;
+    for (int i = 0; i < found->count; i++) {
+        cell global = {found->cells[i].x + left, found->cells[i].y + top};
+        if (!_in_core(global.x, column, engine->size, engine->columns) ||
+            !_in_core(global.y, row, engine->size, engine->rows)) {
+            continue;
+        }
+        if (cell_list_near(&engine->seam, found->cells[i].x, found->cells[i].y, TILE_DUPLICATE) > 0) {
+            engine->duplicates++;
+            continue;
+        }
+        if (_append(engine, global) != BMP_OK) {
+            return BMP_ERR_NOMEM;
+        }
+    }
+    return BMP_OK;
+}
+
+/**
+ * \brief Detects the cells of an opened BMP file one tile at a time.
+ *
+ * A first pass streams the whole file through greyscale and blur for the
+ * global threshold (see parallel_file_threshold()), and with
+ * THRESHOLD_TILES for the histograms of tiles laid over the whole file, so
+ * the tile thresholds do not depend on where the file is cut. The second
+ * runs every tile with its halo through the pipeline at that threshold
+ * and those tile thresholds, reading the mapped file in place, and
+ * releases the file rows that no later tile reads. A cell is kept by the tile whose core holds its position, give
+ * or take TILE_DUPLICATE pixels, unless an earlier tile found a cell that
+ * close to it already. A halo below tiles_min_halo() is widened to it.
+ *
+ * \param engine The engine, whose cells are replaced by those of the file.
+ * \param file The opened BMP file.
+ * \param pool Threads each stage of a tile is split across, or NULL to run serially.
+ * \return BMP_OK, or BMP_ERR_NOMEM if the buffers of a tile could not be allocated.
+ */
+bmp_status tiles_detect_file(tile_engine *engine, const bmp_file *file, worker_pool *pool) {
+    int size = engine->size;
+    int halo = max(engine->halo, tiles_min_halo(engine->work.threshold_mode));
+    engine->count = 0;
+    engine->duplicates = 0;
+    engine->columns = (file->width + size - 1) / size;
+    engine->rows = (file->height + size - 1) / size;
+    int tiles = engine->columns * engine->rows;
+    int *tile_first = (int *) realloc(engine->tile_first, ((size_t) tiles + 1) * sizeof(int));
+    if (tile_first == NULL) {
+        return BMP_ERR_NOMEM;
+    }
+    engine->tile_first = tile_first;
+
+    threshold_map *map = NULL;
+    if (engine->work.threshold_mode == THRESHOLD_TILES) {
+        map = &engine->thresholds;
+        if (threshold_map_fit(map, file->width + WORK_PAD, file->height + WORK_PAD) != 0) {
+            return BMP_ERR_NOMEM;
+        }
+    }
+    engine->threshold = parallel_file_threshold(pool, file, map, &engine->work.fixed_mean);
+    if (engine->threshold < 0) {
+        return BMP_ERR_NOMEM;
+    }
+    engine->work.fixed_threshold = engine->threshold;
+    if (map != NULL) {
+        threshold_map_build(map, THRESHOLD_TILES, engine->threshold, engine->work.fixed_mean);
+    }
+    engine->work.fixed_map = map;
+
+    int released = 0;
+    for (int row = 0; row < engine->rows; row++) {
+        int top = max(row * size - halo, 0);
+        int bottom = min((row + 1) * size + halo, file->height);
+        // No tile from here on reads the rows above this band
+        bmp_release_rows(file, released, top);
+        released = max(released, top);
+        for (int column = 0; column < engine->columns; column++) {
+            int left = max(column * size - halo, 0);
+            int right = min((column + 1) * size + halo, file->width);
+            bmp_file view;
+            bmp_view(file, left, top, right - left, bottom - top, &view);
+            engine->thresholds.left = left;
+            engine->thresholds.top = top;
+            bmp_status status = pipeline_detect_file(&engine->work, &view, pool);
+            if (status == BMP_OK) {
+                status = _index_earlier(engine, column, row, left, top, right - left + WORK_PAD,
+                                        bottom - top + WORK_PAD);
+            }
+            engine->tile_first[row * engine->columns + column] = engine->count;
+            if (status == BMP_OK) {
+                status = _keep(engine, column, row, left, top);
+            }
+            engine->tile_first[row * engine->columns + column + 1] = engine->count;
+            if (status != BMP_OK) {
+                return status;
+            }
+        }
+    }
+    return BMP_OK;
+}
+
+/**
+ * \brief Detects the cells of a BMP file tile by tile, then writes it with the cells marked.
+ *
+ * The output is patched from the mapped input (see pipeline_mark()), so
+ * writing it costs memory for the markers only.
+ *
+ * \param engine The engine, whose cells are replaced by those of the file.
+ * \param input_path Path of the BMP file to read.
+ * \param output_path Where to write the input with the cells marked, or NULL.
+ * \param pool Threads each stage of a tile is split across, or NULL to run serially.
+ * \return BMP_OK, or the reason the file could not be read or written.
+ */
+bmp_status tiles_process(tile_engine *engine, const char *input_path, const char *output_path, worker_pool *pool) {
+    bmp_file file;
+    bmp_status status = pipeline_open(&engine->work, input_path, &file);
+    if (status != BMP_OK) {
+        return status;
+    }
+    status = tiles_detect_file(engine, &file, pool);
+    if (status == BMP_OK && output_path != NULL) {
+        status = pipeline_mark(&file, engine->cells, engine->count, &engine->work.marks);
+        if (status == BMP_OK) {
+            status = bmp_write_patched(&file, &engine->work.marks, output_path);
+        }
+    }
+    bmp_close(&file);
+    return status;
+}
+
+void tiles_free(tile_engine *engine) {
+    pipeline_free(&engine->work);
+    threshold_map_free(&engine->thresholds);
+    cell_list_free(&engine->seam);
+    free(engine->cells);
+    free(engine->tile_first);
+    engine->cells = NULL;
+    engine->tile_first = NULL;
+    engine->count = 0;
+    engine->capacity = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef TILES_TILES_H
+#define TILES_TILES_H
+
+#include "blur.h"
+#include "cbmp.h"
+#include "cells.h"
+#include "detect.h"
+#include "pipeline.h"
+#include "pool.h"
+
+// Side of the square tile cores, in pixels, unless another size is asked for
+#define TILE_SIZE 2048
+// Pixels read around every core: the blur, the 9x9 detection frame and the
+// erosion steps of cells a few dozen pixels across all fit well inside it
+#define TILE_HALO 128
+// Erosion steps a cell is followed through: each takes a pixel off every
+// side, so cells up to 64 pixels across are gone after it (the samples
+// take at most 17)
+#define TILE_EROSION_DEPTH 32
+// Smallest halo that keeps the cells of a tiled run those of an untiled
+// one: a cell found after the last erosion step depends on the pixels
+// this far around it, through the blur, the 9x9 frame and the steps.
+// THRESHOLD_LOCAL also reads THRESHOLD_RADIUS further, and with
+// DETECT_COMPONENTS a component wider than the halo is cut in two.
+#define TILE_HALO_MIN (BLUR_RADIUS + DETECT_HALO + TILE_EROSION_DEPTH)
+// A cell this close, along both axes, to a cell of an earlier tile is the same cell:
+// one image never gives two cells less than 2 pixels apart
+#define TILE_DUPLICATE 1
+
+/**
+ * \brief Detects the cells of BMP files too large to process as one image.
+ *
+ * The file is cut into cores of size x size pixels. Each core is run
+ * through the pipeline with halo pixels of its neighbours around it, and
+ * keeps only the cells that fall inside it, so memory follows the tile
+ * size while cells near the seams see the same pixels as in an untiled
+ * run. All tiles share one threshold, taken from the whole file first,
+ * and with THRESHOLD_TILES one map of tile thresholds laid over the file.
+ */
+typedef struct tile_engine {
+    int size;               // side of the tile cores
+    int halo;               // pixels around each core that are read too
+    pipeline work;          // buffers of one tile and its halo, reused for every tile
+    cell_list seam;         // cells of earlier tiles inside the current one, for finding duplicates
+    cell *cells;            // cells of the last file, tile by tile, in the coordinates of an untiled run
+    int count;
+    int capacity;
+    int *tile_first;        // per tile in row order, index of its first cell, then count
+    int columns;            // tiles across the last file
+    int rows;               // tiles down
+    int threshold;          // Otsu threshold of the whole file
+    threshold_map thresholds; // tile thresholds of the whole file, THRESHOLD_TILES only
+    int duplicates;         // cells dropped because an earlier tile had found them
+} tile_engine;
+
+void tiles_init(tile_engine *engine, int size, int halo);
+int tiles_min_halo(threshold_mode mode);
+bmp_status tiles_detect_file(tile_engine *engine, const bmp_file *file, worker_pool *pool);
+bmp_status tiles_process(tile_engine *engine, const char *input_path, const char *output_path, worker_pool *pool);
+void tiles_free(tile_engine *engine);
+
+#endif // TILES_TILES_H
@@ -0,0 +1,698 @@
+#include "verify.h"
+#include "batch.h"
+#include "blur.h"
+#include "detect.h"
+#include "distance.h"
+#include "erosion.h"
+#include "function.h"
+#include "minmax.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Seed of the synthetic cases, fixed so a failing case can be found again
+#define VERIFY_SEED UINT64_C(0x9E3779B97F4A7C15)
+
+// A blurred image fails if more than one pixel in this many is a level off the double kernel
+#define VERIFY_BLUR_SHARE 10
+
+// Kernels that are compared with their reference
+typedef enum verify_kernel {
+    VERIFY_GREYSCALE,
+    VERIFY_GAUSSIAN,
+    VERIFY_OTSU,
+    VERIFY_BLACK_WHITE,
+    VERIFY_ERODE,
+    VERIFY_DETECT,
+    VERIFY_PIPELINE,        // pipeline_detect() against the whole reference loop
+    VERIFY_DISTANCE,        // the distance transform mode against the same loop
+    VERIFY_KERNELS
+} verify_kernel;
+
+static const char *const kernel_names[VERIFY_KERNELS] = {
+    "greyscale", "gaussian_filter", "otsu_threshold", "black_white", "erode", "detectCell", "pipeline", "distance"
+};
+
+typedef struct verify_state {
+    worker_pool *pool;
+    pipeline work;
+    uint64_t random;                // xorshift state of the synthetic cases
+    long checks[VERIFY_KERNELS];    // comparisons made
+    int failures[VERIFY_KERNELS];   // cases that differed, the first of each is printed
+    long blur_off;                  // blurred pixels one level off the double kernel
+    long blur_pixels;               // blurred pixels compared
+} verify_state;
+
+static void _fail_memory(void) {
+    fprintf(stderr, "Failed to allocate memory for the verification.\n");
+    exit(1);
+}
+
+static void _alloc_image(image *img, int width, int height, int channels) {
+    if (image_alloc(img, width, height, channels) != 0) {
+        _fail_memory();
+    }
+}
+
+static void _alloc_bitimage(bitimage *img, int width, int height) {
+    if (bitimage_alloc(img, width, height) != 0) {
+        _fail_memory();
+    }
+}
+
+static void _init_cells(cell_list *cells, int width, int height) {
+    if (cell_list_init(cells, width, height) != 0) {
+        _fail_memory();
+    }
+}
+
+/**
+ * \brief Counts one comparison of a kernel, and reports it if it is the kernel's first difference.
+ *
+ * \return 1 if the results differ, so callers can stop that case.
+ */
+static int _check(verify_state *run, verify_kernel kernel, int differs, const char *name, const char *format, ...) {
+    run->checks[kernel]++;
+    if (!differs) {
+        return 0;
+    }
+    if (run->failures[kernel]++ == 0) {
+        va_list args;
+        va_start(args, format);
+        printf("%s: %s: ", kernel_names[kernel], name);
+        vprintf(format, args);
+        printf("\n");
+        va_end(args);
+    }
+    return 1;
+}
+
+static uint64_t _random(verify_state *run) {
+    run->random ^= run->random << 13;
+    run->random ^= run->random >> 7;
+    run->random ^= run->random << 17;
+    return run->random;
+}
+
+// Uniform in [low, high]
+static int _random_in(verify_state *run, int low, int high) {
+    return low + (int) (_random(run) % (uint64_t) (high - low + 1));
+}
+
+// Reference kernels: the straightforward pixel by pixel definitions the
+// optimized kernels must reproduce exactly, all but the blur, whose
+// fixed-point taps can only come within a level of the double kernel
+
+static void _reference_greyscale(const image *input, image *grey) {
+    for (int y = 0; y < input->height; y++) {
+        for (int x = 0; x < input->width; x++) {
+            const unsigned char *pixel = IMAGE_PIXEL(input, x, y);
+            IMAGE_AT(grey, x + WORK_PAD, y + WORK_PAD) = (unsigned char) ((pixel[0] + pixel[1] + pixel[2]) / 3);
+        }
+    }
+}
+
+/**
+ * \brief The original 5x5 Gaussian in double precision, truncated, out of place.
+ *
+ * Reads past the right and bottom edges are clamped, as they always were.
+ */
+static void _reference_gaussian(const image *input, image *output) {
+    double kernel[BLUR_TAPS][BLUR_TAPS];
+    create_gaussian_kernel(kernel, BLUR_TAPS, 1.65);
+    for (int y = BLUR_RADIUS; y < input->height; y++) {
+        for (int x = BLUR_RADIUS; x < input->width; x++) {
+            double sum = 0.0;
+            for (int i = -BLUR_RADIUS; i <= BLUR_RADIUS; i++) {
+                for (int j = -BLUR_RADIUS; j <= BLUR_RADIUS; j++) {
+                    int column = min(x + i, input->width - 1);
+                    int row = min(y + j, input->height - 1);
+                    sum += IMAGE_AT(input, column, row) * kernel[i + BLUR_RADIUS][j + BLUR_RADIUS];
+                }
+            }
+            IMAGE_AT(output, x, y) = (unsigned char) min(max((int) sum, 0), 255);
+        }
+    }
+}
+
+static int _reference_otsu(const image *input) {
+    int histogram[256] = {0};
+    for (int y = 2; y < input->height - WORK_PAD; y++) {
+        for (int x = 2; x < input->width - WORK_PAD; x++) {
+            histogram[IMAGE_AT(input, x, y)]++;
+        }
+    }
+    return otsu_from_histogram(histogram, (input->width - WORK_PAD) * (input->height - WORK_PAD));
+}
+
+// Gives a 0/1 mask, only pixels WORK_PAD away from the border can be white
+static void _reference_black_white(const image *input, int threshold, image *mask) {
+    for (int y = 0; y < input->height; y++) {
+        for (int x = 0; x < input->width; x++) {
+            int inside = x >= 2 && x < input->width - WORK_PAD && y >= 2 && y < input->height - WORK_PAD;
+            IMAGE_AT(mask, x, y) = (unsigned char) (inside && IMAGE_AT(input, x, y) > threshold);
+        }
+    }
+}
+
+/**
+ * \brief The original erosion: a white pixel turns black if any pixel of the structuring element is black.
+ *
+ * Runs in place in column order, reading only pixels that are still to come.
+ */
+static int _reference_erode(image *mask) {
+    static const int element[3][3] = {{0, 1, 0},
+                                      {1, 1, 1},
+                                      {1, 1, 0}};
+    int eroded = 1;
+    for (int x = 2; x < mask->width - WORK_PAD; x++) {
+        for (int y = 2; y < mask->height - WORK_PAD; y++) {
+            if (!IMAGE_AT(mask, x, y)) {
+                continue;
+            }
+            int black = 0;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    black |= element[i][j] && !IMAGE_AT(mask, x + i, y + j);
+                }
+            }
+            IMAGE_AT(mask, x, y) = (unsigned char) !black;
+            eroded &= black;
+        }
+    }
+    return eroded;
+}
+
+static int _reference_white(const image *mask, int x, int y) {
+    return x >= 0 && y >= 0 && x < mask->width && y < mask->height && IMAGE_AT(mask, x, y);
+}
+
+/**
+ * \brief The original detectCell: every position in column order, pixels outside the image black.
+ *
+ * A position can only register a cell if its capture area has a white
+ * pixel, so positions are skipped when the rows around them have none in
+ * the 7 columns of the capture area; that count is taken anew per column.
+ *
+ * \param window Room for one count per row.
+ */
+static void _reference_detect(image *mask, cell_list *cells, int *window) {
+    for (int x = 0; x < mask->width; x++) {
+        for (int y = 0; y < mask->height; y++) {
+            window[y] = 0;
+            for (int i = -3; i <= 3; i++) {
+                window[y] += _reference_white(mask, x + i, y);
+            }
+        }
+        for (int y = 0; y < mask->height; y++) {
+            int near = 0;
+            for (int j = max(y - 3, 0); j <= min(y + 3, mask->height - 1); j++) {
+                near += window[j];
+            }
+            if (near == 0) {
+                continue;
+            }
+            int frame_black = 1;
+            int inside_white = 0;
+            for (int i = -4; i <= 4; i++) {
+                for (int j = -4; j <= 4; j++) {
+                    int white = _reference_white(mask, x + i, y + j);
+                    if (i == -4 || i == 4 || j == -4 || j == 4) {
+                        frame_black &= !white;
+                    } else {
+                        inside_white |= white;
+                    }
+                }
+            }
+            if (!frame_black || !inside_white) {
+                continue;
+            }
+            if (cell_list_find(cells, x, y) < 0 && cell_list_add(cells, x, y) < 0) {
+                _fail_memory();
+            }
+            for (int i = -3; i <= 3; i++) {
+                for (int j = -3; j <= 3; j++) {
+                    if (_reference_white(mask, x + i, y + j)) {
+                        IMAGE_AT(mask, x + i, y + j) = 0;
+                        window[y + j]--;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Comparisons, each giving the first difference in row order
+
+// "step k: " for the steps of the erosion loop, nothing for step 0, before the loop
+static const char *_step(int step) {
+    static char text[32];
+    if (step == 0) {
+        return "";
+    }
+    snprintf(text, sizeof(text), "step %d: ", step);
+    return text;
+}
+
+static int _compare_images(verify_state *run, verify_kernel kernel, const char *name, const image *expected,
+                           const image *actual, int border) {
+    for (int y = border; y < expected->height; y++) {
+        for (int x = border; x < expected->width; x++) {
+            if (IMAGE_AT(expected, x, y) != IMAGE_AT(actual, x, y)) {
+                return _check(run, kernel, 1, name, "first difference at (%d, %d): reference %d, optimized %d",
+                              x, y, IMAGE_AT(expected, x, y), IMAGE_AT(actual, x, y));
+            }
+        }
+    }
+    return _check(run, kernel, 0, name, "");
+}
+
+/**
+ * \brief Compares the fixed-point blur with the double kernel it replaces.
+ *
+ * The two differ where the double sum lies within the rounding of the taps
+ * of a whole level, so a pixel may be one level off, but no further, and
+ * only on a small share of the pixels; a bias such as rounding instead of
+ * truncating moves about half of them.
+ */
+static int _compare_blur(verify_state *run, const char *name, const image *expected, const image *actual) {
+    long off = 0;
+    for (int y = BLUR_RADIUS; y < expected->height; y++) {
+        for (int x = BLUR_RADIUS; x < expected->width; x++) {
+            int difference = IMAGE_AT(actual, x, y) - IMAGE_AT(expected, x, y);
+            if (difference < -1 || difference > 1) {
+                return _check(run, VERIFY_GAUSSIAN, 1, name, "first difference at (%d, %d): reference %d, "
+                              "optimized %d", x, y, IMAGE_AT(expected, x, y), IMAGE_AT(actual, x, y));
+            }
+            off += difference != 0;
+        }
+    }
+    long pixels = (long) (expected->width - BLUR_RADIUS) * (expected->height - BLUR_RADIUS);
+    run->blur_off += off;
+    run->blur_pixels += pixels;
+    return _check(run, VERIFY_GAUSSIAN, off * VERIFY_BLUR_SHARE > pixels, name,
+                  "%ld of %ld pixels one level off the reference", off, pixels);
+}
+
+static int _compare_mask(verify_state *run, verify_kernel kernel, const char *name, int step, const image *expected,
+                         const bitimage *actual) {
+    for (int y = 0; y < expected->height; y++) {
+        for (int x = 0; x < expected->width; x++) {
+            int pixel = (int) BITIMAGE_GET(actual, x, y);
+            if (IMAGE_AT(expected, x, y) != pixel) {
+                return _check(run, kernel, 1, name, "%sfirst difference at (%d, %d): reference %d, optimized %d",
+                              _step(step), x, y, IMAGE_AT(expected, x, y), pixel);
+            }
+        }
+    }
+    return _check(run, kernel, 0, name, "");
+}
+
+static int _compare_cells(verify_state *run, verify_kernel kernel, const char *name, int step,
+                          const cell_list *expected, const cell_list *actual) {
+    for (int i = 0; i < max(expected->count, actual->count); i++) {
+        if (i >= expected->count) {
+            return _check(run, kernel, 1, name, "%scell %d: reference none, optimized (%d, %d)",
+                          _step(step), i, actual->cells[i].x, actual->cells[i].y);
+        }
+        if (i >= actual->count) {
+            return _check(run, kernel, 1, name, "%scell %d: reference (%d, %d), optimized none",
+                          _step(step), i, expected->cells[i].x, expected->cells[i].y);
+        }
+        if (expected->cells[i].x != actual->cells[i].x || expected->cells[i].y != actual->cells[i].y) {
+            return _check(run, kernel, 1, name, "%scell %d: reference (%d, %d), optimized (%d, %d)",
+                          _step(step), i, expected->cells[i].x, expected->cells[i].y,
+                          actual->cells[i].x, actual->cells[i].y);
+        }
+    }
+    return _check(run, kernel, 0, name, "");
+}
+
+static void _copy_bitimage(bitimage *dst, const bitimage *src) {
+    int words = (src->width + 63) / 64;
+    for (int y = 0; y < src->height; y++) {
+        memcpy(BITIMAGE_ROW(dst, y), BITIMAGE_ROW(src, y), (size_t) words * sizeof(uint64_t));
+    }
+}
+
+/**
+ * \brief Runs the erosion loop on a mask with the reference kernels and the optimized ones side by side.
+ *
+ * After every step the incremental erosion and erode() must give the
+ * reference mask, and after every detection the same new cells, in the
+ * same order, and the same mask. The fused pass of the pipeline runs the
+ * loop on its own copy and must match after every step too. The distance
+ * mode must find all the cells of the loop, in the same order.
+ *
+ * \param mask 0/1 mask, eroded by the reference loop.
+ * \param cells Receives the cells of the reference loop.
+ */
+static void _verify_mask(verify_state *run, const char *name, image *mask, cell_list *cells) {
+    int width = mask->width;
+    int height = mask->height;
+    bitimage bits, plain, fused;
+    erosion_state erosion, fusion;
+    cell_list found, joined;
+    image distance;
+    int *window = (int *) malloc((size_t) height * sizeof(int));
+    if (window == NULL) {
+        _fail_memory();
+    }
+    _alloc_bitimage(&bits, width, height);
+    _alloc_bitimage(&plain, width, height);
+    _alloc_bitimage(&fused, width, height);
+    _alloc_image(&distance, width, height, 1);
+    _init_cells(&found, width, height);
+    _init_cells(&joined, width, height);
+    bitimage_pack(mask, &bits);
+    _copy_bitimage(&fused, &bits);
+
+    // The distance mode works on the mask before any erosion
+    cell_list direct;
+    _init_cells(&direct, width, height);
+    _copy_bitimage(&plain, &bits);
+    if (distance_detect_cells(&plain, &distance, &direct) != 0) {
+        _fail_memory();
+    }
+
+    if (erosion_init(&erosion, &bits) != 0 || erosion_init(&fusion, &fused) != 0) {
+        _fail_memory();
+    }
+    int complete = 0;
+    for (int step = 1;; step++) {
+        _copy_bitimage(&plain, &bits);
+        int reference_done = _reference_erode(mask);
+        int done = parallel_erosion_step(run->pool, &erosion);
+        int plain_done = erode(&plain, &plain);
+        int joined_previous = joined.count;
+        if (done < 0 || erode_detect_cells(&fusion, &joined, run->pool) < 0) {
+            _fail_memory();
+        }
+        int fused_done = fusion.white == 0;
+        if (_compare_mask(run, VERIFY_ERODE, name, step, mask, &bits) ||
+            _compare_mask(run, VERIFY_ERODE, name, step, mask, &plain) ||
+            _check(run, VERIFY_ERODE, reference_done != done || reference_done != plain_done, name,
+                   "step %d: reference %s, optimized %s", step, reference_done ? "done" : "not done",
+                   done ? "done" : "not done") ||
+            _check(run, VERIFY_ERODE, reference_done != fused_done, name, "step %d: reference %s, fused %s", step,
+                   reference_done ? "done" : "not done", fused_done ? "done" : "not done")) {
+            break;
+        }
+        if (reference_done) {
+            complete = 1;
+            break;
+        }
+
+        int previous = found.count;
+        _reference_detect(mask, cells, window);
+        if (detect_cells(&bits, &found, run->pool) < 0) {
+            _fail_memory();
+        }
+        for (int i = previous; i < found.count; i++) {
+            erosion_mark(&erosion, found.cells[i].x - 3, found.cells[i].y - 3, 7, 7);
+        }
+        for (int i = joined_previous; i < joined.count; i++) {
+            erosion_mark(&fusion, joined.cells[i].x - 3, joined.cells[i].y - 3, 7, 7);
+        }
+        if (_compare_cells(run, VERIFY_DETECT, name, step, cells, &found) ||
+            _compare_mask(run, VERIFY_DETECT, name, step, mask, &bits) ||
+            _compare_cells(run, VERIFY_DETECT, name, step, cells, &joined) ||
+            _compare_mask(run, VERIFY_DETECT, name, step, mask, &fused)) {
+            break;
+        }
+    }
+    // Only a loop that ran to the end gives all the cells to compare with
+    if (complete) {
+        _compare_cells(run, VERIFY_DISTANCE, name, 0, cells, &direct);
+    }
+
+    erosion_free(&erosion);
+    erosion_free(&fusion);
+    cell_list_free(&direct);
+    cell_list_free(&found);
+    cell_list_free(&joined);
+    image_free(&distance);
+    bitimage_free(&plain);
+    bitimage_free(&fused);
+    bitimage_free(&bits);
+    free(window);
+}
+
+/**
+ * \brief Runs an RGB image through the reference stages and compares every optimized stage on the way.
+ *
+ * Each optimized stage gets the reference result of the stage before, so
+ * a difference shows up in the first kernel that causes it. The blur is
+ * the exception: the stages after it get the optimized blur, which only
+ * comes within a level of the double kernel. The whole
+ * pipeline, which also takes isolated components out of the loop, is
+ * compared on the cells at the end.
+ *
+ * \param input The decoded image.
+ * \param file The opened file it came from, to check the streamed front end too, or NULL.
+ */
+static void _verify_image(verify_state *run, const char *name, const image *input, const bmp_file *file) {
+    int width = input->width + WORK_PAD;
+    int height = input->height + WORK_PAD;
+    image grey, blurred, mask, actual;
+    bitimage bits;
+    _alloc_image(&grey, width, height, 1);
+    _alloc_image(&blurred, width, height, 1);
+    _alloc_image(&mask, width, height, 1);
+    _alloc_image(&actual, width, height, 1);
+    _alloc_bitimage(&bits, width, height);
+
+    _reference_greyscale(input, &grey);
+    parallel_greyscale(run->pool, input, &actual);
+    _compare_images(run, VERIFY_GREYSCALE, name, &grey, &actual, 0);
+    if (file != NULL) {
+        for (int y = 0; y < height; y++) {
+            greyscale_work_row(file, y, &IMAGE_AT(&actual, 0, y));
+        }
+        _compare_images(run, VERIFY_GREYSCALE, name, &grey, &actual, 0);
+    }
+
+    _reference_gaussian(&grey, &blurred);
+    if (parallel_gaussian_filter(run->pool, &grey, &actual) != 0) {
+        _fail_memory();
+    }
+    _compare_blur(run, name, &blurred, &actual);
+    // The later stages start from the blur the program computes, so they can match exactly
+    image swap = blurred;
+    blurred = actual;
+    actual = swap;
+    int threshold = _reference_otsu(&blurred);
+    int counted = parallel_otsu_threshold(run->pool, &blurred, NULL);
+    if (counted < 0) {
+        _fail_memory();
+    }
+    _check(run, VERIFY_OTSU, counted != threshold, name, "reference %d, optimized %d", threshold, counted);
+    if (file != NULL) {
+        // Greyscale, blur and histogram fused over the file rows
+        int streamed = parallel_front_end(run->pool, file, &actual, NULL, NULL);
+        if (streamed < 0) {
+            _fail_memory();
+        }
+        _compare_images(run, VERIFY_GAUSSIAN, name, &blurred, &actual, BLUR_RADIUS);
+        _check(run, VERIFY_OTSU, streamed != threshold, name, "streamed: reference %d, optimized %d",
+               threshold, streamed);
+        // The histogram reduced from tile histograms instead, as for --threshold tiles
+        threshold_map tiles = {0};
+        if (threshold_map_fit(&tiles, width, height) != 0) {
+            _fail_memory();
+        }
+        int tiled = parallel_front_end(run->pool, file, &actual, &tiles, NULL);
+        if (tiled < 0) {
+            _fail_memory();
+        }
+        _check(run, VERIFY_OTSU, tiled != threshold, name, "tile histograms: reference %d, optimized %d",
+               threshold, tiled);
+        threshold_map_free(&tiles);
+    }
+
+    _reference_black_white(&blurred, threshold, &mask);
+    parallel_black_white(run->pool, &blurred, threshold, &bits);
+    _compare_mask(run, VERIFY_BLACK_WHITE, name, 0, &mask, &bits);
+
+    cell_list cells;
+    _init_cells(&cells, width, height);
+    _verify_mask(run, name, &mask, &cells);
+    run->work.mode = DETECT_EROSION;
+    bmp_status status = file != NULL ? pipeline_detect_file(&run->work, file, run->pool)
+                                     : pipeline_detect(&run->work, input, run->pool);
+    if (status != BMP_OK) {
+        fprintf(stderr, "%s: %s\n", name, bmp_strerror(status));
+        exit(1);
+    }
+    _compare_cells(run, VERIFY_PIPELINE, name, 0, &cells, &run->work.cells);
+
+    cell_list_free(&cells);
+    bitimage_free(&bits);
+    image_free(&actual);
+    image_free(&mask);
+    image_free(&blurred);
+    image_free(&grey);
+}
+
+// Draws a filled disc of a value into a single-channel image
+static void _disc(image *img, int cx, int cy, int radius, unsigned char value) {
+    for (int y = max(cy - radius, 0); y <= min(cy + radius, img->height - 1); y++) {
+        for (int x = max(cx - radius, 0); x <= min(cx + radius, img->width - 1); x++) {
+            if ((x - cx) * (x - cx) + (y - cy) * (y - cy) <= radius * radius) {
+                IMAGE_AT(img, x, y) = value;
+            }
+        }
+    }
+}
+
+/**
+ * \brief A random image of round cells and specks on a noisy background.
+ */
+static void _synthetic_image(verify_state *run, image *rgb) {
+    int width = _random_in(run, 16, 320);
+    int height = _random_in(run, 16, 320);
+    image grey;
+    _alloc_image(&grey, width, height, 1);
+    _alloc_image(rgb, width, height, BMP_CHANNELS);
+    int background = _random_in(run, 0, 120);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            IMAGE_AT(&grey, x, y) = (unsigned char) min(background + _random_in(run, 0, 40), 255);
+        }
+    }
+    int count = _random_in(run, 0, width * height / 400 + 1);
+    for (int i = 0; i < count; i++) {
+        int radius = _random_in(run, 0, 3) == 0 ? _random_in(run, 1, 3) : _random_in(run, 3, 12);
+        _disc(&grey, _random_in(run, 0, width - 1), _random_in(run, 0, height - 1), radius,
+              (unsigned char) _random_in(run, 150, 255));
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char *pixel = IMAGE_PIXEL(rgb, x, y);
+            for (int c = 0; c < BMP_CHANNELS; c++) {
+                pixel[c] = (unsigned char) max(IMAGE_AT(&grey, x, y) - _random_in(run, 0, 8), 0);
+            }
+        }
+    }
+    image_free(&grey);
+}
+
+/**
+ * \brief A random 0/1 mask of overlapping discs and single white pixels.
+ */
+static void _synthetic_mask(verify_state *run, image *mask) {
+    int width = _random_in(run, 24, 320);
+    int height = _random_in(run, 24, 320);
+    _alloc_image(mask, width, height, 1);
+    image inner;
+    image_wrap(&inner, &IMAGE_AT(mask, WORK_PAD, WORK_PAD), width - 2 * WORK_PAD, height - 2 * WORK_PAD, 1,
+               mask->stride);
+    int count = _random_in(run, 1, width * height / 300 + 1);
+    for (int i = 0; i < count; i++) {
+        _disc(&inner, _random_in(run, 0, inner.width - 1), _random_in(run, 0, inner.height - 1),
+              _random_in(run, 1, 10), 1);
+    }
+    int specks = _random_in(run, 0, width * height / 100);
+    for (int i = 0; i < specks; i++) {
+        IMAGE_AT(&inner, _random_in(run, 0, inner.width - 1), _random_in(run, 0, inner.height - 1)) = 1;
+    }
+}
+
+/**
+ * \brief Checks the optimized kernels against the reference kernels.
+ *
+ * Every image of the inputs, and the given number of seeded synthetic
+ * cases, go through greyscale, gaussian_filter, otsu_threshold,
+ * black_white and the erosion and detection loop twice: once with the
+ * plain pixel by pixel kernels kept here as the oracle, once with the
+ * kernels the program runs, on the given threads. The blur is checked
+ * against the double kernel of the original program and may be a level
+ * off on under 1 pixel in VERIFY_BLUR_SHARE. Half of the synthetic
+ * cases are random images, half random masks that go straight into the
+ * loop. The first difference of each kernel is printed with its
+ * position, then a summary line per kernel.
+ *
+ * \param inputs BMP files and directories, or NULL to take the four levels under samples/.
+ * \param count Number of inputs.
+ * \param cases Number of synthetic cases.
+ * \param threads Threads the optimized kernels run on.
+ * \return 0 if no kernel differed, 1 otherwise.
+ */
+int verify_run(char **inputs, int count, int cases, int threads) {
+    if (inputs == NULL) {
+        inputs = (char **) batch_samples;
+        count = BATCH_SAMPLES;
+    }
+    batch_paths list = {NULL, 0, 0};
+    for (int i = 0; i < count; i++) {
+        if (batch_collect(&list, inputs[i]) != 0) {
+            fprintf(stderr, "Cannot read %s\n", inputs[i]);
+            return 1;
+        }
+    }
+
+    verify_state state;
+    memset(&state, 0, sizeof(state));
+    worker_pool pool;
+    if (pool_init(&pool, threads) != 0) {
+        fprintf(stderr, "Failed to start %d threads.\n", threads);
+        exit(1);
+    }
+    state.pool = &pool;
+    state.random = VERIFY_SEED;
+    pipeline_init(&state.work);
+
+    for (int i = 0; i < list.count; i++) {
+        bmp_file file;
+        image input;
+        bmp_status status = bmp_open(list.paths[i], &file);
+        if (status != BMP_OK) {
+            fprintf(stderr, "%s: %s\n", list.paths[i], bmp_strerror(status));
+            return 1;
+        }
+        _alloc_image(&input, file.width, file.height, BMP_CHANNELS);
+        bmp_decode(&file, &input);
+        _verify_image(&state, list.paths[i], &input, &file);
+        image_free(&input);
+        bmp_close(&file);
+    }
+    for (int i = 0; i < cases; i++) {
+        char name[32];
+        image input;
+        cell_list cells;
+        snprintf(name, sizeof(name), "synthetic case %d", i);
+        if (i % 2 == 0) {
+            _synthetic_image(&state, &input);
+            _verify_image(&state, name, &input, NULL);
+        } else {
+            _synthetic_mask(&state, &input);
+            _init_cells(&cells, input.width, input.height);
+            _verify_mask(&state, name, &input, &cells);
+            cell_list_free(&cells);
+        }
+        image_free(&input);
+    }
+
+    int failed = 0;
+    for (int k = 0; k < VERIFY_KERNELS; k++) {
+        if (state.failures[k] == 0 && k == VERIFY_GAUSSIAN) {
+            printf("%-16s %8ld checks, %.2f%% of pixels one level off\n", kernel_names[k], state.checks[k],
+                   state.blur_pixels > 0 ? 100.0 * (double) state.blur_off / (double) state.blur_pixels : 0.0);
+        } else if (state.failures[k] == 0) {
+            printf("%-16s %8ld checks, identical\n", kernel_names[k], state.checks[k]);
+        } else {
+            printf("%-16s %8ld checks, %d cases differ\n", kernel_names[k], state.checks[k], state.failures[k]);
+            failed = 1;
+        }
+    }
+    printf("%d image%s and %d synthetic case%s on %d thread%s\n", list.count, list.count == 1 ? "" : "s", cases,
+           cases == 1 ? "" : "s", threads, threads == 1 ? "" : "s");
+
+    pipeline_free(&state.work);
+    pool_free(&pool);
+    batch_paths_free(&list);
+    return failed;
+}
@@ -0,0 +1,6 @@
+#ifndef VERIFY_VERIFY_H
+#define VERIFY_VERIFY_H
+
+int verify_run(char **inputs, int count, int cases, int threads);
+
+#endif // VERIFY_VERIFY_H